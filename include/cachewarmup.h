@@ -0,0 +1 @@
+#include "../src/lib/cachewarmup.h"
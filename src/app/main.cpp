@@ -4,13 +4,18 @@
 
 #include <board/abstractboard.h>
 #include <cache.h>
+#include <cachewarmup.h>
 #include <captcha/abstractcaptchaengine.h>
 #include <database.h>
+#include <markup.h>
 #include <ololordapplication.h>
+#include <requestcontext.h>
 #include <search.h>
+#include <searchanalyzer.h>
 #include <settingslocker.h>
 #include <stored/RegisteredUser>
 #include <tools.h>
+#include <transaction.h>
 
 #include <BApplicationServer>
 #include <BCoreApplication>
@@ -23,10 +28,13 @@
 #include <BTextTools>
 #include <BTranslation>
 
+#include <QByteArray>
 #include <QCryptographicHash>
+#include <QDataStream>
 #include <QDateTime>
 #include <QDebug>
 #include <QDir>
+#include <QElapsedTimer>
 #include <QRegExp>
 #include <QSettings>
 #include <QString>
@@ -45,17 +53,22 @@ static const QString LogFileDateTimeFormat = "yyyy.MM.dd-hh.mm.ss";
 static bool checkParsingError(BTextTools::OptionsParsingError error, const QString &errorData);
 static bool handleBanPoster(const QString &cmd, const QStringList &args);
 static bool handleBanUser(const QString &cmd, const QStringList &args);
+static bool handleBenchmarkAnalyzer(const QString &cmd, const QStringList &args);
 static bool handleCache(const QString &cmd, const QStringList &args);
+static bool handleCacheStats(const QString &cmd, const QStringList &args);
 static bool handleClearCache(const QString &cmd, const QStringList &args);
 static bool handleCloseThread(const QString &cmd, const QStringList &args);
 static bool handleDeletePost(const QString &cmd, const QStringList &args);
 static bool handleFixThread(const QString &cmd, const QStringList &args);
+static bool handleMarkupCorpus(const QString &cmd, const QStringList &args);
 static bool handleNewLog(const QString &cmd, const QStringList &args);
 static bool handleOpenThread(const QString &cmd, const QStringList &args);
 static bool handleRebuildPostIndex(const QString &cmd, const QStringList &args);
 static bool handleRegisterUser(const QString &cmd, const QStringList &args);
 static bool handleReloadBoards(const QString &cmd, const QStringList &args);
 static bool handleReloadCaptchaEngines(const QString &cmd, const QStringList &args);
+static bool handleReloadIpBans(const QString &cmd, const QStringList &args);
+static bool handleRequestContextStats(const QString &cmd, const QStringList &args);
 static bool handleRerenderPosts(const QString &cmd, const QStringList &args);
 static bool handleSet(const QString &cmd, const QStringList &args);
 static bool handleShowPoster(const QString &cmd, const QStringList &args);
@@ -70,6 +83,7 @@ static bool setDefaultThreadPassword(const BSettingsNode *node, const QVariant &
 static bool setLoggingMode(const BSettingsNode *, const QVariant &v);
 static bool setLoggingSkipIp(const BSettingsNode *node, const QVariant &value);
 static bool setMaxCacheSize(const BSettingsNode *node, const QVariant &value);
+static bool setMemoryBudget(const BSettingsNode *node, const QVariant &value);
 static bool showDefaultThreadPassword(const BSettingsNode *node, const QVariant &value);
 static void updateLoggingMode();
 
@@ -98,7 +112,7 @@ int main(int argc, char **argv)
         AbstractCaptchaEngine::reloadEngines();
         AbstractBoard::reloadBoards();
         AbstractBoard::restoreCaptchaQuota(BDirTools::readFile(Tools::captchaQuotaFile()));
-        Search::restoreIndex(BDirTools::readFile(Tools::searchIndexFile()));
+        Search::restoreIndex();
         bLogger->setDateTimeFormat(LogDateTimeFormat);
         bLogger->setFileName(logFileName());
         updateLoggingMode();
@@ -116,16 +130,24 @@ int main(int argc, char **argv)
         }
         Database::createSchema();
         Database::checkOutdatedEntries();
+        Database::reloadRegisteredUsers();
         Database::generateRss();
+        Search::upgradeIndex();
         OlolordWebAppThread owt(conf);
         owt.start();
+        CacheWarmUp::restoreHotKeys(BDirTools::readFile(Tools::cacheHotKeysFile()));
         ret = app.exec();
         owt.shutdown();
         owt.wait(10 * BeQt::Second);
+        Database::stopBanExpiry();
+        CacheWarmUp::stop();
         BDirTools::writeFile(Tools::captchaQuotaFile(), AbstractBoard::saveCaptchaQuota());
-        BDirTools::writeFile(Tools::searchIndexFile(), Search::saveIndex());
+        Search::saveIndex();
+        Search::closeIndex();
+        BDirTools::writeFile(Tools::cacheHotKeysFile(), CacheWarmUp::saveHotKeys());
         foreach (const QString &name, Cache::availableCacheNames())
             Cache::clearCache(name);
+        Transaction::closeConnections();
     } else {
         bWriteLine(translate("main", "Another instance of") + " "  + AppName + " "
                    + translate("main", "is already running. Quitting..."));
@@ -292,6 +314,58 @@ bool handleBanUser(const QString &, const QStringList &args)
     return true;
 }
 
+bool handleBenchmarkAnalyzer(const QString &, const QStringList &args)
+{
+    if (args.size() > 1) {
+        bWriteLine(translate("handleBenchmarkAnalyzer", "Invalid argument count"));
+        return false;
+    }
+    int count = 0;
+    if (!args.isEmpty()) {
+        bool ok = false;
+        count = args.first().toInt(&ok);
+        if (!ok || count <= 0) {
+            bWriteLine(translate("handleBenchmarkAnalyzer", "Invalid post count"));
+            return false;
+        }
+    }
+    bool ok = false;
+    QString err;
+    Search::DocumentList documents = Database::searchDocuments(&ok, &err);
+    if (!ok) {
+        bWriteLine(translate("handleBenchmarkAnalyzer", "Error:") + " " + err);
+        return false;
+    }
+    if (count > 0 && count < documents.size())
+        documents = documents.mid(0, count);
+    qint64 bytes = 0;
+    foreach (const Search::Document &d, documents)
+        bytes += d.text.toUtf8().size();
+    const Search::Analyzer &a = Search::Analyzer::defaultAnalyzer();
+    QElapsedTimer timer;
+    timer.start();
+    qint64 tokens = 0;
+    foreach (const Search::Document &d, documents)
+        tokens += a.tokenize(d.text).size();
+    qint64 tokenizeTime = qMax(timer.restart(), qint64(1));
+    qint64 terms = 0;
+    foreach (const Search::Document &d, documents)
+        terms += a.analyze(d.text).size();
+    qint64 analyzeTime = qMax(timer.elapsed(), qint64(1));
+    double mb = double(bytes) / double(BeQt::Megabyte);
+    QString ts = translate("handleBenchmarkAnalyzer", "Posts: %1, text: %2 MB");
+    bWriteLine(ts.arg(documents.size()).arg(mb, 0, 'f', 2));
+    ts = translate("handleBenchmarkAnalyzer", "%1: %2 ms, %3 MB/s, %4 tokens (%5 tokens/s)");
+    bWriteLine(ts.arg(translate("handleBenchmarkAnalyzer", "Tokenizer")).arg(tokenizeTime)
+               .arg(1000.0 * mb / double(tokenizeTime), 0, 'f', 2).arg(tokens)
+               .arg(1000 * tokens / tokenizeTime));
+    bWriteLine(ts.arg(translate("handleBenchmarkAnalyzer", "Analyzer")).arg(analyzeTime)
+               .arg(1000.0 * mb / double(analyzeTime), 0, 'f', 2).arg(terms)
+               .arg(1000 * terms / analyzeTime));
+    bWriteLine(translate("handleBenchmarkAnalyzer", "Analyzer signature:") + " " + a.signature());
+    return true;
+}
+
 static bool handleCache(const QString &, const QStringList &args)
 {
     if (args.size() > 1) {
@@ -358,6 +432,46 @@ static bool handleCache(const QString &, const QStringList &args)
     return true;
 }
 
+static bool handleCacheStats(const QString &, const QStringList &args)
+{
+    if (args.size() > 1) {
+        bWriteLine(translate("handleCacheStats", "Invalid argument count"));
+        return false;
+    }
+    Cache::StatisticsList list;
+    if (args.size()) {
+        bool ok = false;
+        Cache::Statistics s = Cache::statistics(args.first(), &ok);
+        if (!ok) {
+            bWriteLine(translate("handleCacheStats", "No such cache"));
+            return false;
+        }
+        list << s;
+    } else {
+        list = Cache::statistics();
+    }
+    foreach (const Cache::Statistics &s, list) {
+        quint64 lookups = s.hits + s.misses;
+        double ratio = lookups ? (100.0 * double(s.hits) / double(lookups)) : 0.0;
+        QString ts = translate("handleCacheStats", "hits: %1, misses: %2 (hit ratio: %3%), inserts: %4, "
+                               "evictions: %5, entries: %6, cost: %7 of %8, bytes: %9");
+        ts = ts.arg(s.hits).arg(s.misses).arg(ratio, 0, 'f', 1).arg(s.inserts).arg(s.evictions).arg(s.count);
+        ts = ts.arg(s.cost).arg(s.maxCost).arg(s.bytes);
+        bWriteLine(s.name + ": " + ts);
+    }
+    if (!args.size()) {
+        QString ts = translate("handleCacheStats", "Total: %1 bytes (budget: %2 MB)");
+        bWriteLine(ts.arg(Cache::memoryUsage()).arg(Cache::memoryBudget()));
+        CacheWarmUp::Progress p = CacheWarmUp::progress();
+        if (p.total > 0) {
+            ts = p.running ? translate("handleCacheStats", "Warm-up: %1 of %2 threads (failed: %3), running")
+                           : translate("handleCacheStats", "Warm-up: %1 of %2 threads (failed: %3), finished");
+            bWriteLine(ts.arg(p.done).arg(p.total).arg(p.failed));
+        }
+    }
+    return true;
+}
+
 static bool handleClearCache(const QString &, const QStringList &args)
 {
     if (args.size() > 1) {
@@ -462,6 +576,84 @@ bool handleFixThread(const QString &, const QStringList &args)
     return true;
 }
 
+bool handleMarkupCorpus(const QString &, const QStringList &args)
+{
+    if (args.size() != 2 || (args.first() != "record" && args.first() != "check")) {
+        bWriteLine(translate("handleMarkupCorpus", "Invalid arguments"));
+        return false;
+    }
+    QString fn = BDirTools::findResource("res/markup_corpus.txt", BDirTools::GlobalOnly);
+    QStringList lines = BDirTools::readTextFile(fn, "UTF-8").split('\n');
+    QStringList names;
+    QStringList outputs;
+    QStringList texts;
+    QList<Markup::MarkupLanguage> languages;
+    foreach (const QString &line, lines) {
+        if (!line.startsWith("@@ ")) {
+            if (!texts.isEmpty())
+                texts.last() += (texts.last().isEmpty() ? "" : "\n") + line;
+            continue;
+        }
+        QStringList sl = line.mid(3).split(' ', QString::SkipEmptyParts);
+        QString lang = !sl.isEmpty() ? sl.takeFirst() : QString();
+        if ("wakaba" == lang)
+            languages << Markup::ExtendedWakabaMarkLanguage;
+        else if ("bbcode" == lang)
+            languages << Markup::BBCodeLanguage;
+        else if ("none" == lang)
+            languages << Markup::NoLanguage;
+        else
+            languages << Markup::AllLanguages;
+        names << sl.join(" ");
+        texts << QString();
+    }
+    if (texts.isEmpty()) {
+        bWriteLine(translate("handleMarkupCorpus", "Failed to read the corpus"));
+        return false;
+    }
+    foreach (int i, bRangeD(0, texts.size() - 1))
+        outputs << Markup::processPostText(texts.at(i), "", 0, 0, languages.at(i));
+    if (args.first() == "record") {
+        QByteArray data;
+        QDataStream out(&data, QIODevice::WriteOnly);
+        out.setVersion(BeQt::DataStreamVersion);
+        out << outputs;
+        if (!BDirTools::writeFile(args.last(), data)) {
+            bWriteLine(translate("handleMarkupCorpus", "Failed to write file"));
+            return false;
+        }
+        bWriteLine(translate("handleMarkupCorpus", "Recorded %1 cases").arg(outputs.size()));
+        return true;
+    }
+    bool ok = false;
+    QByteArray data = BDirTools::readFile(args.last(), -1, &ok);
+    if (!ok) {
+        bWriteLine(translate("handleMarkupCorpus", "Failed to read file"));
+        return false;
+    }
+    QDataStream in(data);
+    in.setVersion(BeQt::DataStreamVersion);
+    QStringList expected;
+    in >> expected;
+    if (expected.size() != outputs.size()) {
+        bWriteLine(translate("handleMarkupCorpus", "Case count mismatch: %1 expected, %2 found")
+                   .arg(expected.size()).arg(outputs.size()));
+        return false;
+    }
+    int failed = 0;
+    foreach (int i, bRangeD(0, outputs.size() - 1)) {
+        if (outputs.at(i) == expected.at(i))
+            continue;
+        ++failed;
+        bWriteLine(translate("handleMarkupCorpus", "Mismatch:") + " " + names.at(i));
+        bWriteLine("  - " + expected.at(i));
+        bWriteLine("  + " + outputs.at(i));
+    }
+    bWriteLine(translate("handleMarkupCorpus", "%1 of %2 cases match").arg(outputs.size() - failed)
+               .arg(outputs.size()));
+    return !failed;
+}
+
 bool handleNewLog(const QString &, const QStringList &)
 {
     QString s = bReadLine(translate("handleNewLog", "Are you sure?") + " [Yn] ");
@@ -567,6 +759,28 @@ bool handleReloadCaptchaEngines(const QString &, const QStringList &)
     return true;
 }
 
+bool handleReloadIpBans(const QString &, const QStringList &)
+{
+    int count = Tools::reloadIpBans();
+    bWriteLine(translate("handleReloadIpBans", "IP ranges loaded:") + " " + QString::number(count));
+    return true;
+}
+
+bool handleRequestContextStats(const QString &, const QStringList &)
+{
+    RequestContext::Statistics s = RequestContext::statistics();
+    bWriteLine(translate("handleRequestContextStats", "Requests:") + " " + QString::number(s.requests));
+    foreach (int i, bRangeD(0, RequestContext::ValueCount - 1)) {
+        QString name = RequestContext::valueName(RequestContext::Value(i));
+        bWriteLine(name + ": " + translate("handleRequestContextStats", "computed") + " "
+                   + QString::number(s.computed[i]) + ", " + translate("handleRequestContextStats", "reused") + " "
+                   + QString::number(s.hits[i]) + ", "
+                   + translate("handleRequestContextStats", "max computed per request") + " "
+                   + QString::number(s.maxComputed[i]));
+    }
+    return true;
+}
+
 bool handleRerenderPosts(const QString &, const QStringList &args)
 {
     QString s = bReadLine(translate("handleRerenderPosts", "This operation is REALLY heavey and may take a long time. "
@@ -656,6 +870,17 @@ bool handleUptime(const QString &, const QStringList &)
         return false;
     }
     bWriteLine(translate("handleUptime", "Uptime:") + " " + msecsToString(oApp->uptime()));
+    Transaction::ConnectionPoolInfo info = Transaction::connectionPoolInfo();
+    bWriteLine(translate("handleUptime", "Database connections opened:") + " "
+               + QString::number(info.connectionCount));
+    bWriteLine(translate("handleUptime", "Database transactions started:") + " "
+               + QString::number(info.transactionCount));
+    if (info.walEnabled) {
+        bWriteLine(translate("handleUptime", "Read-only database connections opened:") + " "
+                   + QString::number(info.readOnlyConnectionCount));
+        bWriteLine(translate("handleUptime", "Read-only database transactions started:") + " "
+                   + QString::number(info.readOnlyTransactionCount));
+    }
     return true;
 }
 
@@ -747,6 +972,13 @@ void initCommands()
         "Make a thread <thread-number> at <board> not fixed (regular thread).");
     BTerminal::setCommandHelp("unfix-thread", ch);
     //
+    BTerminal::installHandler("benchmark-analyzer", &handleBenchmarkAnalyzer);
+    ch.usage = "benchmark-analyzer [post-count]";
+    ch.description = BTranslation::translate("initCommands", "Measure search tokenizer and analyzer throughput over "
+                                             "the texts of all posts.\n"
+                                             "If [post-count] is specified, only that many posts are used.");
+    BTerminal::setCommandHelp("benchmark-analyzer", ch);
+    //
     BTerminal::installHandler("cache", &handleCache);
     ch.usage = "cache [cache-name]";
     ch.description = BTranslation::translate("initCommands", "Cache all dynamic/static files.\n"
@@ -764,6 +996,14 @@ void initCommands()
     ch.description = t;
     BTerminal::setCommandHelp("clear-cache", ch);
     //
+    BTerminal::installHandler("cache-stats", &handleCacheStats);
+    ch.usage = "cache-stats [cache-name]";
+    ch.description = BTranslation::translate("initCommands", "Show hit/miss/insert/eviction counters, current cost "
+                                             "and memory usage of the cache specified by [cache-name].\n"
+                                             "If [cache-name] is not specified, all caches are shown, "
+                                             "along with the cache warm-up progress.");
+    BTerminal::setCommandHelp("cache-stats", ch);
+    //
     BTerminal::installHandler("reload-boards", &handleReloadBoards);
     ch.usage = "reload-boards";
     ch.description = BTranslation::translate("initCommands", "Reload all boards: builtin and provided by plugins.");
@@ -775,9 +1015,17 @@ void initCommands()
                                              "plugins.");
     BTerminal::setCommandHelp("reload-captcha-engines", ch);
     //
+    BTerminal::installHandler("reload-ip-bans", &handleReloadIpBans);
+    ch.usage = "reload-ip-bans";
+    ch.description = BTranslation::translate("initCommands", "Reload the list of banned IP ranges (res/ip_ban.txt).\n"
+                                             "The list is also reloaded automatically when the file changes.");
+    BTerminal::setCommandHelp("reload-ip-bans", ch);
+    //
     BTerminal::installHandler("rebuild-post-index", &handleRebuildPostIndex);
     ch.usage = "rebuild-post-index";
-    ch.description = BTranslation::translate("initCommands", "Clear post text index and create it from scratch.");
+    ch.description = BTranslation::translate("initCommands", "Clear post text index and create it from scratch.\n"
+                                             "The index is also rebuilt in background on startup if it was built "
+                                             "by another version of the search analyzer.");
     BTerminal::setCommandHelp("rebuild-post-index", ch);
     //
     BTerminal::installHandler("register-user", &handleRegisterUser);
@@ -785,11 +1033,21 @@ void initCommands()
     ch.description = BTranslation::translate("initCommands", "Registers a user.");
     BTerminal::setCommandHelp("register-user", ch);
     //
+    BTerminal::installHandler("request-context-stats", &handleRequestContextStats);
+    ch.usage = "request-context-stats";
+    ch.description = BTranslation::translate("initCommands", "Show how many times each per-request value (IP, "
+                                             "hashpass, locale, user level and boards, ban state) was computed "
+                                             "and reused since startup.\n"
+                                             "Each value should be computed at most once per request.");
+    BTerminal::setCommandHelp("request-context-stats", ch);
+    //
     BTerminal::installHandler("rerender-posts", &handleRerenderPosts);
     ch.usage = "rerender-posts [board]...";
     ch.description = BTranslation::translate("initCommands", "Rerenders all posts on all boards.\n"
                                              "If one or more board names are specified, rerenders only posts on those "
-                                             "boards.");
+                                             "boards.\n"
+                                             "If the previous run with the same board names was interrupted, it is "
+                                             "resumed from the last written post.");
     BTerminal::setCommandHelp("rerender-posts", ch);
     //
     BTerminal::installHandler("delete-post", &handleDeletePost);
@@ -798,6 +1056,13 @@ void initCommands()
         "If <post-number> is a thread, that thread and all posts in it are deleted.");
     BTerminal::setCommandHelp("delete-post", ch);
     //
+    BTerminal::installHandler("markup-corpus", &handleMarkupCorpus);
+    ch.usage = "markup-corpus record|check <file>";
+    ch.description = BTranslation::translate("initCommands", "Render the markup test corpus (res/markup_corpus.txt).\n"
+                                             "record saves the rendered posts to <file>, check compares them with "
+                                             "the ones saved to <file> earlier and shows the differences.");
+    BTerminal::setCommandHelp("markup-corpus", ch);
+    //
     BTerminal::installHandler("new-log", &handleNewLog);
     ch.usage = "new-log";
     ch.description = BTranslation::translate("initCommands", "Finish writing to the current log file and start "
@@ -806,7 +1071,9 @@ void initCommands()
     //
     BTerminal::installHandler("uptime", &handleUptime);
     ch.usage = "uptime";
-    ch.description = BTranslation::translate("initCommands", "Shows for how long the application has been running.");
+    ch.description = BTranslation::translate("initCommands", "Shows for how long the application has been running.\n"
+                                             "Also shows how many database connections were opened and how many "
+                                             "transactions were started using them.");
     BTerminal::setCommandHelp("uptime", ch);
 }
 
@@ -883,6 +1150,10 @@ void initSettings()
     nn->setDescription(BTranslation::translate("initSettings", "Maximum count of extra posts a user may make before "
                                                "solving captcha again.\n"
                                                "The default is 0 (solve captcha every time)."));
+    nn = new BSettingsNode(QVariant::Bool, "page_cache_enabled", n);
+    nn->setDescription(BTranslation::translate("initSettings", "Determines if rendered board, thread and catalog "
+                                               "pages are cached for anonymous users.\n"
+                                               "The default is true."));
     nn = new BSettingsNode(QVariant::String, "launch_date", n);
     BTranslation t = BTranslation::translate("initSettings", "Date and time of first site launch.\n"
                                              "Is used to calculate board speed.\n"
@@ -987,16 +1258,77 @@ void initSettings()
     nn->setDescription(BTranslation::translate("initSettings", "Time zone offset in minutes.\n"
                                                "The value must be between -720 and 840.\n"
                                                "The default is -1000 (no offset)."));
+    /*======================================== Database ========================================*/
+    n = new BSettingsNode("Database", root);
+    nn = new BSettingsNode(QVariant::UInt, "max_connections", n);
+    nn->setDescription(BTranslation::translate("initSettings", "Maximum number of simultaneously open database "
+                                               "connections.\n"
+                                               "Connections are kept open and reused by subsequent transactions.\n"
+                                               "Takes effect after restart.\n"
+                                               "The default is 0 (unlimited)."));
+    nn = new BSettingsNode(QVariant::UInt, "min_connections", n);
+    nn->setDescription(BTranslation::translate("initSettings", "Number of idle database connections kept open.\n"
+                                               "Takes effect after restart.\n"
+                                               "The default is 0 (keep all connections open)."));
+    nn = new BSettingsNode(QVariant::Int, "rerender_batch_size", n);
+    nn->setDescription(BTranslation::translate("initSettings", "Number of posts read, rendered and written at once "
+                                               "by the rerender-posts command.\n"
+                                               "Posts may not be deleted while a batch is processed.\n"
+                                               "The default is 100."));
+    nn = new BSettingsNode(QVariant::Int, "rerender_thread_count", n);
+    nn->setDescription(BTranslation::translate("initSettings", "Number of threads used to render posts by the "
+                                               "rerender-posts command.\n"
+                                               "The default is QThread::idealThreadCount()"));
+    nn = new BSettingsNode(QVariant::Bool, "wal_enabled", n);
+    nn->setDescription(BTranslation::translate("initSettings", "Determines if the database is switched to "
+                                               "write-ahead logging (WAL) mode.\n"
+                                               "In this mode board, thread and catalog pages are read using separate "
+                                               "read-only connections which are never blocked by posting.\n"
+                                               "Takes effect after restart.\n"
+                                               "The default is false."));
+    /*======================================== Search ========================================*/
+    n = new BSettingsNode("Search", root);
+    nn = new BSettingsNode(QVariant::Int, "results_per_page", n);
+    nn->setDescription(BTranslation::translate("initSettings", "Number of search results per one page.\n"
+                                               "Results are ranked by relevance; only the posts of the requested "
+                                               "page are loaded from the database.\n"
+                                               "If 0, all results are shown on one page.\n"
+                                               "The default is 20."));
     /*======================================== Cache ========================================*/
     n = new BSettingsNode("Cache", root);
+    nn = new BSettingsNode(QVariant::Int, "memory_budget", n);
+    nn->setUserSetFunction(&setMemoryBudget);
+    nn->setDescription(BTranslation::translate("initSettings", "Memory budget shared by all caches (in megabytes).\n"
+                                               "When the caches together hold more data, entries are evicted from "
+                                               "the largest cache.\n"
+                                               "If 0, there is no shared limit.\n"
+                                               "The default is 512."));
+    nn = new BSettingsNode(QVariant::Int, "warm_up_key_count", n);
+    nn->setDescription(BTranslation::translate("initSettings", "Maximum number of most recently used threads "
+                                               "saved per cache (op_posts, thread_posts, last_n_posts) on shutdown.\n"
+                                               "These threads are loaded into the caches in background on the next "
+                                               "startup.\n"
+                                               "If 0, caches are not warmed up.\n"
+                                               "The default is 1000."));
+    nn = new BSettingsNode(QVariant::Int, "warm_up_thread_count", n);
+    nn->setDescription(BTranslation::translate("initSettings", "Number of threads used to warm up caches on "
+                                               "startup.\n"
+                                               "The default is QThread::idealThreadCount()"));
     foreach (const QString &s, Cache::availableCacheNames()) {
         nn = new BSettingsNode(s, n);
-        BSettingsNode *nnn = new BSettingsNode(QVariant::Int, "max_size", nn);
+        BSettingsNode *nnn = new BSettingsNode(QVariant::Int, Cache::maxCacheSizeKey(s), nn);
         nnn->setUserSetFunction(&setMaxCacheSize);
         BTranslation t = BTranslation::translate("initSettings", "Maximum cache size (in bytes or in units).\n"
                                                  "The default value is %1.");
         t.setArgument(QString::number(Cache::defaultCacheSize(s)));
         nnn->setDescription(t);
+        nnn = new BSettingsNode(QVariant::String, "eviction_policy", nn);
+        nnn->setDescription(BTranslation::translate("initSettings", "Cache eviction policy. Possible values:\n"
+                                                    "  clock - lookups only set a reference bit and do not block "
+                                                    "each other\n"
+                                                    "  lru - lookups move entries to the front (exact LRU order)\n"
+                                                    "Takes effect after restart.\n"
+                                                    "The default is clock."));
     }
     BTerminal::setRootSettingsNode(root);
 }
@@ -1092,7 +1424,25 @@ bool setMaxCacheSize(const BSettingsNode *node, const QVariant &value)
         bWriteLine(err);
         return false;
     }
-    SettingsLocker()->setValue("Cache/" + p->key() + "/max_size", sz);
+    SettingsLocker()->setValue("Cache/" + p->key() + "/" + Cache::maxCacheSizeKey(p->key()), sz);
+    return true;
+}
+
+bool setMemoryBudget(const BSettingsNode *, const QVariant &value)
+{
+    QString s = !value.isNull() ? value.toString() : bReadLine(translate("setMemoryBudget", "Enter size:") + " ");
+    if (s.isEmpty()) {
+        bWriteLine(translate("setMemoryBudget", "Invalid value"));
+        return false;
+    }
+    bool ok = false;
+    int sz = s.toInt(&ok);
+    if (!ok || sz < 0) {
+        bWriteLine(translate("setMemoryBudget", "Invalid value"));
+        return false;
+    }
+    Cache::setMemoryBudget(sz);
+    SettingsLocker()->setValue("Cache/memory_budget", sz);
     return true;
 }
 
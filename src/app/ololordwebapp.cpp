@@ -4,6 +4,7 @@
 
 #include <Controller>
 #include <plugin/RouteFactoryPluginInterface>
+#include <RequestContext>
 #include <route/AbstractRoute>
 #include <route/ActionRoute>
 #include <route/AddFileRoute>
@@ -176,6 +177,8 @@ OlolordWebApp::~OlolordWebApp()
 
 void OlolordWebApp::main(std::string url)
 {
+    RequestContext::Scope scope(request());
+    Q_UNUSED(scope)
     try {
         if (dispatcher().dispatch(url))
             return;
@@ -25,10 +25,9 @@ AbstractAjaxHandler::~AbstractAjaxHandler()
 bool AbstractAjaxHandler::testBan(const QString &boardName, bool readonly)
 {
     TranslatorStd ts(server.request());
-    QString ip = Tools::userIp(server.request());
     bool ok = false;
     QString err;
-    QMap<QString, Database::BanInfo> map = Database::userBanInfo(ip, &ok, &err, ts.locale());
+    QMap<QString, Database::BanInfo> map = Database::userBanInfo(server.request(), &ok, &err);
     if (!ok) {
         server.return_error(Tools::toStd(err));
         return false;
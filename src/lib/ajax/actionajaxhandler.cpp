@@ -1,5 +1,6 @@
 #include "actionajaxhandler.h"
 
+#include "cache.h"
 #include "database.h"
 #include "captcha/abstractcaptchaengine.h"
 #include "captcha/abstractyandexcaptchaengine.h"
@@ -334,6 +335,42 @@ void ActionAjaxHandler::getBoards()
     DDOS_POST_S
 }
 
+void ActionAjaxHandler::getCacheStatistics()
+{
+    DDOS_S(2)
+    try {
+        Tools::log(server, "ajax_get_cache_statistics", "begin");
+        if (Database::registeredUserLevel(server.request()) < RegisteredUser::ModerLevel) {
+            TranslatorQt tq(server.request());
+            QString err = tq.translate("ActionAjaxHandler", "Not enough rights", "error");
+            server.return_error(Tools::toStd(err));
+            Tools::log(server, "ajax_get_cache_statistics", "fail:" + err);
+            DDOS_POST_S
+            return;
+        }
+        cppcms::json::object o;
+        foreach (const Cache::Statistics &s, Cache::statistics()) {
+            cppcms::json::object oo;
+            oo["hits"] = double(s.hits);
+            oo["misses"] = double(s.misses);
+            oo["inserts"] = double(s.inserts);
+            oo["evictions"] = double(s.evictions);
+            oo["count"] = s.count;
+            oo["cost"] = s.cost;
+            oo["maxCost"] = s.maxCost;
+            oo["bytes"] = double(s.bytes);
+            o[Tools::toStd(s.name)] = oo;
+        }
+        server.return_result(o);
+        Tools::log(server, "ajax_get_cache_statistics", "success");
+    } catch (const std::exception &e) {
+        QString err = Tools::fromStd(e.what());
+        server.return_error(Tools::toStd(err));
+        Tools::log(server, "ajax_get_cache_statistics", "fail:" + err);
+    }
+    DDOS_POST_S
+}
+
 void ActionAjaxHandler::getCaptchaQuota(std::string boardName)
 {
     DDOS_S(2)
@@ -762,6 +799,8 @@ QList<ActionAjaxHandler::Handler> ActionAjaxHandler::handlers() const
     list << Handler("edit_audio_tags", cppcms::rpc::json_method(&ActionAjaxHandler::editAudioTags, self), method_role);
     list << Handler("edit_post", cppcms::rpc::json_method(&ActionAjaxHandler::editPost, self), method_role);
     list << Handler("get_boards", cppcms::rpc::json_method(&ActionAjaxHandler::getBoards, self), method_role);
+    list << Handler("get_cache_statistics", cppcms::rpc::json_method(&ActionAjaxHandler::getCacheStatistics, self),
+                    method_role);
     list << Handler("get_captcha_quota", cppcms::rpc::json_method(&ActionAjaxHandler::getCaptchaQuota, self),
                     method_role);
     list << Handler("get_coub_video_info", cppcms::rpc::json_method(&ActionAjaxHandler::getCoubVideoInfo, self),
@@ -36,6 +36,7 @@ public:
                        const cppcms::json::object &tags);
     void editPost(const cppcms::json::object &params);
     void getBoards();
+    void getCacheStatistics();
     void getCaptchaQuota(std::string boardName);
     void getCoubVideoInfo(std::string videoId);
     void getFileExistence(std::string boardName, std::string hash);
@@ -24,6 +24,7 @@
 #include "stored/postcounter-odb.hxx"
 #include "stored/thread.h"
 #include "stored/thread-odb.hxx"
+#include "threadindex.h"
 #include "tools.h"
 #include "transaction.h"
 #include "translator.h"
@@ -70,6 +71,7 @@
 
 #include <cppcms/application.h>
 #include <cppcms/http_request.h>
+#include <cppcms/http_response.h>
 #include <cppcms/json.h>
 
 #include <odb/database.hxx>
@@ -79,11 +81,71 @@
 #include <odb/result.hxx>
 #include <odb/transaction.hxx>
 
+#include <sstream>
 #include <string>
 #include <vector>
 
 #include <fstream>
 
+static QString pageCacheKey(const AbstractBoard *board, const cppcms::http::request &req, const QString &page)
+{
+    if (!board || !board->pageCacheEnabled() || !Tools::hashpass(req).isEmpty())
+        return QString();
+    //NOTE: Some captcha engines put a per-request challenge into the page in ascetic mode
+    if (!Tools::cookieValue(req, "mode").compare("ascetic", Qt::CaseInsensitive) || board->captchaQuota(req))
+        return QString();
+    init_once(QStringList, cookieNames, QStringList()) {
+        cookieNames << "captchaEngine" << "draftsByDefault" << "hiddenBoards" << "hidePostformRules" << "markupMode";
+        cookieNames << "maxAllowedRating" << "minimalisticPostform" << "mode" << "shrinkPosts" << "style" << "time";
+        cookieNames << "timeZoneOffset";
+    }
+    QStringList parts;
+    parts << board->name() << page << Tools::locale(req).name() << (Tools::isMobile(req).any ? "mobile" : "desktop");
+    foreach (const QString &name, cookieNames)
+        parts << Tools::cookieValue(req, name);
+    return parts.join("|");
+}
+
+static void writePage(cppcms::application &app, const Cache::Page &page)
+{
+    cppcms::http::response &r = app.response();
+    r.etag(page.eTag.constData());
+    QString inm = Tools::fromStd(app.request().getenv("HTTP_IF_NONE_MATCH"));
+    QStringList tags = inm.split(QRegExp("\\s*,\\s*"), QString::SkipEmptyParts);
+    if (tags.contains(QString::fromLatin1(page.eTag)) || tags.contains("*"))
+        return r.status(304);
+    r.out().write(page.data.constData(), page.data.size());
+}
+
+static bool writeCachedPage(cppcms::application &app, const QString &key, quint64 generation)
+{
+    Cache::Page page;
+    if (key.isEmpty() || !Cache::page(key, &page) || page.generation != generation)
+        return false;
+    if (page.posterIps.contains(Tools::userIp(app.request())))
+        return false;
+    writePage(app, page);
+    return true;
+}
+
+static void renderPage(cppcms::application &app, const QString &viewName, cppcms::base_content &c,
+                       const QString &key, quint64 generation, const QSet<QString> &posterIps)
+{
+    if (key.isEmpty())
+        return Tools::render(app, viewName, c);
+    std::ostringstream out;
+    Tools::render(app, viewName, c, out);
+    std::string s = out.str();
+    Cache::Page page;
+    page.data = QByteArray(s.data(), s.size());
+    page.eTag = "\"" + QCryptographicHash::hash(page.data, QCryptographicHash::Md5).toHex() + "\"";
+    page.generation = generation;
+    page.posterIps = posterIps;
+    if (!posterIps.contains(Tools::userIp(app.request())))
+        Cache::cachePage(key, page);
+    writePage(app, page);
+}
+
 static void scaleThumbnail(QImage &img, AbstractBoard::FileTransaction &ft)
 {
     ft.setMainFileSize(img.height(), img.width());
@@ -460,6 +522,10 @@ void AbstractBoard::reloadBoards()
         nnn->setDescription(BTranslation::translate("AbstractBoard", "Maximum count of extra posts a user may make "
                                                     "before solving captcha again on this board.\n"
                                                     "The default is 0 (solve captcha every time)."));
+        nnn = new BSettingsNode(QVariant::Bool, "page_cache_enabled", nn);
+        nnn->setDescription(BTranslation::translate("AbstractBoard", "Determines if rendered pages of this board are "
+                                                    "cached for anonymous users.\n"
+                                                    "The default is true."));
         nnn = new BSettingsNode(QVariant::String, "launch_date", nn);
         BTranslation t = BTranslation::translate("AbstractBoard", "Date and time of first board launch.\n"
                                                  "Is used to calculate board speed.\n"
@@ -751,6 +817,10 @@ void AbstractBoard::handleBoard(cppcms::application &app, unsigned int page)
     QString logTarget = name() + "/" + QString::number(page);
     if (!Controller::testBanNonAjax(app, Controller::ReadAction, name()))
         return Tools::log(app, "board", "fail:ban", logTarget);
+    QString cacheKey = pageCacheKey(this, app.request(), "board/" + QString::number(page));
+    quint64 generation = Cache::pageGeneration(name());
+    if (writeCachedPage(app, cacheKey, generation))
+        return Tools::log(app, "board", "success:cache", logTarget);
     TranslatorQt tq(app.request());
     TranslatorStd ts(app.request());
     QString viewName;
@@ -766,38 +836,34 @@ void AbstractBoard::handleBoard(cppcms::application &app, unsigned int page)
     Content::Board &c = *cc;
     unsigned int pageCount = 0;
     bool postingEn = postingEnabled();
+    QSet<QString> posterIps;
     try {
-        Transaction t;
+        Transaction t(Transaction::ReadOnlyMode);
         if (!t) {
             QString err = tq.translate("AbstractBoard", "Internal database error", "description");
             Controller::renderErrorNonAjax(app, tq.translate("AbstractBoard", "Internal error", "error"), err);
             Tools::log(app, "board", "fail:" + err, logTarget);
             return;
         }
-        odb::query<Thread> q = odb::query<Thread>::board == name() && odb::query<Thread>::archived == false;
+        bool b = false;
+        ThreadIndex::DraftMap drafts;
+        ThreadIndex::ThreadInfoList list = ThreadIndex::threads(name(), &drafts, &b);
+        if (!b) {
+            QString err = tq.translate("AbstractBoard", "Internal database error", "description");
+            Controller::renderErrorNonAjax(app, tq.translate("AbstractBoard", "Internal error", "error"), err);
+            Tools::log(app, "board", "fail:" + err, logTarget);
+            return;
+        }
         QByteArray hashpass = Tools::hashpass(app.request());
         bool modOnBoard = Database::moderOnBoard(app.request(), name());
-        QList<Thread> list = Database::query<Thread, Thread>(q);
         int lvl = Database::registeredUserLevel(app.request());
-        foreach (int i, bRangeR(list.size() - 1, 0)) {
-            const Thread &tt = list.at(i);
-            Post *opPostP = Cache::opPost(tt.board(), tt.number());
-            if (opPostP) {
-                if (opPostP->draft() && opPostP->hashpass() != hashpass
-                        && (!modOnBoard || Database::registeredUserLevel(opPostP->hashpass()) >= lvl)) {
-                    list.removeAt(i);
-                }
-            } else {
-                Post opPost = *tt.posts().first().load();
-                Cache::cacheOpPost(tt.board(), tt.number(), new Post(opPost));
-                if (opPost.draft() && opPost.hashpass() != hashpass
-                        && (!modOnBoard || Database::registeredUserLevel(opPost.hashpass()) >= lvl)) {
-                    list.removeAt(i);
-                }
-            }
+        unsigned int tpp = threadsPerPage();
+        unsigned int threadCount = list.size() - drafts.size();
+        for (ThreadIndex::DraftMap::ConstIterator i = drafts.constBegin(); i != drafts.constEnd(); ++i) {
+            if (i.value() == hashpass || (modOnBoard && Database::registeredUserLevel(i.value()) < lvl))
+                ++threadCount;
         }
-        qSort(list.begin(), list.end(), &threadLessThanByDate);
-        pageCount = (list.size() / threadsPerPage()) + ((list.size() % threadsPerPage()) ? 1 : 0);
+        pageCount = (threadCount / tpp) + ((threadCount % tpp) ? 1 : 0);
         if (!pageCount)
             pageCount = 1;
         if (page >= pageCount) {
@@ -805,7 +871,35 @@ void AbstractBoard::handleBoard(cppcms::application &app, unsigned int page)
             Tools::log(app, "board", "fail:not_found", logTarget);
             return;
         }
-        foreach (const Thread &tt, list.mid(page * threadsPerPage(), threadsPerPage())) {
+        QList<quint64> threadNumbers;
+        unsigned int skip = page * tpp;
+        foreach (const ThreadIndex::ThreadInfo &ti, list) {
+            if (ti.draft && ti.opHashpass != hashpass
+                    && (!modOnBoard || Database::registeredUserLevel(ti.opHashpass) >= lvl)) {
+                continue;
+            }
+            if (skip) {
+                --skip;
+                continue;
+            }
+            threadNumbers << ti.number;
+            if (unsigned(threadNumbers.size()) >= tpp)
+                break;
+        }
+        QList<Thread> threads;
+        if (!threadNumbers.isEmpty()) {
+            odb::query<Thread> q = odb::query<Thread>::board == name()
+                    && odb::query<Thread>::number.in_range(threadNumbers.begin(), threadNumbers.end());
+            threads = Database::query<Thread, Thread>(q);
+        }
+        QMap<quint64, int> threadIndexes;
+        foreach (int i, bRangeD(0, threads.size() - 1))
+            threadIndexes.insert(threads.at(i).number(), i);
+        foreach (quint64 threadNumber, threadNumbers) {
+            int ind = threadIndexes.value(threadNumber, -1);
+            if (ind < 0)
+                continue;
+            const Thread &tt = threads.at(ind);
             Content::Board::Thread thread;
             const Thread::Posts &posts = tt.posts();
             thread.bumpLimit = bumpLimit();
@@ -816,22 +910,27 @@ void AbstractBoard::handleBoard(cppcms::application &app, unsigned int page)
             thread.postingEnabled = postingEn && tt.postingEnabled();
             bool ok = false;
             QString err;
-            Post *opPostP = Cache::opPost(tt.board(), tt.number());
-            if (opPostP)
+            QSharedPointer<Post> opPostP = Cache::opPost(tt.board(), tt.number());
+            if (opPostP) {
                 thread.opPost = toController(*opPostP, app.request(), &ok, &err);
-            else
-                thread.opPost = toController(*posts.first().load(), app.request(), &ok, &err);
+                posterIps << opPostP->posterIp();
+            } else {
+                QSharedPointer<Post> opPost = posts.first().load();
+                thread.opPost = toController(*opPost, app.request(), &ok, &err);
+                posterIps << opPost->posterIp();
+            }
             thread.opPost.sequenceNumber = 1;
             if (!ok) {
                 Controller::renderErrorNonAjax(app, tq.translate("AbstractBoard", "Internal error", "error"), err);
                 Tools::log(app, "board", "fail:" + err, logTarget);
                 return;
             }
-            Cache::PostList *lastNPosts = Cache::lastNPosts(name(), tt.number());
+            Cache::LoadLock loadLock;
+            QSharedPointer<Cache::PostList> lastNPosts = Cache::lastNPosts(name(), tt.number(), &loadLock);
             unsigned int maxPosts = Tools::maxInfo(Tools::MaxLastPosts, name());
             unsigned int i = posts.size();
             if (!lastNPosts) {
-                Cache::PostList *postList = new Cache::PostList;
+                QSharedPointer<Cache::PostList> postList(new Cache::PostList);
                 foreach (int j, bRangeR(posts.size() - 1, 1)) {
                     Post post = *posts.at(j).load();
                     *postList << post;
@@ -840,6 +939,7 @@ void AbstractBoard::handleBoard(cppcms::application &app, unsigned int page)
                         continue;
                     }
                     Content::Post p = toController(post, app.request(), &ok, &err);
+                    posterIps << post.posterIp();
                     p.sequenceNumber = i;
                     --i;
                     thread.lastPosts.push_front(p);
@@ -853,6 +953,7 @@ void AbstractBoard::handleBoard(cppcms::application &app, unsigned int page)
                         break;
                 }
                 Cache::cacheLastNPosts(name(), tt.number(), postList);
+                loadLock.unlock();
             } else {
                 foreach (const Post &post, *lastNPosts) {
                     if (post.draft() && hashpass != post.hashpass()
@@ -860,6 +961,7 @@ void AbstractBoard::handleBoard(cppcms::application &app, unsigned int page)
                         continue;
                     }
                     Content::Post p = toController(post, app.request(), &ok, &err);
+                    posterIps << post.posterIp();
                     p.sequenceNumber = i;
                     --i;
                     thread.lastPosts.push_front(p);
@@ -898,7 +1000,7 @@ void AbstractBoard::handleBoard(cppcms::application &app, unsigned int page)
     c.toNextPageText = ts.translate("AbstractBoard", "Next page", "toNextPageText");
     c.toPreviousPageText = ts.translate("AbstractBoard", "Previous page", "toPreviousPageText");
     beforeRenderBoard(app.request(), cc.data());
-    Tools::render(app, viewName, c);
+    renderPage(app, viewName, c, cacheKey, generation, posterIps);
     Tools::log(app, "board", "success", logTarget);
 }
 
@@ -924,8 +1026,14 @@ void AbstractBoard::handleCatalog(cppcms::application &app)
     QString sortBy = params.value("sort");
     bool sortByRecent = !sortBy.compare("recent", Qt::CaseInsensitive);
     bool sortByBumps = !sortBy.compare("bumps", Qt::CaseInsensitive);
+    QString cacheKey = pageCacheKey(this, app.request(),
+                                    "catalog/" + QString(sortByBumps ? "bumps" : (sortByRecent ? "recent" : "date")));
+    quint64 generation = Cache::pageGeneration(name());
+    if (writeCachedPage(app, cacheKey, generation))
+        return Tools::log(app, "catalog", "success:cache", logTarget);
+    QSet<QString> posterIps;
     try {
-        Transaction t;
+        Transaction t(Transaction::ReadOnlyMode);
         if (!t) {
             QString err = tq.translate("AbstractBoard", "Internal database error", "description");
             Controller::renderErrorNonAjax(app, tq.translate("AbstractBoard", "Internal error", "error"), err);
@@ -939,7 +1047,8 @@ void AbstractBoard::handleCatalog(cppcms::application &app)
         int lvl = Database::registeredUserLevel(app.request());
         foreach (int i, bRangeR(list.size() - 1, 0)) {
             const Thread &tt = list.at(i);
-            Post *opPostP = Cache::opPost(tt.board(), tt.number());
+            Cache::LoadLock loadLock;
+            QSharedPointer<Post> opPostP = Cache::opPost(tt.board(), tt.number(), &loadLock);
             if (opPostP) {
                 if (opPostP->draft() && opPostP->hashpass() != hashpass
                         && (!modOnBoard || Database::registeredUserLevel(opPostP->hashpass()) >= lvl)) {
@@ -947,7 +1056,8 @@ void AbstractBoard::handleCatalog(cppcms::application &app)
                 }
             } else {
                 Post opPost = *list.at(i).posts().first().load();
-                Cache::cacheOpPost(tt.board(), tt.number(), new Post(opPost));
+                Cache::cacheOpPost(tt.board(), tt.number(), QSharedPointer<Post>(new Post(opPost)));
+                loadLock.unlock();
                 if (opPost.draft() && opPost.hashpass() != hashpass
                         && (!modOnBoard || Database::registeredUserLevel(opPost.hashpass()) >= lvl)) {
                     list.removeAt(i);
@@ -962,11 +1072,15 @@ void AbstractBoard::handleCatalog(cppcms::application &app)
             thread.replyCount = posts.size() - 1;
             bool ok = false;
             QString err;
-            Post *opPostP = Cache::opPost(tt.board(), tt.number());
-            if (opPostP)
+            QSharedPointer<Post> opPostP = Cache::opPost(tt.board(), tt.number());
+            if (opPostP) {
                 thread.opPost = toController(*opPostP, app.request(), &ok, &err);
-            else
-                thread.opPost = toController(*posts.first().load(), app.request(), &ok, &err);
+                posterIps << opPostP->posterIp();
+            } else {
+                QSharedPointer<Post> opPost = posts.first().load();
+                thread.opPost = toController(*opPost, app.request(), &ok, &err);
+                posterIps << opPost->posterIp();
+            }
             thread.opPost.sequenceNumber = 1;
             if (!ok) {
                 Controller::renderErrorNonAjax(app, tq.translate("AbstractBoard", "Internal error", "error"), err);
@@ -995,7 +1109,7 @@ void AbstractBoard::handleCatalog(cppcms::application &app)
     c.sortingModeLabelText = ts.translate("AbstractBoard", "Sort by:", "sortingModeLabelText");
     c.sortingModeRecentLabelText = ts.translate("AbstractBoard", "Last post date", "sortingModeRecentLabelText");
     beforeRenderCatalog(app.request(), cc.data());
-    Tools::render(app, viewName, c);
+    renderPage(app, viewName, c, cacheKey, generation, posterIps);
     Tools::log(app, "catalog", "success", logTarget);
 }
 
@@ -1115,6 +1229,10 @@ void AbstractBoard::handleThread(cppcms::application &app, quint64 threadNumber)
     QString logTarget = name() + "/" + QString::number(threadNumber);
     if (!Controller::testBanNonAjax(app, Controller::ReadAction, name()))
         return Tools::log(app, "thread", "fail:ban", logTarget);
+    QString cacheKey = pageCacheKey(this, app.request(), "thread/" + QString::number(threadNumber));
+    quint64 generation = Cache::pageGeneration(name(), threadNumber);
+    if (writeCachedPage(app, cacheKey, generation))
+        return Tools::log(app, "thread", "success:cache", logTarget);
     TranslatorQt tq(app.request());
     TranslatorStd ts(app.request());
     QString viewName;
@@ -1130,8 +1248,9 @@ void AbstractBoard::handleThread(cppcms::application &app, quint64 threadNumber)
     Content::Thread &c = *cc;
     bool postingEn = postingEnabled();
     QString pageTitle;
+    QSet<QString> posterIps;
     try {
-        Transaction t;
+        Transaction t(Transaction::ReadOnlyMode);
         if (!t) {
             QString err = tq.translate("AbstractBoard", "Internal database error", "description");
             Controller::renderErrorNonAjax(app, tq.translate("AbstractBoard", "Internal error", "error"), err);
@@ -1166,7 +1285,8 @@ void AbstractBoard::handleThread(cppcms::application &app, quint64 threadNumber)
         c.id = thread->id();
         c.number = thread->number();
         int lvl = Database::registeredUserLevel(app.request());
-        Post *opPostP = Cache::opPost(thread->board(), thread->number());
+        Cache::LoadLock opPostLoadLock;
+        QSharedPointer<Post> opPostP = Cache::opPost(thread->board(), thread->number(), &opPostLoadLock);
         QString subject;
         QString text;
         if (opPostP) {
@@ -1182,7 +1302,8 @@ void AbstractBoard::handleThread(cppcms::application &app, quint64 threadNumber)
             Post opPost = *posts.first().load();
             subject = opPost.subject();
             text = opPost.text();
-            Cache::cacheOpPost(thread->board(), thread->number(), new Post(opPost));
+            Cache::cacheOpPost(thread->board(), thread->number(), QSharedPointer<Post>(new Post(opPost)));
+            opPostLoadLock.unlock();
             if (opPost.draft() && hashpass != opPost.hashpass()
                     && (!modOnBoard || Database::registeredUserLevel(opPost.hashpass()) >= lvl)) {
                 Controller::renderNotFoundNonAjax(app);
@@ -1205,52 +1326,43 @@ void AbstractBoard::handleThread(cppcms::application &app, quint64 threadNumber)
         postingEn = postingEn && thread->postingEnabled();
         bool ok = false;
         QString err;
-        if (opPostP)
+        if (opPostP) {
             c.opPost = toController(*opPostP, app.request(), &ok, &err);
-        else
-            c.opPost = toController(*posts.first().load(), app.request(), &ok, &err);
+            posterIps << opPostP->posterIp();
+        } else {
+            QSharedPointer<Post> opPost = posts.first().load();
+            c.opPost = toController(*opPost, app.request(), &ok, &err);
+            posterIps << opPost->posterIp();
+        }
         c.opPost.sequenceNumber = 1;
         if (!ok)
             return Controller::renderErrorNonAjax(app, tq.translate("AbstractBoard", "Internal error", "error"), err);
         unsigned int i = 2;
-        Cache::PostList *threadPosts = Cache::threadPosts(thread->board(), thread->number());
-        if (threadPosts) {
-            foreach (int j, bRangeD(1, threadPosts->size() - 1)) {
-                const Post &post = threadPosts->at(j);
-                if (post.draft() && hashpass != post.hashpass()
-                        && (!modOnBoard || Database::registeredUserLevel(post.hashpass()) >= lvl)) {
-                    continue;
-                }
-                Content::Post p = toController(post, app.request(), &ok, &err);
-                p.sequenceNumber = i;
-                ++i;
-                c.posts.push_back(p);
-                if (!ok) {
-                    Controller::renderErrorNonAjax(app, tq.translate("AbstractBoard", "Internal error", "error"), err);
-                    Tools::log(app, "thread", "fail:" + err, logTarget);
-                    return;
-                }
+        Cache::LoadLock threadPostsLoadLock;
+        QSharedPointer<Cache::PostList> threadPosts = Cache::threadPosts(thread->board(), thread->number(),
+                                                                         &threadPostsLoadLock);
+        if (!threadPosts) {
+            threadPosts = QSharedPointer<Cache::PostList>(new Cache::PostList);
+            foreach (int j, bRangeD(1, posts.size() - 1))
+                *threadPosts << *posts.at(j).load();
+            Cache::cacheThreadPosts(thread->board(), thread->number(), threadPosts);
+            threadPostsLoadLock.unlock();
+        }
+        foreach (const Post &post, *threadPosts) {
+            if (post.draft() && hashpass != post.hashpass()
+                    && (!modOnBoard || Database::registeredUserLevel(post.hashpass()) >= lvl)) {
+                continue;
             }
-        } else {
-            threadPosts = new Cache::PostList;
-            foreach (int j, bRangeD(1, posts.size() - 1)) {
-                Post post = *posts.at(j).load();
-                *threadPosts << post;
-                if (post.draft() && hashpass != post.hashpass()
-                        && (!modOnBoard || Database::registeredUserLevel(post.hashpass()) >= lvl)) {
-                    continue;
-                }
-                Content::Post p = toController(post, app.request(), &ok, &err);
-                p.sequenceNumber = i;
-                ++i;
-                c.posts.push_back(p);
-                if (!ok) {
-                    Controller::renderErrorNonAjax(app, tq.translate("AbstractBoard", "Internal error", "error"), err);
-                    Tools::log(app, "thread", "fail:" + err, logTarget);
-                    return;
-                }
+            Content::Post p = toController(post, app.request(), &ok, &err);
+            posterIps << post.posterIp();
+            p.sequenceNumber = i;
+            ++i;
+            c.posts.push_back(p);
+            if (!ok) {
+                Controller::renderErrorNonAjax(app, tq.translate("AbstractBoard", "Internal error", "error"), err);
+                Tools::log(app, "thread", "fail:" + err, logTarget);
+                return;
             }
-            Cache::cacheThreadPosts(thread->board(), thread->number(), threadPosts);
         }
     }  catch (const odb::exception &e) {
         QString err = Tools::fromStd(e.what());
@@ -1272,7 +1384,7 @@ void AbstractBoard::handleThread(cppcms::application &app, quint64 threadNumber)
     c.postLimit = postLimit();
     c.updateThreadText = ts.translate("AbstractBoard", "Update thread", "updateThreadText");
     beforeRenderThread(app.request(), cc.data());
-    Tools::render(app, viewName, c);
+    renderPage(app, viewName, c, cacheKey, generation, posterIps);
     Tools::log(app, "thread", "success", logTarget);
 }
 
@@ -1318,6 +1430,12 @@ AbstractBoard::MarkupElements AbstractBoard::markupElements() const
             | UrlMarkupElement);
 }
 
+bool AbstractBoard::pageCacheEnabled() const
+{
+    SettingsLocker s;
+    return s->value("Board/" + name() + "/page_cache_enabled", s->value("Board/page_cache_enabled", true)).toBool();
+}
+
 QStringList AbstractBoard::postformRules(const QLocale &l) const
 {
     return rulesImplementation(l, "postform");
@@ -1610,10 +1728,21 @@ Content::Post AbstractBoard::toController(const Post &post, const cppcms::http::
 {
     static const QString DateTimeFormat = "dd/MM/yyyy ddd hh:mm:ss";
     TranslatorQt tq(req);
-    Content::Post *p = Cache::post(name(), post.number());
-    bool inCache = p;
+    int regLvl = Database::registeredUserLevel(req);
+    bool localTime = !Tools::cookieValue(req, "time").compare("local", Qt::CaseInsensitive);
+    QString variant = tq.locale().name() + "/" + (localTime ? QString::number(Tools::timeZoneMinutesOffset(req)) : "")
+            + "/" + ((regLvl >= RegisteredUser::ModerLevel) ? "moder" : "user");
+    Content::Post rp;
+    if (Cache::renderedPost(name(), post.number(), variant, &rp)) {
+        rp.ownHashpass = (post.hashpass() == Tools::hashpass(req));
+        rp.ownIp = (post.posterIp() == Tools::userIp(req));
+        return bRet(ok, true, error, QString(), rp);
+    }
+    Cache::LoadLock loadLock;
+    QSharedPointer<Content::Post> p = Cache::post(name(), post.number(), &loadLock);
+    bool inCache = !p.isNull();
     if (!p) {
-        p = new Content::Post;
+        p = QSharedPointer<Content::Post>(new Content::Post);
         p->bannedFor = post.bannedFor();
         p->email = Tools::toStd(post.email());
         p->number = post.number();
@@ -1635,7 +1764,7 @@ Content::Post AbstractBoard::toController(const Post &post, const cppcms::http::
         p->userData = post.userData();
         quint64 threadNumber = 0;
         try {
-            Transaction t;
+            Transaction t(Transaction::ReadOnlyMode);
             if (!t) {
                 return bRet(ok, false, error, tq.translate("AbstractBoard", "Internal database error", "error"),
                             Content::Post());
@@ -1746,8 +1875,9 @@ Content::Post AbstractBoard::toController(const Post &post, const cppcms::http::
         }
     }
     Content::Post pp = *p;
-    if (!inCache && !Cache::cachePost(name(), post.number(), p))
-        delete p;
+    if (!inCache)
+        Cache::cachePost(name(), post.number(), p);
+    loadLock.unlock();
     TranslatorStd ts(req);
     QLocale l = tq.locale();
     for (std::list<Content::File>::iterator i = pp.files.begin(); i != pp.files.end(); ++i) {
@@ -1765,7 +1895,6 @@ Content::Post AbstractBoard::toController(const Post &post, const cppcms::http::
     }
     if (showWhois() && "Unknown country" == pp.countryName)
         pp.countryName = ts.translate("AbstractBoard", "Unknown country", "countryName");
-    int regLvl = Database::registeredUserLevel(req);
     if (regLvl >= RegisteredUser::ModerLevel)
         pp.ip = Tools::toStd(post.posterIp());
     pp.ownHashpass = (post.hashpass() == Tools::hashpass(req));
@@ -1807,6 +1936,7 @@ Content::Post AbstractBoard::toController(const Post &post, const cppcms::http::
         QByteArray tripcode = QCryptographicHash::hash(hashpass, QCryptographicHash::Md5);
         pp.tripcode = Tools::toStd("!" + QString::fromLatin1(tripcode.toBase64()).left(10));
     }
+    Cache::cacheRenderedPost(name(), post.number(), variant, pp);
     return bRet(ok, true, error, QString(), pp);
 }
 
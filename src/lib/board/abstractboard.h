@@ -203,6 +203,7 @@ public:
     virtual bool isHidden() const;
     virtual MarkupElements markupElements() const;
     virtual QString name() const = 0;
+    virtual bool pageCacheEnabled() const;
     virtual QStringList postformRules(const QLocale &l) const;
     virtual bool postingEnabled() const;
     PostingSpeed postingSpeed() const;
@@ -131,6 +131,11 @@ QString rpgBoard::name() const
     return "rpg";
 }
 
+bool rpgBoard::pageCacheEnabled() const
+{
+    return false;
+}
+
 QString rpgBoard::title(const QLocale &l) const
 {
     return TranslatorQt(l).translate("rpgBoard", "Role-playing games", "board title");
@@ -46,6 +46,7 @@ public:
                               bool thread, QString *error = 0, QString *description = 0);
     cppcms::json::value editedPostUserData(const Tools::PostParameters &params) const;
     QString name() const;
+    bool pageCacheEnabled() const;
     QString title(const QLocale &l) const;
     cppcms::json::object toJson(const Content::Post &post, const cppcms::http::request &req) const;
 protected:
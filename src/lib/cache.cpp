@@ -2,76 +2,335 @@
 
 #include "controller/baseboard.h"
 #include "settingslocker.h"
+#include "shardedcache.h"
 #include "stored/thread.h"
 #include "translator.h"
 
 #include <BeQt>
+#include <BLogger>
 #include <BTranslator>
 
+#include <QAtomicInt>
+#include <QAtomicInteger>
 #include <QByteArray>
-#include <QCache>
 #include <QDateTime>
 #include <QDebug>
 #include <QLocale>
 #include <QMap>
+#include <QMutex>
+#include <QMutexLocker>
 #include <QReadLocker>
 #include <QReadWriteLock>
+#include <QSet>
 #include <QSettings>
+#include <QSharedPointer>
 #include <QString>
 #include <QStringList>
 #include <QVariant>
+#include <QWaitCondition>
 #include <QWriteLocker>
 
+#include <climits>
+#include <list>
+#include <string>
+
 namespace Cache
 {
 
-static QCache<QString, QString> theCustomContent;
-static QReadWriteLock customContentLock(QReadWriteLock::Recursive);
-static QCache<QString, CustomLinkInfoList> theCustomLinks;
-static QReadWriteLock customLinksLock(QReadWriteLock::Recursive);
-static QCache<QString, File> dynamicFiles;
-static QReadWriteLock dynamicFilesLock(QReadWriteLock::Recursive);
-static QCache<QString, Tools::FriendList> theFriendList;
-static QReadWriteLock friendListLock(QReadWriteLock::Recursive);
-static QCache<QString, IpBanInfoList> theIpBanInfoList;
-static QReadWriteLock ipBanInfoListLock(QReadWriteLock::Recursive);
-static QCache<QString, PostList> theLastNPosts;
-static QReadWriteLock lastNPostsLock(QReadWriteLock::Recursive);
-static QCache<QString, QStringList> theNews;
-static QReadWriteLock newsLock(QReadWriteLock::Recursive);
-static QCache<QString, Post> theOpPosts;
-static QReadWriteLock opPostsLock(QReadWriteLock::Recursive);
-static QCache<QString, Content::Post> thePosts;
-static QReadWriteLock postsLock(QReadWriteLock::Recursive);
-static QCache<QString, QStringList> theRules;
-static QReadWriteLock rulesLock(QReadWriteLock::Recursive);
-static QCache<QString, File> staticFiles;
-static QReadWriteLock staticFilesLock(QReadWriteLock::Recursive);
-static QCache<QString, PostList> theThreadPosts;
-static QReadWriteLock threadPostsLock(QReadWriteLock::Recursive);
-static QCache<QString, BTranslator> translators;
-static QReadWriteLock translatorsLock(QReadWriteLock::Recursive);
-
-template <typename T>
-void initCache(T &cache, const QString &name, int defaultSize)
+class AbstractNamedCache
 {
-    if (name.isEmpty())
+public:
+    const QString Name;
+protected:
+    QAtomicInteger<qint64> mbytes;
+public:
+    explicit AbstractNamedCache(const QString &name);
+    virtual ~AbstractNamedCache();
+public:
+    qint64 bytes() const;
+    virtual qint64 evict(qint64 bytes, const void *keep) = 0;
+    virtual QStringList keys(int max) const = 0;
+    virtual Statistics statistics() const = 0;
+};
+
+typedef QMap<QString, AbstractNamedCache *> NamedCacheMap;
+
+static const int ArrayHeaderSize = 24;
+static const int HeapBlockOverhead = 2 * sizeof(void *);
+static const int StdStringLocalCapacity = 15;
+
+static QMutex loadMutex;
+static QWaitCondition loadCondition;
+static QSet<QString> loadingKeys;
+static QAtomicInt theMemoryBudget(-1);
+static QAtomicInteger<qint64> theTotalBytes(0);
+
+static NamedCacheMap &namedCaches()
+{
+    static NamedCacheMap map;
+    return map;
+}
+
+static qint64 heapSize(const QByteArray &a)
+{
+    return a.capacity() ? (HeapBlockOverhead + ArrayHeaderSize + a.capacity() + 1) : 0;
+}
+
+static qint64 heapSize(const QDateTime &dt)
+{
+    return !dt.isNull() ? (HeapBlockOverhead + ArrayHeaderSize) : 0;
+}
+
+static qint64 heapSize(const QString &s)
+{
+    return s.capacity() ? (HeapBlockOverhead + ArrayHeaderSize + (s.capacity() + 1) * sizeof(QChar)) : 0;
+}
+
+static qint64 heapSize(const QVariant &v)
+{
+    if (v.isNull())
+        return 0;
+    if (QVariant::String == v.type())
+        return heapSize(v.toString());
+    if (QVariant::ByteArray == v.type())
+        return heapSize(v.toByteArray());
+    return HeapBlockOverhead + BeQt::serialize(v).size();
+}
+
+static qint64 heapSize(const std::string &s)
+{
+    return (s.capacity() > StdStringLocalCapacity) ? (HeapBlockOverhead + s.capacity() + 1) : 0;
+}
+
+template <typename T> qint64 heapSize(const QList<T> &list)
+{
+    if (list.isEmpty())
+        return 0;
+    return HeapBlockOverhead + ArrayHeaderSize + list.size() * (sizeof(void *) + HeapBlockOverhead + sizeof(T));
+}
+
+template <typename T> qint64 heapSize(const std::list<T> &list)
+{
+    return list.size() * (HeapBlockOverhead + 2 * sizeof(void *) + sizeof(T));
+}
+
+static int toCost(qint64 bytes)
+{
+    return int(qMin(bytes, qint64(INT_MAX)));
+}
+
+static qint64 estimateSize(const RenderedPostMap &map)
+{
+    qint64 sz = 0;
+    foreach (const QString &variant, map.keys())
+        sz += HeapBlockOverhead + 3 * sizeof(void *) + sizeof(QString) + heapSize(variant);
+    foreach (const Content::Post &post, map.values())
+        sz += estimateSize(post);
+    return sz;
+}
+
+AbstractNamedCache::AbstractNamedCache(const QString &name) :
+    Name(name), mbytes(0)
+{
+    namedCaches().insert(name, this);
+}
+
+AbstractNamedCache::~AbstractNamedCache()
+{
+    //
+}
+
+qint64 AbstractNamedCache::bytes() const
+{
+    return mbytes.load();
+}
+
+static qint64 memoryExcess()
+{
+    int budget = memoryBudget();
+    return (budget > 0) ? (theTotalBytes.load() - qint64(budget) * BeQt::Megabyte) : 0;
+}
+
+static void enforceMemoryBudget(const void *keep)
+{
+    static QMutex enforceMutex;
+    if (memoryExcess() <= 0 || !enforceMutex.tryLock())
         return;
-    if (defaultSize < 0)
-        defaultSize = 100 * BeQt::Megabyte;
-    int sz = SettingsLocker()->value("Cache/" + name + "/max_size", defaultSize).toInt();
-    cache.setMaxCost((sz >= 0) ? sz : 0);
+    forever {
+        qint64 excess = memoryExcess();
+        if (excess <= 0)
+            break;
+        AbstractNamedCache *largest = 0;
+        foreach (AbstractNamedCache *c, namedCaches()) {
+            if (!largest || c->bytes() > largest->bytes())
+                largest = c;
+        }
+        if (!largest || !largest->evict(excess, keep))
+            break;
+    }
+    enforceMutex.unlock();
+}
+
+template <typename T> class NamedCache : public AbstractNamedCache, public ShardedCache<QString, T>
+{
+public:
+    const int DefaultSize;
+private:
+    QAtomicInt initialized;
+    QMutex initMutex;
+public:
+    explicit NamedCache(const QString &name, int defaultSize, int shardCount = 16) :
+        AbstractNamedCache(name), ShardedCache<QString, T>(shardCount),
+        DefaultSize((defaultSize >= 0) ? defaultSize : (100 * BeQt::Megabyte))
+    {
+        //
+    }
+public:
+    qint64 evict(qint64 bytes, const void *keep)
+    {
+        return ShardedCache<QString, T>::evict(bytes, static_cast<const T *>(keep));
+    }
+    void init()
+    {
+        if (initialized.fetchAndAddOrdered(0))
+            return;
+        QMutexLocker locker(&initMutex);
+        if (initialized.fetchAndAddOrdered(0))
+            return;
+        SettingsLocker s;
+        QString key = maxCacheSizeKey(Name);
+        if ("max_size" != key && s->contains("Cache/" + Name + "/max_size")) {
+            //NOTE: An entry count can not be converted to bytes, so the old setting is only reported
+            bLog("[Cache] Cache/" + Name + "/max_size is ignored, the size of this cache is limited by Cache/" + Name
+                 + "/" + key);
+        }
+        int sz = s->value("Cache/" + Name + "/" + key, DefaultSize).toInt();
+        QString policy = s->value("Cache/" + Name + "/eviction_policy", "clock").toString();
+        this->setEvictionPolicy(!policy.compare("lru", Qt::CaseInsensitive) ? ShardedCache<QString, T>::LruPolicy :
+                                                                               ShardedCache<QString, T>::ClockPolicy);
+        this->setMaxCost((sz >= 0) ? sz : 0);
+        initialized.fetchAndStoreOrdered(1);
+    }
+    bool insert(const QString &key, const QSharedPointer<T> &object, int cost = 1, qint64 bytes = -1)
+    {
+        if (!ShardedCache<QString, T>::insert(key, object, cost, bytes))
+            return false;
+        enforceMemoryBudget(object.data());
+        return true;
+    }
+    QStringList keys(int max) const
+    {
+        return ShardedCache<QString, T>::keys(max);
+    }
+    Statistics statistics() const
+    {
+        typename ShardedCache<QString, T>::Statistics st = ShardedCache<QString, T>::statistics();
+        Statistics s;
+        s.name = Name;
+        s.hits = st.hits;
+        s.misses = st.misses;
+        s.inserts = st.inserts;
+        s.evictions = st.evictions;
+        s.count = st.count;
+        s.cost = st.cost;
+        s.maxCost = st.maxCost;
+        s.bytes = st.bytes;
+        return s;
+    }
+protected:
+    void bytesChanged(qint64 delta)
+    {
+        mbytes.fetchAndAddRelaxed(delta);
+        theTotalBytes.fetchAndAddRelaxed(delta);
+    }
+};
+
+template <typename T> QSharedPointer<T> objectOrLock(NamedCache<T> &cache, const QString &key, LoadLock *lock)
+{
+    QSharedPointer<T> o = cache.object(key);
+    if (o || !lock)
+        return o;
+    bool waited = false;
+    if (!lock->lock(cache.Name + ":" + key, &waited) || !waited)
+        return QSharedPointer<T>();
+    o = cache.object(key);
+    if (o)
+        lock->unlock();
+    return o;
+}
+
+LoadLock::LoadLock()
+{
+    //
+}
+
+LoadLock::~LoadLock()
+{
+    unlock();
 }
 
+bool LoadLock::isLocked() const
+{
+    return !mkey.isEmpty();
+}
+
+bool LoadLock::lock(const QString &key, bool *waited)
+{
+    if (key.isEmpty() || isLocked())
+        return bRet(waited, false, false);
+    bool w = false;
+    QMutexLocker locker(&loadMutex);
+    while (loadingKeys.contains(key)) {
+        w = true;
+        if (!loadCondition.wait(&loadMutex, 30 * BeQt::Second))
+            return bRet(waited, w, false);
+    }
+    loadingKeys.insert(key);
+    mkey = key;
+    return bRet(waited, w, true);
+}
+
+void LoadLock::unlock()
+{
+    if (mkey.isEmpty())
+        return;
+    QMutexLocker locker(&loadMutex);
+    loadingKeys.remove(mkey);
+    mkey.clear();
+    loadCondition.wakeAll();
+}
+
+static NamedCache<QString> theCustomContent("custom_content", defaultCustomContentCacheSize);
+static NamedCache<CustomLinkInfoList> theCustomLinks("custom_links", defaultCustomLinksCacheSize, 1);
+static NamedCache<File> dynamicFiles("dynamic_files", defaultDynamicFilesCacheSize, 1);
+static NamedCache<Tools::FriendList> theFriendList("friend_list", defaultFriendListCacheSize, 1);
+static NamedCache<QString> theHighlightedCode("highlighted_code", defaultHighlightedCodeCacheSize);
+static NamedCache<PostList> theLastNPosts("last_n_posts", defaultLastNPostsCacheSize);
+static NamedCache<QStringList> theNews("news", defaultNewsCacheSize, 1);
+static NamedCache<Post> theOpPosts("op_posts", defaultOpPostsCacheSize);
+static QMap<QString, quint64> pageGenerations;
+static quint64 lastPageGeneration = 0;
+static QReadWriteLock pageGenerationsLock(QReadWriteLock::Recursive);
+static quint64 removedThreadPageGeneration = 0;
+static NamedCache<Page> thePages("pages", defaultPagesCacheSize);
+static NamedCache<Content::Post> thePosts("posts", defaultPostsCacheSize);
+static NamedCache<RenderedPostMap> theRenderedPosts("rendered_posts", defaultRenderedPostsCacheSize);
+static NamedCache<QStringList> theRules("rules", defaultRulesCacheSize, 1);
+static NamedCache<File> staticFiles("static_files", defaultStaticFilesCacheSize, 1);
+static NamedCache<PostList> theThreadPosts("thread_posts", defaultThreadPostsCacheSize);
+static NamedCache<BTranslator> translators("translators", defaultTranslationsCacheSize, 1);
+
 bool addThreadPost(const QString &boardName, quint64 threadNumber, const Post &post)
 {
     if (boardName.isEmpty() || !threadNumber)
         return false;
-    QWriteLocker locker(&threadPostsLock);
-    PostList *list = theThreadPosts.object(boardName + "/" + QString::number(threadNumber));
+    NamedCache<PostList>::WriteLocker locker(theThreadPosts, boardName + "/" + QString::number(threadNumber));
+    QSharedPointer<PostList> list = locker.object();
     if (!list)
         return false;
-    *list << post;
+    QSharedPointer<PostList> nlist(new PostList(*list));
+    *nlist << post;
+    locker.setObject(nlist, toCost(locker.cost() + estimateSize(post)));
     return true;
 }
 
@@ -79,18 +338,20 @@ bool addLastNPost(const QString &boardName, quint64 threadNumber, const Post &po
 {
     if (boardName.isEmpty() || !threadNumber)
         return false;
-    QWriteLocker locker(&lastNPostsLock);
-    PostList *list = theLastNPosts.object(boardName + "/" + QString::number(threadNumber));
+    NamedCache<PostList>::WriteLocker locker(theLastNPosts, boardName + "/" + QString::number(threadNumber));
+    QSharedPointer<PostList> list = locker.object();
     if (!list)
         return false;
-    list->prepend(post);
+    QSharedPointer<PostList> nlist(new PostList(*list));
+    nlist->prepend(post);
     int count = 0;
-    foreach (const Post &p, *list) {
+    foreach (const Post &p, *nlist) {
         if (!p.draft())
             ++count;
     }
     if (count > 3)
-        list->removeLast();
+        nlist->removeLast();
+    locker.setObject(nlist, toCost(estimateSize(*nlist)));
     return true;
 }
 
@@ -101,11 +362,13 @@ ClearCacheFunctionMap availableClearCacheFunctions()
         map.insert("custom_links", &clearCustomLinks);
         map.insert("dynamic_files", &clearDynamicFilesCache);
         map.insert("friend_list", &clearFriendListCache);
-        map.insert("ip_ban_info_list", &clearIpBanInfoListCache);
+        map.insert("highlighted_code", &clearHighlightedCodeCache);
         map.insert("last_n_posts", &clearLastNPostsCache);
         map.insert("news", &clearNewsCache);
         map.insert("op_posts", &clearOpPostsCache);
+        map.insert("pages", &clearPagesCache);
         map.insert("posts", &clearPostsCache);
+        map.insert("rendered_posts", &clearRenderedPostsCache);
         map.insert("rules", &clearRulesCache);
         map.insert("static_files", &clearStaticFilesCache);
         map.insert("thread_posts", &clearThreadPostsCache);
@@ -121,11 +384,13 @@ SetMaxCacheSizeFunctionMap availableSetMaxCacheSizeFunctions()
         map.insert("custom_links", &setCustomLinksMaxCacheSize);
         map.insert("dynamic_files", &setDynamicFilesMaxCacheSize);
         map.insert("friend_list", &setFriendListMaxCacheSize);
-        map.insert("ip_ban_info_list", &setIpBanInfoListMaxCacheSize);
+        map.insert("highlighted_code", &setHighlightedCodeMaxCacheSize);
         map.insert("last_n_posts", &setLastNPostsMaxCacheSize);
         map.insert("news", &setNewsMaxCacheSize);
         map.insert("op_posts", &setOpPostsMaxCacheSize);
+        map.insert("pages", &setPagesMaxCacheSize);
         map.insert("posts", &setPostsMaxCacheSize);
+        map.insert("rendered_posts", &setRenderedPostsMaxCacheSize);
         map.insert("rules", &setRulesMaxCacheSize);
         map.insert("static_files", &setStaticFilesMaxCacheSize);
         map.insert("thread_posts", &setThreadPostsMaxCacheSize);
@@ -142,11 +407,13 @@ QStringList availableCacheNames()
         names << "home_page";
         names << "dynamic_files";
         names << "friend_list";
-        names << "ip_ban_info_list";
+        names << "highlighted_code";
         names << "last_n_posts";
         names << "news";
         names << "op_posts";
+        names << "pages";
         names << "posts";
+        names << "rendered_posts";
         names << "rules";
         names << "static_files";
         names << "thread_posts";
@@ -155,13 +422,11 @@ QStringList availableCacheNames()
     return names;
 }
 
-bool cacheCustomContent(const QString &prefix, const QLocale &l, QString *content)
+bool cacheCustomContent(const QString &prefix, const QLocale &l, const QSharedPointer<QString> &content)
 {
     if (prefix.isEmpty() || !content)
         return false;
-    QWriteLocker locker(&customContentLock);
-    do_once(init)
-        initCache(theCustomContent, "custom_content", defaultCustomContentCacheSize);
+    theCustomContent.init();
     int sz = content->length() * 2;
     if (theCustomContent.maxCost() < sz)
         return false;
@@ -169,43 +434,37 @@ bool cacheCustomContent(const QString &prefix, const QLocale &l, QString *conten
     return true;
 }
 
-bool cacheCustomLinks(const QLocale &l, CustomLinkInfoList *list)
+bool cacheCustomLinks(const QLocale &l, const QSharedPointer<CustomLinkInfoList> &list)
 {
     if (!list)
         return false;
-    QWriteLocker locker(&customLinksLock);
-    do_once(init)
-        initCache(theCustomLinks, "custom_links", defaultCustomLinksCacheSize);
+    theCustomLinks.init();
     int sz = list->size();
     if (theCustomLinks.maxCost() < sz)
         return false;
-    theCustomLinks.insert(l.name(), list, sz);
+    theCustomLinks.insert(l.name(), list, sz, sz * sizeof(Tools::CustomLinkInfo));
     return true;
 }
 
-File *cacheDynamicFile(const QString &path, const QByteArray &file)
+QSharedPointer<File> cacheDynamicFile(const QString &path, const QByteArray &file)
 {
     if (path.isEmpty())
-        return 0;
-    QWriteLocker locker(&dynamicFilesLock);
-    do_once(init)
-        initCache(dynamicFiles, "dynamic_files", defaultDynamicFilesCacheSize);
+        return QSharedPointer<File>();
+    dynamicFiles.init();
     if (dynamicFiles.maxCost() < (file.size() + 8))
-        return 0;
-    File *f = new File;
+        return QSharedPointer<File>();
+    QSharedPointer<File> f(new File);
     f->data = file;
     f->msecsSinceEpoch = (QDateTime::currentMSecsSinceEpoch() / 1000) * 1000;
     dynamicFiles.insert(path, f, file.size() + 8);
     return f;
 }
 
-bool cacheFriendList(Tools::FriendList *list)
+bool cacheFriendList(const QSharedPointer<Tools::FriendList> &list)
 {
     if (!list)
         return false;
-    QWriteLocker locker(&friendListLock);
-    do_once(init)
-        initCache(theFriendList, "friend_list", defaultFriendListCacheSize);
+    theFriendList.init();
     int sz = 0;
     foreach (const Tools::Friend &f, *list)
         sz += f.name.length() * 2 + f.title.length() * 2 + f.url.length() * 2;
@@ -215,41 +474,35 @@ bool cacheFriendList(Tools::FriendList *list)
     return true;
 }
 
-bool cacheIpBanInfoList(IpBanInfoList *list)
+bool cacheHighlightedCode(const QString &key, const QString &html)
 {
-    if (!list)
+    if (key.isEmpty())
         return false;
-    QWriteLocker locker(&ipBanInfoListLock);
-    do_once(init)
-        initCache(theIpBanInfoList, "ip_ban_info_list", defaultIpBanInfoListCacheSize);
-    int sz = list->size() * 2 * sizeof(int);
-    if (theIpBanInfoList.maxCost() < sz)
+    theHighlightedCode.init();
+    int sz = html.length() * 2;
+    if (theHighlightedCode.maxCost() < sz)
         return false;
-    theIpBanInfoList.insert("x", list, sz);
+    theHighlightedCode.insert(key, QSharedPointer<QString>(new QString(html)), sz);
     return true;
 }
 
-bool cacheLastNPosts(const QString &boardName, quint64 threadNumber, PostList *list)
+bool cacheLastNPosts(const QString &boardName, quint64 threadNumber, const QSharedPointer<PostList> &list)
 {
     if (boardName.isEmpty() || !threadNumber || !list)
         return false;
-    QWriteLocker locker(&lastNPostsLock);
-    do_once(init)
-        initCache(theLastNPosts, "last_n_posts", defaultLastNPostsCacheSize);
-    int sz = list->size();
+    theLastNPosts.init();
+    int sz = toCost(estimateSize(*list));
     if (theLastNPosts.maxCost() < sz)
         return false;
     theLastNPosts.insert(boardName + "/" + QString::number(threadNumber), list, sz);
     return true;
 }
 
-bool cacheNews(const QLocale &locale, QStringList *news)
+bool cacheNews(const QLocale &locale, const QSharedPointer<QStringList> &news)
 {
     if (!news)
         return false;
-    QWriteLocker locker(&newsLock);
-    do_once(init)
-        initCache(theNews, "news", defaultNewsCacheSize);
+    theNews.init();
     int sz = 0;
     foreach (const QString &r, *news)
         sz = r.length() * 2;
@@ -259,39 +512,65 @@ bool cacheNews(const QLocale &locale, QStringList *news)
     return true;
 }
 
-bool cacheOpPost(const QString &boardName, quint64 threadNumber, Post *post)
+bool cacheOpPost(const QString &boardName, quint64 threadNumber, const QSharedPointer<Post> &post)
 {
     if (boardName.isEmpty() || !threadNumber || !post)
         return false;
-    QWriteLocker locker(&opPostsLock);
-    do_once(init)
-        initCache(theOpPosts, "op_posts", defaultOpPostsCacheSize);
-    if (theOpPosts.maxCost() < 1)
+    theOpPosts.init();
+    int sz = toCost(estimateSize(*post));
+    if (theOpPosts.maxCost() < sz)
+        return false;
+    theOpPosts.insert(boardName + "/" + QString::number(threadNumber), post, sz);
+    return true;
+}
+
+bool cachePage(const QString &key, const Page &page)
+{
+    if (key.isEmpty())
+        return false;
+    thePages.init();
+    int sz = page.data.size() + page.eTag.size();
+    if (thePages.maxCost() < sz)
         return false;
-    theOpPosts.insert(boardName + "/" + QString::number(threadNumber), post, 1);
+    thePages.insert(key, QSharedPointer<Page>(new Page(page)), sz);
     return true;
 }
 
-bool cachePost(const QString &boardName, quint64 postNumber, Content::Post *post)
+bool cachePost(const QString &boardName, quint64 postNumber, const QSharedPointer<Content::Post> &post)
 {
     if (boardName.isEmpty() || !postNumber || !post)
         return false;
-    QWriteLocker locker(&postsLock);
-    do_once(init)
-        initCache(thePosts, "posts", defaultPostsCacheSize);
-    if (thePosts.maxCost() < 1)
+    thePosts.init();
+    int sz = toCost(estimateSize(*post));
+    if (thePosts.maxCost() < sz)
         return false;
-    thePosts.insert(boardName + "/" + QString::number(postNumber), post, 1);
+    thePosts.insert(boardName + "/" + QString::number(postNumber), post, sz);
     return true;
 }
 
-bool cacheRules(const QString &prefix, const QLocale &locale, QStringList *rules)
+bool cacheRenderedPost(const QString &boardName, quint64 postNumber, const QString &variant,
+                       const Content::Post &post)
+{
+    if (boardName.isEmpty() || !postNumber || variant.isEmpty())
+        return false;
+    theRenderedPosts.init();
+    QString key = boardName + "/" + QString::number(postNumber);
+    NamedCache<RenderedPostMap>::WriteLocker locker(theRenderedPosts, key);
+    QSharedPointer<RenderedPostMap> old = locker.object();
+    QSharedPointer<RenderedPostMap> map(old ? new RenderedPostMap(*old) : new RenderedPostMap);
+    map->insert(variant, post);
+    int sz = toCost(estimateSize(*map));
+    if (theRenderedPosts.maxCost() < sz)
+        return false;
+    theRenderedPosts.insert(key, map, sz);
+    return true;
+}
+
+bool cacheRules(const QString &prefix, const QLocale &locale, const QSharedPointer<QStringList> &rules)
 {
     if (prefix.isEmpty() || !rules)
         return false;
-    QWriteLocker locker(&rulesLock);
-    do_once(init)
-        initCache(theRules, "rules", defaultRulesCacheSize);
+    theRules.init();
     int sz = 0;
     foreach (const QString &r, *rules)
         sz = r.length() * 2;
@@ -301,46 +580,40 @@ bool cacheRules(const QString &prefix, const QLocale &locale, QStringList *rules
     return true;
 }
 
-File *cacheStaticFile(const QString &path, const QByteArray &file)
+QSharedPointer<File> cacheStaticFile(const QString &path, const QByteArray &file)
 {
     if (path.isEmpty())
-        return 0;
-    QWriteLocker locker(&staticFilesLock);
-    do_once(init)
-        initCache(staticFiles, "static_files", defaultStaticFilesCacheSize);
+        return QSharedPointer<File>();
+    staticFiles.init();
     if (staticFiles.maxCost() < (file.size() + 8))
-        return 0;
-    File *f = new File;
+        return QSharedPointer<File>();
+    QSharedPointer<File> f(new File);
     f->data = file;
     f->msecsSinceEpoch = (QDateTime::currentMSecsSinceEpoch() / 1000) * 1000;
     staticFiles.insert(path, f, file.size() + 8);
     return f;
 }
 
-bool cacheThreadPosts(const QString &boardName, quint64 threadNumber, PostList *list)
+bool cacheThreadPosts(const QString &boardName, quint64 threadNumber, const QSharedPointer<PostList> &list)
 {
     if (boardName.isEmpty() || !threadNumber || !list)
         return false;
-    QWriteLocker locker(&threadPostsLock);
-    do_once(init)
-        initCache(theThreadPosts, "thread_posts", defaultThreadPostsCacheSize);
-    int sz = list->size();
+    theThreadPosts.init();
+    int sz = toCost(estimateSize(*list));
     if (theThreadPosts.maxCost() < sz)
         return false;
     theThreadPosts.insert(boardName + "/" + QString::number(threadNumber), list, sz);
     return true;
 }
 
-bool cacheTranslator(const QString &name, const QLocale &locale, BTranslator *t)
+bool cacheTranslator(const QString &name, const QLocale &locale, const QSharedPointer<BTranslator> &t)
 {
     if (name.isEmpty() || !t)
         return false;
-    QWriteLocker locker(&translatorsLock);
-    do_once(init)
-        initCache(translators, "translators", defaultTranslationsCacheSize);
+    translators.init();
     if (translators.maxCost() < 1)
         return false;
-    translators.insert(name + "_" + locale.name(), t, 1);
+    translators.insert(name + "_" + locale.name(), t, 1, sizeof(BTranslator));
     return true;
 }
 
@@ -356,93 +629,88 @@ bool clearCache(const QString &name, QString *err, const QLocale &l)
 
 void clearCustomContent()
 {
-    QWriteLocker locker(&customContentLock);
     theCustomContent.clear();
 }
 
 void clearCustomLinks()
 {
-    QWriteLocker locker(&customLinksLock);
     theCustomLinks.clear();
 }
 
 void clearDynamicFilesCache()
 {
-    QWriteLocker locker(&dynamicFilesLock);
     dynamicFiles.clear();
 }
 
 void clearFriendListCache()
 {
-    QWriteLocker locker(&friendListLock);
     theFriendList.clear();
 }
 
-void clearIpBanInfoListCache()
+void clearHighlightedCodeCache()
 {
-    QWriteLocker locker(&ipBanInfoListLock);
-    theIpBanInfoList.clear();
+    theHighlightedCode.clear();
 }
 
 void clearLastNPostsCache()
 {
-    QWriteLocker locker(&lastNPostsLock);
     theLastNPosts.clear();
 }
 
 void clearNewsCache()
 {
-    QWriteLocker locker(&newsLock);
     theNews.clear();
 }
 
 void clearOpPostsCache()
 {
-    QWriteLocker locker(&opPostsLock);
     theOpPosts.clear();
 }
 
+void clearPagesCache()
+{
+    thePages.clear();
+}
+
 void clearPostsCache()
 {
-    QWriteLocker locker(&postsLock);
     thePosts.clear();
 }
 
+void clearRenderedPostsCache()
+{
+    theRenderedPosts.clear();
+}
+
 void clearRulesCache()
 {
-    QWriteLocker locker(&rulesLock);
     theRules.clear();
 }
 
 void clearStaticFilesCache()
 {
-    QWriteLocker locker(&staticFilesLock);
     staticFiles.clear();
 }
 
 void clearThreadPostsCache()
 {
-    QWriteLocker locker(&threadPostsLock);
     theThreadPosts.clear();
 }
 
 void clearTranslatorsCache()
 {
-    QWriteLocker locker(&translatorsLock);
     translators.clear();
 }
 
-QString *customContent(const QString &prefix, const QLocale &l)
+QSharedPointer<QString> customContent(const QString &prefix, const QLocale &l)
 {
     if (prefix.isEmpty())
-        return 0;
-    QReadLocker locker(&customContentLock);
+        return QSharedPointer<QString>();
     return theCustomContent.object(prefix + "/" + l.name());
 }
 
-CustomLinkInfoList *customLinks(const QLocale &l)
+QSharedPointer<CustomLinkInfoList> customLinks(const QLocale &l)
 {
-    QReadLocker locker(&customLinksLock);
     return theCustomLinks.object(l.name());
 }
 
@@ -454,10 +722,12 @@ int defaultCacheSize(const QString &name)
         map.insert("custom_links", defaultCustomLinksCacheSize);
         map.insert("dynamic_files", defaultDynamicFilesCacheSize);
         map.insert("friend_list", defaultFriendListCacheSize);
-        map.insert("ip_ban_info_list", defaultIpBanInfoListCacheSize);
+        map.insert("highlighted_code", defaultHighlightedCodeCacheSize);
         map.insert("last_n_posts", defaultLastNPostsCacheSize);
         map.insert("news", defaultNewsCacheSize);
         map.insert("op_posts", defaultOpPostsCacheSize);
+        map.insert("pages", defaultPagesCacheSize);
+        map.insert("rendered_posts", defaultRenderedPostsCacheSize);
         map.insert("rules", defaultRulesCacheSize);
         map.insert("static_files", defaultStaticFilesCacheSize);
         map.insert("thread_posts", defaultThreadPostsCacheSize);
@@ -466,78 +736,199 @@ int defaultCacheSize(const QString &name)
     return map.value(name);
 }
 
-File *dynamicFile(const QString &path)
+QSharedPointer<File> dynamicFile(const QString &path)
 {
     if (path.isEmpty())
-        return 0;
-    QReadLocker locker(&dynamicFilesLock);
+        return QSharedPointer<File>();
     return dynamicFiles.object(path);
 }
 
-Tools::FriendList *friendList()
+qint64 estimateSize(const Content::Post &post)
+{
+    qint64 sz = sizeof(Content::Post);
+    sz += heapSize(post.cityName) + heapSize(post.countryName) + heapSize(post.dateTime) + heapSize(post.email);
+    sz += heapSize(post.files);
+    foreach (const Content::File &f, post.files) {
+        sz += heapSize(f.size) + heapSize(f.sizeKB) + heapSize(f.sizeTooltip) + heapSize(f.sourceName);
+        sz += heapSize(f.thumbName) + heapSize(f.type) + heapSize(f.audioTagAlbum) + heapSize(f.audioTagArtist);
+        sz += heapSize(f.audioTagTitle) + heapSize(f.audioTagYear);
+    }
+    sz += heapSize(post.flagName) + heapSize(post.ip) + heapSize(post.markupMode);
+    sz += heapSize(post.modificationDateTime) + heapSize(post.name) + heapSize(post.nameRaw);
+    sz += heapSize(post.rawName) + heapSize(post.rawPostText) + heapSize(post.rawSubject);
+    sz += heapSize(post.referencedBy) + heapSize(post.refersTo);
+    foreach (const Content::Post::Ref &r, post.referencedBy)
+        sz += heapSize(r.boardName);
+    foreach (const Content::Post::Ref &r, post.refersTo)
+        sz += heapSize(r.boardName);
+    sz += heapSize(post.subject) + heapSize(post.text) + heapSize(post.tripcode) + heapSize(post.userData);
+    return sz;
+}
+
+qint64 estimateSize(const Post &post)
+{
+    qint64 sz = sizeof(Post);
+    sz += heapSize(post.board()) + heapSize(post.dateTime()) + heapSize(post.modificationDateTime());
+    sz += heapSize(post.email()) + heapSize(post.fileInfos()) + heapSize(post.hashpass()) + heapSize(post.name());
+    sz += heapSize(post.password()) + heapSize(post.posterIp()) + heapSize(post.countryCode());
+    sz += heapSize(post.countryName()) + heapSize(post.cityName()) + heapSize(post.rawText());
+    sz += heapSize(post.referencedBy()) + heapSize(post.refersTo()) + heapSize(post.subject()) + heapSize(post.text());
+    sz += heapSize(post.userData());
+    return sz;
+}
+
+qint64 estimateSize(const PostList &list)
+{
+    qint64 sz = sizeof(PostList);
+    if (!list.isEmpty())
+        sz += HeapBlockOverhead + ArrayHeaderSize + list.size() * (sizeof(void *) + HeapBlockOverhead);
+    foreach (const Post &post, list)
+        sz += estimateSize(post);
+    return sz;
+}
+
+QSharedPointer<Tools::FriendList> friendList()
 {
-    QReadLocker locker(&friendListLock);
     return theFriendList.object("x");
 }
 
-IpBanInfoList *ipBanInfoList()
+bool highlightedCode(const QString &key, QString *html)
+{
+    if (key.isEmpty() || !html)
+        return false;
+    QSharedPointer<QString> s = theHighlightedCode.object(key);
+    if (!s)
+        return false;
+    *html = *s;
+    return true;
+}
+
+QStringList hotKeys(const QString &name, int max, bool *ok)
+{
+    AbstractNamedCache *c = namedCaches().value(name);
+    if (!c)
+        return bRet(ok, false, QStringList());
+    return bRet(ok, true, c->keys(max));
+}
+
+void invalidatePages(const QString &boardName, quint64 threadNumber)
 {
-    QReadLocker locker(&ipBanInfoListLock);
-    return theIpBanInfoList.object("x");
+    if (boardName.isEmpty())
+        return;
+    QWriteLocker locker(&pageGenerationsLock);
+    ++lastPageGeneration;
+    pageGenerations.insert(boardName, lastPageGeneration);
+    if (threadNumber)
+        pageGenerations.insert(boardName + "/" + QString::number(threadNumber), lastPageGeneration);
 }
 
-PostList *lastNPosts(const QString &boardName, quint64 threadNumber)
+QSharedPointer<PostList> lastNPosts(const QString &boardName, quint64 threadNumber, LoadLock *lock)
 {
     if (boardName.isEmpty() || !threadNumber)
-        return 0;
-    QReadLocker locker(&lastNPostsLock);
-    return theLastNPosts.object(boardName + "/" + QString::number(threadNumber));
+        return QSharedPointer<PostList>();
+    return objectOrLock(theLastNPosts, boardName + "/" + QString::number(threadNumber), lock);
+}
+
+QString maxCacheSizeKey(const QString &name)
+{
+    init_once(QStringList, byteCharged, QStringList()) {
+        byteCharged << "last_n_posts";
+        byteCharged << "op_posts";
+        byteCharged << "posts";
+        byteCharged << "rendered_posts";
+        byteCharged << "thread_posts";
+    }
+    return byteCharged.contains(name) ? "max_bytes" : "max_size";
+}
+
+int memoryBudget()
+{
+    int budget = theMemoryBudget.load();
+    if (budget >= 0)
+        return budget;
+    budget = SettingsLocker()->value("Cache/memory_budget", defaultMemoryBudget).toInt();
+    theMemoryBudget.testAndSetOrdered(-1, qMax(budget, 0));
+    return theMemoryBudget.load();
+}
+
+qint64 memoryUsage()
+{
+    return theTotalBytes.load();
 }
 
-QStringList *news(const QLocale &locale)
+QSharedPointer<QStringList> news(const QLocale &locale)
 {
-    QReadLocker locker(&newsLock);
     return theNews.object(locale.name());
 }
 
-Post *opPost(const QString &boardName, quint64 threadNumber)
+QSharedPointer<Post> opPost(const QString &boardName, quint64 threadNumber, LoadLock *lock)
 {
     if (boardName.isEmpty() || !threadNumber)
+        return QSharedPointer<Post>();
+    return objectOrLock(theOpPosts, boardName + "/" + QString::number(threadNumber), lock);
+}
+
+bool page(const QString &key, Page *page)
+{
+    if (key.isEmpty() || !page)
+        return false;
+    QSharedPointer<Page> p = thePages.object(key);
+    if (!p)
+        return false;
+    *page = *p;
+    return true;
+}
+
+quint64 pageGeneration(const QString &boardName, quint64 threadNumber)
+{
+    if (boardName.isEmpty())
         return 0;
-    QReadLocker locker(&opPostsLock);
-    return theOpPosts.object(boardName + "/" + QString::number(threadNumber));
+    QReadLocker locker(&pageGenerationsLock);
+    if (!threadNumber)
+        return pageGenerations.value(boardName);
+    return pageGenerations.value(boardName + "/" + QString::number(threadNumber), removedThreadPageGeneration);
 }
 
-Content::Post *post(const QString &boardName, quint64 postNumber)
+QSharedPointer<Content::Post> post(const QString &boardName, quint64 postNumber, LoadLock *lock)
 {
     if (boardName.isEmpty() || !postNumber)
-        return 0;
-    QReadLocker locker(&postsLock);
-    return thePosts.object(boardName + "/" + QString::number(postNumber));
+        return QSharedPointer<Content::Post>();
+    return objectOrLock(thePosts, boardName + "/" + QString::number(postNumber), lock);
 }
 
 void removePost(const QString &boardName, quint64 postNumber)
 {
     if (boardName.isEmpty() || !postNumber)
         return;
-    QWriteLocker locker(&postsLock);
     thePosts.remove(boardName + "/" + QString::number(postNumber));
+    removeRenderedPost(boardName, postNumber);
+}
+
+void removeRenderedPost(const QString &boardName, quint64 postNumber)
+{
+    if (boardName.isEmpty() || !postNumber)
+        return;
+    theRenderedPosts.remove(boardName + "/" + QString::number(postNumber));
 }
 
 void removeLastNPost(const QString &boardName, quint64 threadNumber, quint64 postNumber)
 {
     if (boardName.isEmpty() || !threadNumber || !postNumber)
         return;
-    QWriteLocker locker(&lastNPostsLock);
-    PostList *list = theLastNPosts.object(boardName + "/" + QString::number(threadNumber));
+    NamedCache<PostList>::WriteLocker locker(theLastNPosts, boardName + "/" + QString::number(threadNumber));
+    QSharedPointer<PostList> list = locker.object();
     if (!list)
         return;
     foreach (int i, bRangeD(0, list->size() - 1)) {
         if (list->at(i).number() == postNumber) {
-            if (list->at(i).draft())
+            if (list->at(i).draft()) {
+                locker.unlock();
                 theLastNPosts.clear();
-            else
-                list->removeAt(i);
+            } else {
+                QSharedPointer<PostList> nlist(new PostList(*list));
+                nlist->removeAt(i);
+                locker.setObject(nlist, toCost(estimateSize(*nlist)));
+            }
             return;
         }
     }
@@ -547,7 +938,6 @@ void removeLastNPosts(const QString &boardName, quint64 threadNumber)
 {
     if (boardName.isEmpty() || !threadNumber)
         return;
-    QWriteLocker locker(&lastNPostsLock);
     theLastNPosts.remove(boardName + "/" + QString::number(threadNumber));
 }
 
@@ -555,7 +945,6 @@ void removeOpPost(const QString &boardName, quint64 threadNumber)
 {
     if (boardName.isEmpty() || !threadNumber)
         return;
-    QWriteLocker locker(&opPostsLock);
     theOpPosts.remove(boardName + "/" + QString::number(threadNumber));
 }
 
@@ -563,31 +952,56 @@ void removeThreadPost(const QString &boardName, quint64 threadNumber, quint64 po
 {
     if (boardName.isEmpty() || !threadNumber || !postNumber)
         return;
-    QWriteLocker locker(&threadPostsLock);
-    PostList *list = theThreadPosts.object(boardName + "/" + QString::number(threadNumber));
+    NamedCache<PostList>::WriteLocker locker(theThreadPosts, boardName + "/" + QString::number(threadNumber));
+    QSharedPointer<PostList> list = locker.object();
     if (!list)
         return;
     foreach (int i, bRangeD(0, list->size() - 1)) {
         if (list->at(i).number() == postNumber) {
-            list->removeAt(i);
+            QSharedPointer<PostList> nlist(new PostList(*list));
+            locker.setObject(nlist, toCost(locker.cost() - estimateSize(nlist->takeAt(i))));
             return;
         }
     }
 }
 
+void removeThreadPages(const QString &boardName, quint64 threadNumber)
+{
+    if (boardName.isEmpty() || !threadNumber)
+        return;
+    QWriteLocker locker(&pageGenerationsLock);
+    ++lastPageGeneration;
+    pageGenerations.insert(boardName, lastPageGeneration);
+    pageGenerations.remove(boardName + "/" + QString::number(threadNumber));
+    //NOTE: Threads without an entry share this generation, so the cached pages of the removed thread never match again
+    removedThreadPageGeneration = lastPageGeneration;
+}
+
 void removeThreadPosts(const QString &boardName, quint64 threadNumber)
 {
     if (boardName.isEmpty() || !threadNumber)
         return;
-    QWriteLocker locker(&threadPostsLock);
     theThreadPosts.remove(boardName + "/" + QString::number(threadNumber));
 }
 
-QStringList *rules(const QLocale &locale, const QString &prefix)
+bool renderedPost(const QString &boardName, quint64 postNumber, const QString &variant, Content::Post *post)
+{
+    if (boardName.isEmpty() || !postNumber || variant.isEmpty() || !post)
+        return false;
+    QSharedPointer<RenderedPostMap> map = theRenderedPosts.object(boardName + "/" + QString::number(postNumber));
+    if (!map)
+        return false;
+    RenderedPostMap::ConstIterator i = map->constFind(variant);
+    if (map->constEnd() == i)
+        return false;
+    *post = i.value();
+    return true;
+}
+
+QSharedPointer<QStringList> rules(const QLocale &locale, const QString &prefix)
 {
     if (prefix.isEmpty())
-        return 0;
-    QReadLocker locker(&rulesLock);
+        return QSharedPointer<QStringList>();
     return theRules.object(prefix + "/" + locale.name());
 }
 
@@ -595,7 +1009,6 @@ void setCustomContentMaxCacheSize(int size)
 {
     if (size < 0)
         return;
-    QWriteLocker locker(&customContentLock);
     theCustomContent.setMaxCost(size);
 }
 
@@ -603,7 +1016,6 @@ void setCustomLinksMaxCacheSize(int size)
 {
     if (size < 0)
         return;
-    QWriteLocker locker(&customLinksLock);
     theCustomLinks.setMaxCost(size);
 }
 
@@ -611,7 +1023,6 @@ void setDynamicFilesMaxCacheSize(int size)
 {
     if (size < 0)
         return;
-    QWriteLocker locker(&dynamicFilesLock);
     dynamicFiles.setMaxCost(size);
 }
 
@@ -619,23 +1030,20 @@ void setFriendListMaxCacheSize(int size)
 {
     if (size < 0)
         return;
-    QWriteLocker locker(&friendListLock);
     theFriendList.setMaxCost(size);
 }
 
-void setIpBanInfoListMaxCacheSize(int size)
+void setHighlightedCodeMaxCacheSize(int size)
 {
     if (size < 0)
         return;
-    QWriteLocker locker(&ipBanInfoListLock);
-    theIpBanInfoList.setMaxCost(size);
+    theHighlightedCode.setMaxCost(size);
 }
 
 void setLastNPostsMaxCacheSize(int size)
 {
     if (size < 0)
         return;
-    QWriteLocker locker(&lastNPostsLock);
     theLastNPosts.setMaxCost(size);
 }
 
@@ -651,11 +1059,18 @@ bool setMaxCacheSize(const QString &name, int size, QString *err, const QLocale
     return bRet(err, QString(), true);
 }
 
+void setMemoryBudget(int megabytes)
+{
+    if (megabytes < 0)
+        return;
+    theMemoryBudget.fetchAndStoreOrdered(megabytes);
+    enforceMemoryBudget(0);
+}
+
 void setNewsMaxCacheSize(int size)
 {
     if (size < 0)
         return;
-    QWriteLocker locker(&newsLock);
     theNews.setMaxCost(size);
 }
 
@@ -663,23 +1078,34 @@ void setOpPostsMaxCacheSize(int size)
 {
     if (size < 0)
         return;
-    QWriteLocker locker(&opPostsLock);
     theOpPosts.setMaxCost(size);
 }
 
+void setPagesMaxCacheSize(int size)
+{
+    if (size < 0)
+        return;
+    thePages.setMaxCost(size);
+}
+
 void setPostsMaxCacheSize(int size)
 {
     if (size < 0)
         return;
-    QWriteLocker locker(&postsLock);
     thePosts.setMaxCost(size);
 }
 
+void setRenderedPostsMaxCacheSize(int size)
+{
+    if (size < 0)
+        return;
+    theRenderedPosts.setMaxCost(size);
+}
+
 void setRulesMaxCacheSize(int size)
 {
     if (size < 0)
         return;
-    QWriteLocker locker(&rulesLock);
     theRules.setMaxCost(size);
 }
 
@@ -687,7 +1113,6 @@ void setStaticFilesMaxCacheSize(int size)
 {
     if (size < 0)
         return;
-    QWriteLocker locker(&staticFilesLock);
     staticFiles.setMaxCost(size);
 }
 
@@ -695,7 +1120,6 @@ void setThreadPostsMaxCacheSize(int size)
 {
     if (size < 0)
         return;
-    QWriteLocker locker(&threadPostsLock);
     theThreadPosts.setMaxCost(size);
 }
 
@@ -703,48 +1127,75 @@ void setTranslatorsMaxCacheSize(int size)
 {
     if (size < 0)
         return;
-    QWriteLocker locker(&translatorsLock);
     translators.setMaxCost(size);
 }
 
-File *staticFile(const QString &path)
+QSharedPointer<File> staticFile(const QString &path)
 {
     if (path.isEmpty())
-        return 0;
-    QReadLocker locker(&staticFilesLock);
+        return QSharedPointer<File>();
     return staticFiles.object(path);
 }
 
-PostList *threadPosts(const QString &boardName, quint64 threadNumber)
+Statistics statistics(const QString &name, bool *ok)
+{
+    AbstractNamedCache *c = namedCaches().value(name);
+    if (!c) {
+        Statistics s;
+        s.name = name;
+        s.hits = 0;
+        s.misses = 0;
+        s.inserts = 0;
+        s.evictions = 0;
+        s.count = 0;
+        s.cost = 0;
+        s.maxCost = 0;
+        s.bytes = 0;
+        return bRet(ok, false, s);
+    }
+    return bRet(ok, true, c->statistics());
+}
+
+StatisticsList statistics()
+{
+    StatisticsList list;
+    foreach (AbstractNamedCache *c, namedCaches())
+        list << c->statistics();
+    return list;
+}
+
+QSharedPointer<PostList> threadPosts(const QString &boardName, quint64 threadNumber, LoadLock *lock)
 {
     if (boardName.isEmpty() || !threadNumber)
-        return 0;
-    QReadLocker locker(&threadPostsLock);
-    return theThreadPosts.object(boardName + "/" + QString::number(threadNumber));
+        return QSharedPointer<PostList>();
+    return objectOrLock(theThreadPosts, boardName + "/" + QString::number(threadNumber), lock);
 }
 
-BTranslator *translator(const QString &name, const QLocale &locale)
+QSharedPointer<BTranslator> translator(const QString &name, const QLocale &locale, LoadLock *lock)
 {
     if (name.isEmpty())
-        return 0;
-    QReadLocker locker(&translatorsLock);
-    return translators.object(name + "_" + locale.name());
+        return QSharedPointer<BTranslator>();
+    return objectOrLock(translators, name + "_" + locale.name(), lock);
 }
 
 bool updateLastNPost(const QString &boardName, quint64 threadNumber, const Post &post)
 {
     if (boardName.isEmpty() || !threadNumber)
         return false;
-    QWriteLocker locker(&lastNPostsLock);
-    PostList *list = theLastNPosts.object(boardName + "/" + QString::number(threadNumber));
+    NamedCache<PostList>::WriteLocker locker(theLastNPosts, boardName + "/" + QString::number(threadNumber));
+    QSharedPointer<PostList> list = locker.object();
     if (!list)
         return false;
     foreach (int i, bRangeD(0, list->size() - 1)) {
         if (list->at(i).number() == post.number()) {
-            if (list->at(i).draft() != post.draft())
+            if (list->at(i).draft() != post.draft()) {
+                locker.unlock();
                 theLastNPosts.clear();
-            else
-                list->replace(i, post);
+            } else {
+                QSharedPointer<PostList> nlist(new PostList(*list));
+                nlist->replace(i, post);
+                locker.setObject(nlist, toCost(estimateSize(*nlist)));
+            }
             return true;
         }
     }
@@ -755,13 +1206,15 @@ bool updateThreadPost(const QString &boardName, quint64 threadNumber, const Post
 {
     if (boardName.isEmpty() || !threadNumber)
         return false;
-    QWriteLocker locker(&threadPostsLock);
-    PostList *list = theThreadPosts.object(boardName + "/" + QString::number(threadNumber));
+    NamedCache<PostList>::WriteLocker locker(theThreadPosts, boardName + "/" + QString::number(threadNumber));
+    QSharedPointer<PostList> list = locker.object();
     if (!list)
         return false;
     foreach (int i, bRangeD(0, list->size() - 1)) {
         if (list->at(i).number() == post.number()) {
-            list->replace(i, post);
+            QSharedPointer<PostList> nlist(new PostList(*list));
+            nlist->replace(i, post);
+            locker.setObject(nlist, toCost(locker.cost() - estimateSize(list->at(i)) + estimateSize(post)));
             return true;
         }
     }
@@ -0,0 +1,235 @@
+#include "cachewarmup.h"
+
+#include "cache.h"
+#include "database.h"
+#include "settingslocker.h"
+#include "stored/thread.h"
+#include "stored/thread-odb.hxx"
+#include "tools.h"
+#include "transaction.h"
+#include "translator.h"
+
+#include <BeQt>
+#include <BTerminal>
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QMap>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QSettings>
+#include <QSharedPointer>
+#include <QString>
+#include <QStringList>
+#include <QThread>
+#include <QThreadPool>
+#include <QVariant>
+#include <QVariantMap>
+
+#include <odb/database.hxx>
+#include <odb/exception.hxx>
+#include <odb/query.hxx>
+
+namespace CacheWarmUp
+{
+
+enum Target
+{
+    OpPostTarget = 0x01,
+    ThreadPostsTarget = 0x02,
+    LastNPostsTarget = 0x04
+};
+
+class Task : public QRunnable
+{
+public:
+    const QString BoardName;
+    const quint64 ThreadNumber;
+    const int Targets;
+public:
+    explicit Task(const QString &boardName, quint64 threadNumber, int targets);
+public:
+    void run();
+private:
+    bool warmUp();
+};
+
+static QMutex poolMutex(QMutex::Recursive);
+static QThreadPool *pool = 0;
+static QElapsedTimer elapsedTimer;
+static QAtomicInt cancelled;
+static QAtomicInt total;
+static QAtomicInt done;
+static QAtomicInt failed;
+
+static QMap<QString, int> targets()
+{
+    init_once(QMap<QString, int>, map, QMap<QString, int>()) {
+        map.insert("last_n_posts", LastNPostsTarget);
+        map.insert("op_posts", OpPostTarget);
+        map.insert("thread_posts", ThreadPostsTarget);
+    }
+    return map;
+}
+
+static void finish(bool ok)
+{
+    if (!ok)
+        failed.fetchAndAddOrdered(1);
+    int d = done.fetchAndAddOrdered(1) + 1;
+    int t = total.fetchAndAddOrdered(0);
+    int step = qMax(t / 10, 1);
+    if (d % step && d != t)
+        return;
+    TranslatorQt tq;
+    QMutexLocker locker(&poolMutex);
+    QString s = tq.translate("CacheWarmUp", "Warming up caches:", "message") + " " + QString::number(d) + "/"
+            + QString::number(t) + " (" + QString::number(elapsedTimer.elapsed()) + " "
+            + tq.translate("CacheWarmUp", "ms", "message") + ")";
+    int f = failed.fetchAndAddOrdered(0);
+    if (f)
+        s += ", " + tq.translate("CacheWarmUp", "failed:", "message") + " " + QString::number(f);
+    bWriteLine(s);
+}
+
+Task::Task(const QString &boardName, quint64 threadNumber, int targets) :
+    BoardName(boardName), ThreadNumber(threadNumber), Targets(targets)
+{
+    //
+}
+
+void Task::run()
+{
+    finish(!cancelled.fetchAndAddOrdered(0) && warmUp());
+}
+
+bool Task::warmUp()
+{
+    try {
+        Transaction t(Transaction::ReadOnlyMode);
+        if (!t)
+            return false;
+        odb::query<Thread> q = odb::query<Thread>::board == BoardName && odb::query<Thread>::number == ThreadNumber;
+        q = q && odb::query<Thread>::archived == false;
+        Database::Result<Thread> thread = Database::queryOne<Thread, Thread>(q);
+        if (thread.error || !thread)
+            return false;
+        const Thread::Posts &posts = thread->posts();
+        if (posts.isEmpty())
+            return false;
+        if (Targets & OpPostTarget) {
+            Cache::LoadLock lock;
+            if (!Cache::opPost(BoardName, ThreadNumber, &lock) && lock.isLocked()) {
+                Cache::cacheOpPost(BoardName, ThreadNumber, QSharedPointer<Post>(new Post(*posts.first().load())));
+            }
+        }
+        if (Targets & ThreadPostsTarget) {
+            Cache::LoadLock lock;
+            if (!Cache::threadPosts(BoardName, ThreadNumber, &lock) && lock.isLocked()) {
+                QSharedPointer<Cache::PostList> list(new Cache::PostList);
+                foreach (int i, bRangeD(1, posts.size() - 1))
+                    *list << *posts.at(i).load();
+                Cache::cacheThreadPosts(BoardName, ThreadNumber, list);
+            }
+        }
+        if (Targets & LastNPostsTarget) {
+            Cache::LoadLock lock;
+            if (!Cache::lastNPosts(BoardName, ThreadNumber, &lock) && lock.isLocked()) {
+                unsigned int maxPosts = Tools::maxInfo(Tools::MaxLastPosts, BoardName);
+                unsigned int count = 0;
+                QSharedPointer<Cache::PostList> list(new Cache::PostList);
+                foreach (int i, bRangeR(posts.size() - 1, 1)) {
+                    Post post = *posts.at(i).load();
+                    *list << post;
+                    if (!post.draft())
+                        ++count;
+                    if (count >= maxPosts)
+                        break;
+                }
+                Cache::cacheLastNPosts(BoardName, ThreadNumber, list);
+            }
+        }
+        t.commit();
+    } catch (const odb::exception &e) {
+        Tools::log("CacheWarmUp::Task::warmUp", e);
+        return false;
+    }
+    return true;
+}
+
+Progress progress()
+{
+    Progress p;
+    p.total = total.fetchAndAddOrdered(0);
+    p.done = done.fetchAndAddOrdered(0);
+    p.failed = failed.fetchAndAddOrdered(0);
+    p.running = p.done < p.total;
+    return p;
+}
+
+int restoreHotKeys(const QByteArray &data)
+{
+    QVariantMap m = BeQt::deserialize(data).toMap();
+    QStringList keys;
+    QMap<QString, int> threads;
+    QMap<QString, int> t = targets();
+    foreach (const QString &name, t.keys()) {
+        foreach (const QString &key, m.value(name).toStringList()) {
+            int ind = key.lastIndexOf('/');
+            bool ok = false;
+            if (ind <= 0 || !key.mid(ind + 1).toULongLong(&ok) || !ok)
+                continue;
+            if (!threads.contains(key))
+                keys << key;
+            threads[key] |= t.value(name);
+        }
+    }
+    QMutexLocker locker(&poolMutex);
+    if (pool || keys.isEmpty())
+        return 0;
+    int threadCount = SettingsLocker()->value("Cache/warm_up_thread_count", QThread::idealThreadCount()).toInt();
+    pool = new QThreadPool;
+    pool->setMaxThreadCount((threadCount > 0) ? threadCount : 1);
+    cancelled.fetchAndStoreOrdered(0);
+    total.fetchAndStoreOrdered(keys.size());
+    done.fetchAndStoreOrdered(0);
+    failed.fetchAndStoreOrdered(0);
+    elapsedTimer.start();
+    TranslatorQt tq;
+    bWriteLine(tq.translate("CacheWarmUp", "Warming up caches, threads queued:", "message") + " "
+               + QString::number(keys.size()));
+    foreach (const QString &key, keys) {
+        int ind = key.lastIndexOf('/');
+        pool->start(new Task(key.left(ind), key.mid(ind + 1).toULongLong(), threads.value(key)));
+    }
+    return keys.size();
+}
+
+QByteArray saveHotKeys()
+{
+    int count = SettingsLocker()->value("Cache/warm_up_key_count", defaultHotKeyCount).toInt();
+    QVariantMap m;
+    if (count <= 0)
+        return BeQt::serialize(m);
+    foreach (const QString &name, targets().keys())
+        m.insert(name, Cache::hotKeys(name, count));
+    return BeQt::serialize(m);
+}
+
+void stop()
+{
+    QMutexLocker locker(&poolMutex);
+    if (!pool)
+        return;
+    cancelled.fetchAndStoreOrdered(1);
+    QThreadPool *p = pool;
+    pool = 0;
+    locker.unlock();
+    p->waitForDone();
+    delete p;
+}
+
+}
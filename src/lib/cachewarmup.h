@@ -0,0 +1,28 @@
+#ifndef OLOLORD_CACHEWARMUP_H
+#define OLOLORD_CACHEWARMUP_H
+
+class QByteArray;
+
+#include "global.h"
+
+namespace CacheWarmUp
+{
+
+struct OLOLORD_EXPORT Progress
+{
+    int total;
+    int done;
+    int failed;
+    bool running;
+};
+
+const int defaultHotKeyCount = 1000;
+
+OLOLORD_EXPORT Progress progress();
+OLOLORD_EXPORT int restoreHotKeys(const QByteArray &data);
+OLOLORD_EXPORT QByteArray saveHotKeys();
+OLOLORD_EXPORT void stop();
+
+}
+
+#endif // OLOLORD_CACHEWARMUP_H
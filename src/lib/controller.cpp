@@ -907,8 +907,7 @@ bool testBan(cppcms::application &app, UserActionType proposedAction, const QStr
 
 bool testBanAjax(cppcms::application &app, UserActionType proposedAction, const QString &board)
 {
-    QString ip = Tools::userIp(app.request());
-    int lvl = Tools::ipBanLevel(ip);
+    int lvl = Tools::ipBanLevel(app.request());
     if (lvl >= proposedAction) {
         renderIpBanAjax(app, lvl);
         return false;
@@ -916,7 +915,7 @@ bool testBanAjax(cppcms::application &app, UserActionType proposedAction, const
     TranslatorQt tq(app.request());
     bool ok = false;
     QString err;
-    QMap<QString, Database::BanInfo> map = Database::userBanInfo(ip, &ok, &err, tq.locale());
+    QMap<QString, Database::BanInfo> map = Database::userBanInfo(app.request(), &ok, &err);
     if (!ok) {
         renderErrorAjax(app, tq.translate("testBanAjax", "Internal error", "error"), err);
         return false;
@@ -933,8 +932,7 @@ bool testBanAjax(cppcms::application &app, UserActionType proposedAction, const
 
 bool testBanNonAjax(cppcms::application &app, UserActionType proposedAction, const QString &board)
 {
-    QString ip = Tools::userIp(app.request());
-    int lvl = Tools::ipBanLevel(ip);
+    int lvl = Tools::ipBanLevel(app.request());
     if (lvl >= proposedAction) {
         renderIpBan(app, lvl);
         return false;
@@ -942,7 +940,7 @@ bool testBanNonAjax(cppcms::application &app, UserActionType proposedAction, con
     TranslatorQt tq(app.request());
     bool ok = false;
     QString err;
-    QMap<QString, Database::BanInfo> map = Database::userBanInfo(ip, &ok, &err, tq.locale());
+    QMap<QString, Database::BanInfo> map = Database::userBanInfo(app.request(), &ok, &err);
     if (!ok) {
         renderError(app, tq.translate("testBan", "Internal error", "error"), err);
         return false;
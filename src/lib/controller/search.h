@@ -25,11 +25,13 @@ public:
     bool error;
     std::string errorMessage;
     std::string errorDescription;
+    std::string nextPageUrl;
     std::string nothingFoundMessage;
     std::string query;
     std::string queryBoard;
     std::string resultsMessage;
     std::list<SearchResult> searchResults;
+    std::string toNextPageText;
 };
 
 }
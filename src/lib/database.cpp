@@ -6,6 +6,7 @@
 #include "controller.h"
 #include "controller/baseboard.h"
 #include "markup.h"
+#include "requestcontext.h"
 #include "search.h"
 #include "settingslocker.h"
 #include "stored/banneduser.h"
@@ -16,20 +17,18 @@
 #include "stored/registereduser-odb.hxx"
 #include "stored/thread.h"
 #include "stored/thread-odb.hxx"
+#include "threadindex.h"
 #include "tools.h"
 #include "transaction.h"
 #include "translator.h"
 
 #include <BDirTools>
 #include <BeQt>
-#include <BSqlDatabase>
 #include <BSqlQuery>
-#include <BSqlResult>
-#include <BSqlWhere>
 #include <BTerminal>
 #include <BTextTools>
-#include <BUuid>
 
+#include <QAtomicInt>
 #include <QByteArray>
 #include <QCryptographicHash>
 #include <QDateTime>
@@ -44,16 +43,32 @@
 #include <QElapsedTimer>
 #include <QFile>
 #include <QFileInfo>
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QMultiMap>
+#include <QPair>
 #include <QReadLocker>
 #include <QReadWriteLock>
+#include <QRunnable>
 #include <QScopedPointer>
+#include <QSet>
 #include <QSettings>
 #include <QSharedPointer>
+#include <QSqlDatabase>
+#include <QSqlQuery>
 #include <QString>
 #include <QStringList>
+#include <QThread>
+#include <QThreadPool>
+#include <QThreadStorage>
 #include <QTimeZone>
 #include <QVariant>
 #include <QVariantMap>
+#include <QVector>
+#include <QWaitCondition>
 #include <QWriteLocker>
 
 #include <cppcms/http_request.h>
@@ -74,11 +89,44 @@ struct PostTmpInfo
 {
     RefMap refs;
     QString board;
+    QString rawText;
     QString text;
     bool extendedWakabaMarkEnabled;
     bool bbCodeEnabled;
 };
 
+struct BanTableUpdate
+{
+    QString ip;
+    QList<BanInfo> bans;
+    QDateTime dateTime;
+    QMap<quint64, QDateTime> expirations;
+};
+
+class BanExpiryThread : public QThread
+{
+public:
+    void run();
+};
+
+class RerenderTask : public QRunnable
+{
+private:
+    PostTmpInfo &info;
+public:
+    explicit RerenderTask(PostTmpInfo &tmp);
+public:
+    void run();
+};
+
+struct GeolocationTable
+{
+    QVector<unsigned int> ipFrom;
+    QVector<unsigned int> ipTo;
+    QVector<int> locations;
+    QList<GeolocationInfo> infos;
+};
+
 RefKey::RefKey()
 {
     postNumber = 0;
@@ -100,6 +148,24 @@ bool RefKey::operator <(const RefKey &other) const
     return boardName < other.boardName || (boardName == other.boardName && postNumber < other.postNumber);
 }
 
+RerenderTask::RerenderTask(PostTmpInfo &tmp) :
+    info(tmp)
+{
+    //
+}
+
+void RerenderTask::run()
+{
+    Markup::MarkupLanguage ml = Markup::NoLanguage;
+    if (info.extendedWakabaMarkEnabled && info.bbCodeEnabled)
+        ml = Markup::AllLanguages;
+    else if (info.extendedWakabaMarkEnabled)
+        ml = Markup::ExtendedWakabaMarkLanguage;
+    else if (info.bbCodeEnabled)
+        ml = Markup::BBCodeLanguage;
+    info.text = Markup::processPostText(info.text, info.board, &info.refs, 0, ml);
+}
+
 bool BanInfo::isExpired() const
 {
     return expires.isValid() && expires <= QDateTime::currentDateTimeUtc();
@@ -223,14 +289,52 @@ public:
     }
 };
 
+typedef QHash< QString, QMap<QString, BanInfo> > BanTable;
+
+struct RegisteredUserInfo
+{
+    int level;
+    QStringList boards;
+};
+
+typedef QHash<QByteArray, RegisteredUserInfo> RegisteredUserTable;
+
+struct RegisteredUserTableCopy
+{
+    int generation;
+    QSharedPointer<const RegisteredUserTable> table;
+};
+
+static QMultiMap<QDateTime, quint64> banExpirations;
+static QWaitCondition banExpirationsCondition;
+static QMutex banExpirationsMutex;
+static const qint64 BanExpiryRetryInterval = BeQt::Minute;
+static bool banExpiryStopped = false;
+static BanExpiryThread *banExpiryThread = 0;
+static QSharedPointer<const BanTable> banTable;
+static QMutex banTableMutex;
+static const qint64 BanTableRetryInterval = 10 * BeQt::Second;
+static QElapsedTimer banTableRetryTimer;
+static QMutex banTableWriteMutex;
+static const qint64 GeolocationCheckInterval = 10 * BeQt::Second;
+static QElapsedTimer geolocationCheckTimer;
+static QDateTime geolocationLastModified;
+static QMutex geolocationMutex;
+static QString geolocationPath;
+static QMutex geolocationReloadMutex;
+static QSharedPointer<const GeolocationTable> geolocationTable;
+static const int MaxInRangeSize = 900; //NOTE: SQLite allows up to 999 bound parameters per statement
 static QReadWriteLock processTextLock(QReadWriteLock::Recursive);
 static QMutex postMutex(QMutex::Recursive);
 static QReadWriteLock rssLock(QReadWriteLock::Recursive);
 static QMap<QString, QString> rssMap;
-static QMap<QByteArray, QStringList> registeredUserBoardsMap;
-static QMutex registeredUserBoardsMutex(QMutex::Recursive);
-static QMap<QByteArray, int> registeredUserLevelMap;
-static QMutex registeredUserLevelMutex(QMutex::Recursive);
+static QSharedPointer<const RegisteredUserTable> registeredUsers;
+static QThreadStorage<RegisteredUserTableCopy *> registeredUsersCopies;
+static QAtomicInt registeredUsersGeneration;
+static QMutex registeredUsersMutex;
+static const qint64 RegisteredUsersRetryInterval = 10 * BeQt::Second;
+static QElapsedTimer registeredUsersRetryTimer;
+static QMutex registeredUsersWriteMutex;
 
 static bool addToReferencedPosts(QSharedPointer<Post> post, const RefMap &referencedPosts, QString *error = 0,
                                  QString *description = 0, const QLocale &l = BCoreApplication::locale())
@@ -274,6 +378,7 @@ static bool addToReferencedPosts(QSharedPointer<Post> post, const RefMap &refere
                 QSharedPointer<PostReference> nref(new PostReference(post, p.data));
                 t->persist(nref);
                 Cache::removePost(key.boardName, key.postNumber);
+                Cache::invalidatePages(key.boardName, referencedPosts.value(key));
             }
         }
         t.commit();
@@ -301,6 +406,7 @@ static bool removeFromReferencedPosts(quint64 postId, QString *error = 0,
         foreach (const PostReference &p, posts) {
             QSharedPointer<Post> sp = p.targetPost().load();
             Cache::removePost(sp->board(), sp->number());
+            Cache::invalidatePages(sp->board(), sp->thread().load()->number());
         }
         t->erase_query<PostReference>(odb::query<PostReference>::sourcePost == postId);
         t.commit();
@@ -433,6 +539,305 @@ static quint64 incrementPostCounter(const QString &boardName, quint64 delta = 1,
     return bRet(error, QString(), incremented);
 }
 
+static bool loadBanTable()
+{
+    QMutexLocker writeLocker(&banTableWriteMutex);
+    QSharedPointer<BanTable> table(new BanTable);
+    try {
+        Transaction t(Transaction::ReadOnlyMode);
+        if (!t)
+            return false;
+        QList<BannedUser> users = queryAll<BannedUser>();
+        foreach (const BannedUser &user, users) {
+            QMap<QString, BanInfo> map;
+            typedef QLazyWeakPointer<Ban> LazyBan;
+            foreach (const LazyBan &lban, user.bans()) {
+                QSharedPointer<Ban> ban = lban.load();
+                BanInfo inf;
+                inf.boardName = ban->board();
+                inf.dateTime = ban->dateTime();
+                inf.expires = ban->expirationDateTime();
+                inf.level = ban->level();
+                inf.reason = ban->reason();
+                if (!inf.isExpired())
+                    map.insert(inf.boardName, inf);
+            }
+            if (!map.isEmpty())
+                table->insert(user.ip(), map);
+        }
+        t.commit();
+    } catch (const odb::exception &e) {
+        Tools::log("Database::loadBanTable", e);
+        return false;
+    }
+    QMutexLocker locker(&banTableMutex);
+    banTable = table;
+    return true;
+}
+
+static QSharedPointer<const BanTable> banTableSnapshot()
+{
+    QMutexLocker locker(&banTableMutex);
+    if (!banTable.isNull())
+        return banTable;
+    if (banTableRetryTimer.isValid() && banTableRetryTimer.elapsed() < BanTableRetryInterval)
+        return banTable;
+    banTableRetryTimer.start();
+    locker.unlock();
+    loadBanTable();
+    locker.relock();
+    return banTable;
+}
+
+static void updateBanTable(const QString &ip, const QList<BanInfo> &bans, const QDateTime &dateTime)
+{
+    QMutexLocker writeLocker(&banTableWriteMutex);
+    QMutexLocker locker(&banTableMutex);
+    if (banTable.isNull())
+        return;
+    QSharedPointer<BanTable> table(new BanTable(*banTable));
+    locker.unlock();
+    QMap<QString, BanInfo> map;
+    foreach (BanInfo inf, bans) {
+        if (inf.level <= 0 || inf.isExpired())
+            continue;
+        inf.dateTime = dateTime;
+        map.insert(inf.boardName, inf);
+    }
+    if (map.isEmpty())
+        table->remove(ip);
+    else
+        table->insert(ip, map);
+    locker.relock();
+    banTable = table;
+}
+
+static void pruneBanTable(const QStringList &ips)
+{
+    if (ips.isEmpty())
+        return;
+    QMutexLocker writeLocker(&banTableWriteMutex);
+    QMutexLocker locker(&banTableMutex);
+    if (banTable.isNull())
+        return;
+    QSharedPointer<BanTable> table(new BanTable(*banTable));
+    locker.unlock();
+    foreach (const QString &ip, ips) {
+        QMap<QString, BanInfo> map = table->value(ip);
+        foreach (const QString &boardName, map.keys()) {
+            if (map.value(boardName).isExpired())
+                map.remove(boardName);
+        }
+        if (map.isEmpty())
+            table->remove(ip);
+        else
+            table->insert(ip, map);
+    }
+    locker.relock();
+    banTable = table;
+}
+
+static bool expireBans(const QList<quint64> &banIds)
+{
+    if (banIds.isEmpty())
+        return true;
+    QStringList ips;
+    try {
+        Transaction t(Transaction::WriteMode);
+        if (!t)
+            return false;
+        QDateTime now = QDateTime::currentDateTimeUtc();
+        foreach (quint64 id, banIds) {
+            Result<Ban> ban = queryOne<Ban, Ban>(odb::query<Ban>::id == id);
+            if (ban.error || !ban)
+                continue;
+            QDateTime exp = ban->expirationDateTime();
+            if (!exp.isValid() || exp > now)
+                continue;
+            QSharedPointer<BannedUser> user = ban->bannedUser().load();
+            quint64 postId = ban->postId();
+            t->erase(*ban);
+            if (!user.isNull()) {
+                ips << user->ip();
+                if (query<Ban, Ban>(odb::query<Ban>::bannedUser == user->id()).isEmpty())
+                    t->erase(*user);
+            }
+            if (postId) {
+                Result<Post> post = queryOne<Post, Post>(odb::query<Post>::id == postId);
+                if (post.error || !post)
+                    continue;
+                post->setBannedFor(false);
+                update(post);
+                Cache::removePost(post->board(), post->number());
+                Cache::invalidatePages(post->board(), post->thread().load()->number());
+            }
+        }
+        t.commit();
+    } catch (const odb::exception &e) {
+        Tools::log("Database::expireBans", e);
+        return false;
+    }
+    pruneBanTable(ips);
+    return true;
+}
+
+static void scheduleBanExpiration(quint64 banId, const QDateTime &dateTime)
+{
+    if (!banId || !dateTime.isValid())
+        return;
+    QMutexLocker locker(&banExpirationsMutex);
+    if (banExpiryStopped)
+        return;
+    QDateTime dt = dateTime.toUTC();
+    bool earliest = banExpirations.isEmpty() || dt < banExpirations.firstKey();
+    banExpirations.insert(dt, banId);
+    if (!banExpiryThread) {
+        banExpiryThread = new BanExpiryThread;
+        banExpiryThread->start();
+    } else if (earliest) {
+        banExpirationsCondition.wakeAll();
+    }
+}
+
+static void retryBanExpiration(const QList<quint64> &banIds)
+{
+    QDateTime dt = QDateTime::currentDateTimeUtc().addMSecs(BanExpiryRetryInterval);
+    foreach (quint64 id, banIds)
+        scheduleBanExpiration(id, dt);
+}
+
+static void applyBanTableUpdate(const BanTableUpdate &u)
+{
+    updateBanTable(u.ip, u.bans, u.dateTime);
+    for (QMap<quint64, QDateTime>::ConstIterator i = u.expirations.begin(); i != u.expirations.end(); ++i)
+        scheduleBanExpiration(i.key(), i.value());
+}
+
+static const RegisteredUserTable *registeredUsersSnapshot()
+{
+    RegisteredUserTableCopy *copy = registeredUsersCopies.localData();
+    if (!copy) {
+        copy = new RegisteredUserTableCopy;
+        copy->generation = -1;
+        registeredUsersCopies.setLocalData(copy);
+    }
+    if (copy->generation == registeredUsersGeneration.fetchAndAddOrdered(0) && !copy->table.isNull())
+        return copy->table.data();
+    QMutexLocker locker(&registeredUsersMutex);
+    if (registeredUsers.isNull()) {
+        //NOTE: The table is not loaded if loading it on startup failed, so the load is retried on a throttle
+        if (registeredUsersRetryTimer.isValid() && registeredUsersRetryTimer.elapsed() < RegisteredUsersRetryInterval)
+            return 0;
+        registeredUsersRetryTimer.start();
+        locker.unlock();
+        if (!reloadRegisteredUsers())
+            return 0;
+        locker.relock();
+    }
+    copy->generation = registeredUsersGeneration.fetchAndAddOrdered(0);
+    copy->table = registeredUsers;
+    return copy->table.data();
+}
+
+static void setRegisteredUsers(const QSharedPointer<const RegisteredUserTable> &table)
+{
+    QMutexLocker locker(&registeredUsersMutex);
+    registeredUsers = table;
+    registeredUsersGeneration.fetchAndAddOrdered(1);
+}
+
+static void updateRegisteredUsers(const QByteArray &hashpass, int level, const QStringList &boards)
+{
+    QMutexLocker writeLocker(&registeredUsersWriteMutex);
+    QSharedPointer<const RegisteredUserTable> current;
+    {
+        QMutexLocker locker(&registeredUsersMutex);
+        current = registeredUsers;
+    }
+    if (current.isNull())
+        return;
+    QSharedPointer<RegisteredUserTable> table(new RegisteredUserTable(*current));
+    RegisteredUserInfo inf;
+    inf.level = level;
+    inf.boards = boards;
+    table->insert(hashpass, inf);
+    setRegisteredUsers(table);
+}
+
+static QSharedPointer<const GeolocationTable> loadGeolocationTable(bool force)
+{
+    QMutexLocker reloadLocker(&geolocationReloadMutex);
+    QString path = BDirTools::findResource("geolocation/ip2location.sqlite");
+    QDateTime lastModified = !path.isEmpty() ? QFileInfo(path).lastModified() : QDateTime();
+    QMutexLocker locker(&geolocationMutex);
+    if (!force && !geolocationTable.isNull() && path == geolocationPath && lastModified == geolocationLastModified)
+        return geolocationTable;
+    locker.unlock();
+    GeolocationTable *table = new GeolocationTable;
+    if (!path.isEmpty()) {
+        static const QString ConnectionName = "ip2location";
+        {
+            QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", ConnectionName);
+            db.setDatabaseName(path);
+            if (db.open()) {
+                QSqlQuery q(db);
+                q.setForwardOnly(true);
+                QHash<QString, int> locations;
+                if (q.exec("SELECT ip_from, ip_to, country_code, country_name, city_name FROM ip2location "
+                           "ORDER BY ip_to")) {
+                    while (q.next()) {
+                        GeolocationInfo info;
+                        info.countryCode = q.value(2).toString();
+                        info.countryName = q.value(3).toString();
+                        info.cityName = q.value(4).toString();
+                        QString key = info.countryCode + "\n" + info.countryName + "\n" + info.cityName;
+                        int ind = locations.value(key, -1);
+                        if (ind < 0) {
+                            ind = table->infos.size();
+                            locations.insert(key, ind);
+                            table->infos << info;
+                        }
+                        table->ipFrom << q.value(0).toUInt();
+                        table->ipTo << q.value(1).toUInt();
+                        table->locations << ind;
+                    }
+                }
+                db.close();
+            }
+        }
+        QSqlDatabase::removeDatabase(ConnectionName);
+    }
+    QSharedPointer<const GeolocationTable> sp(table);
+    geolocationPath = path;
+    geolocationLastModified = lastModified;
+    locker.relock();
+    geolocationTable = sp;
+    geolocationCheckTimer.start();
+    return sp;
+}
+
+static quint64 readRerenderCheckpoint(const QStringList &boardNames)
+{
+    QVariantMap m = BeQt::deserialize(BDirTools::readFile(Tools::rerenderCheckpointFile())).toMap();
+    if (m.value("boards").toStringList() != boardNames)
+        return 0;
+    return m.value("last_id").toULongLong();
+}
+
+static odb::query<Post> rerenderQuery(const QStringList &boardNames, quint64 lastId)
+{
+    odb::query<Post> q = (odb::query<Post>::rawHtml == false);
+    if (!boardNames.isEmpty()) {
+        odb::query<Post> qq = (odb::query<Post>::board == boardNames.first());
+        foreach (const QString &board, boardNames.mid(1))
+            qq = qq || (odb::query<Post>::board == board);
+        q = q && qq;
+    }
+    if (lastId)
+        q = q && (odb::query<Post>::id > lastId);
+    return q;
+}
+
 static bool saveFile(const Tools::File &f, AbstractBoard::FileTransaction &ft, QString *error = 0,
                      QString *description = 0, const QLocale &l = BCoreApplication::locale())
 {
@@ -504,8 +909,20 @@ static bool testCaptcha(const cppcms::http::request &req, const Tools::PostParam
     return bRet(error, QString(), description, QString(), true);
 }
 
-static bool banUserInternal(const QString &sourceBoard, quint64 postNumber, const QList<BanInfo> &bans, QString *error,
-                            const QLocale &l, QString ip = QString())
+static bool writeRerenderCheckpoint(const QStringList &boardNames, quint64 lastId)
+{
+    QVariantMap m;
+    m.insert("boards", boardNames);
+    m.insert("last_id", lastId);
+    QString fn = Tools::rerenderCheckpointFile();
+    if (!BDirTools::writeFile(fn + ".tmp", BeQt::serialize(m)))
+        return false;
+    QFile::remove(fn);
+    return QFile::rename(fn + ".tmp", fn);
+}
+
+static bool banUserInternal(const QString &sourceBoard, quint64 postNumber, const QList<BanInfo> &bans,
+                            BanTableUpdate &tableUpdate, QString *error, const QLocale &l, QString ip = QString())
 {
     TranslatorQt tq(l);
     try {
@@ -513,6 +930,7 @@ static bool banUserInternal(const QString &sourceBoard, quint64 postNumber, cons
         if (!t)
             return bRet(error, tq.translate("banUserInternal", "Internal database error", "error"), false);
         quint64 postId = 0L;
+        quint64 threadNumber = 0L;
         if (!sourceBoard.isEmpty() && postNumber) {
             Result<Post> post = queryOne<Post, Post>(odb::query<Post>::board == sourceBoard
                                                      && odb::query<Post>::number == postNumber);
@@ -531,7 +949,7 @@ static bool banUserInternal(const QString &sourceBoard, quint64 postNumber, cons
                 }
             }
             post->setBannedFor(banned);
-            quint64 threadNumber = post->thread().load()->number();
+            threadNumber = post->thread().load()->number();
             Cache::updateLastNPost(sourceBoard, threadNumber, *post);
             Cache::updateThreadPost(sourceBoard, threadNumber, *post);
             Cache::removeOpPost(sourceBoard, threadNumber);
@@ -554,6 +972,7 @@ static bool banUserInternal(const QString &sourceBoard, quint64 postNumber, cons
             persist(user);
         }
         QStringList boardNames = AbstractBoard::boardNames();
+        QMap<quint64, QDateTime> expirations;
         bool count = 0;
         foreach (const BanInfo &inf, bans) {
             if (!boardNames.contains(inf.boardName))
@@ -566,12 +985,21 @@ static bool banUserInternal(const QString &sourceBoard, quint64 postNumber, cons
             ban->setLevel(inf.level);
             ban->setReason(inf.reason);
             t->persist(*ban);
+            if (inf.expires.isValid())
+                expirations.insert(ban->id(), inf.expires);
             ++count;
         }
         if (count < 1)
             t->erase(*user);
         t.commit();
+        //NOTE: The ban table is updated by the caller once the outermost transaction is committed
+        tableUpdate.ip = ip;
+        tableUpdate.bans = bans;
+        tableUpdate.dateTime = dt;
+        tableUpdate.expirations = expirations;
         Cache::removePost(sourceBoard, postNumber);
+        if (threadNumber)
+            Cache::invalidatePages(sourceBoard, threadNumber);
         return bRet(error, QString(), true);
     }  catch (const odb::exception &e) {
         return bRet(error, Tools::fromStd(e.what()), false);
@@ -599,7 +1027,7 @@ static bool createPostInternal(CreatePostInternalParameters &p)
         refs = p.refs;
     QReadLocker locker(&processTextLock);
     try {
-        Transaction t;
+        Transaction t(Transaction::WriteMode);
         if (!t) {
             return bRet(p.error, tq.translate("createPostInternal", "Internal error", "error"), p.description,
                         tq.translate("createPostInternal", "Internal database error", "description"), false);
@@ -683,7 +1111,9 @@ static bool createPostInternal(CreatePostInternalParameters &p)
         if (ps->number() != p.threadNumber) {
             Cache::addThreadPost(boardName, p.threadNumber, *ps);
             Cache::addLastNPost(boardName, p.threadNumber, *ps);
+            ThreadIndex::addPost(boardName, p.threadNumber, p.dateTime, bump);
         }
+        Cache::invalidatePages(boardName, p.threadNumber);
         return bRet(p.error, QString(), p.description, QString(), true);
     } catch (const odb::exception &e) {
         return bRet(p.error, tq.translate("createPostInternal", "Internal error", "error"), p.description,
@@ -707,7 +1137,7 @@ static bool deletePostInternal(const QString &boardName, quint64 postNumber, QSt
     QMutexLocker locker(&postMutex);
     quint64 threadNumber = 0;
     try {
-        Transaction t;
+        Transaction t(Transaction::WriteMode);
         if (!t)
             return bRet(error, tq.translate("deletePostInternal", "Internal database error", "error"), false);
         Result<Post> post = queryOne<Post, Post>(odb::query<Post>::board == boardName
@@ -745,7 +1175,7 @@ static bool deletePostInternal(const QString &boardName, quint64 postNumber, QSt
         tmp.text = Markup::processPostText(tmp.text, tmp.board, 0, postNumber, ml);
     }
     try {
-        Transaction t;
+        Transaction t(Transaction::WriteMode);
         if (!t)
             return bRet(error, tq.translate("deletePostInternal", "Internal database error", "error"), false);
         Result<Post> post = queryOne<Post, Post>(odb::query<Post>::board == boardName
@@ -789,6 +1219,7 @@ static bool deletePostInternal(const QString &boardName, quint64 postNumber, QSt
                 continue;
             p.setText(postIds.value(p.id()).text);
             Cache::removePost(p.board(), p.number());
+            Cache::invalidatePages(p.board(), p.thread().load()->number());
             t->update(p);
         }
         if (thread)
@@ -802,12 +1233,27 @@ static bool deletePostInternal(const QString &boardName, quint64 postNumber, QSt
         Cache::removeLastNPost(boardName, threadNumber, postNumber);
         Cache::removeOpPost(boardName, threadNumber);
         t.commit();
+        if (threadNumber == postNumber) {
+            ThreadIndex::removeThread(boardName, threadNumber);
+            Cache::removeThreadPages(boardName, threadNumber);
+        } else {
+            Cache::invalidatePages(boardName, threadNumber);
+        }
         return bRet(error, QString(), true);
     }  catch (const odb::exception &e) {
         return bRet(error, Tools::fromStd(e.what()), false);
     }
 }
 
+static bool moderOnBoardInternal(int level, const QStringList &boards, const QString &board1, const QString &board2)
+{
+    if (level < RegisteredUser::ModerLevel)
+        return false;
+    if (level >= RegisteredUser::AdminLevel)
+        return true;
+    return (boards.contains("*") || (boards.contains(board1) && (board2.isEmpty() || boards.contains(board2))));
+}
+
 static bool setThreadFixedInternal(const QString &board, quint64 threadNumber, bool fixed, QString *error,
                                    const QLocale &l)
 {
@@ -827,6 +1273,8 @@ static bool setThreadFixedInternal(const QString &board, quint64 threadNumber, b
         thread->setFixed(fixed);
         update(thread);
         t.commit();
+        ThreadIndex::setThreadFixed(board, threadNumber, fixed);
+        Cache::invalidatePages(board, threadNumber);
         Cache::removePost(board, threadNumber);
         Cache::removeOpPost(board, threadNumber);
         return bRet(error, QString(), true);
@@ -854,6 +1302,7 @@ static bool setThreadOpenedInternal(const QString &board, quint64 threadNumber,
         thread->setPostingEnabled(opened);
         update(thread);
         t.commit();
+        Cache::invalidatePages(board, threadNumber);
         Cache::removePost(board, threadNumber);
         Cache::removeOpPost(board, threadNumber);
         return bRet(error, QString(), true);
@@ -872,6 +1321,32 @@ static bool threadIdDateTimeFixedLessThan(const ThreadIdDateTimeFixed &t1, const
         return false;
 }
 
+void BanExpiryThread::run()
+{
+    static const qint64 MaxWait = BeQt::Hour;
+    QMutexLocker locker(&banExpirationsMutex);
+    while (!banExpiryStopped) {
+        if (banExpirations.isEmpty()) {
+            banExpirationsCondition.wait(&banExpirationsMutex);
+            continue;
+        }
+        QDateTime now = QDateTime::currentDateTimeUtc();
+        qint64 msecs = now.msecsTo(banExpirations.firstKey());
+        if (msecs > 0) {
+            banExpirationsCondition.wait(&banExpirationsMutex, qMin(msecs, MaxWait));
+            continue;
+        }
+        QList<quint64> ids;
+        while (!banExpirations.isEmpty() && banExpirations.firstKey() <= now)
+            ids << banExpirations.take(banExpirations.firstKey());
+        locker.unlock();
+        //NOTE: The bans are still in the database if expiring them failed, so they are retried later
+        if (!expireBans(ids))
+            retryBanExpiration(ids);
+        locker.relock();
+    }
+}
+
 bool addFile(const cppcms::http::request &req, const QMap<QString, QString> &params, const QList<Tools::File> &files,
              QString *error, QString *description)
 {
@@ -922,6 +1397,7 @@ bool addFile(const cppcms::http::request &req, const QMap<QString, QString> &par
         }
         Cache::removePost(post->board(), post->number());
         Cache::removePost(post->board(), threadNumber);
+        Cache::invalidatePages(post->board(), threadNumber);
         return bRet(error, QString(), description, QString(), true);
     } catch (const odb::exception &e) {
         return bRet(error, tq.translate("addFile", "Internal error", "error"), description, Tools::fromStd(e.what()),
@@ -929,25 +1405,22 @@ bool addFile(const cppcms::http::request &req, const QMap<QString, QString> &par
     }
 }
 
-int addPostsToIndex(QString *error, const QLocale &l)
-{
-    TranslatorQt tq(l);
-    try {
-        Transaction t;
-        if (!t)
-            return bRet(error, tq.translate("addPostsToIndex", "Internal database error", "error"), -1);
-        QList<Post> posts = queryAll<Post>();
-        foreach (const Post &post, posts)
-            Search::addToIndex(post.board(), post.number(), post.rawText());
-        return bRet(error, QString(), posts.size());
-    } catch (const odb::exception &e) {
-        return bRet(error, Tools::fromStd(e.what()), -1);
-    }
-}
-
 QMap< QString, QMap<QString, BanInfo> > banInfos(bool *ok, QString *error, const QLocale &l)
 {
     QMap< QString, QMap<QString, BanInfo> > map;
+    QSharedPointer<const BanTable> table = banTableSnapshot();
+    if (!table.isNull()) {
+        for (BanTable::ConstIterator i = table->begin(); i != table->end(); ++i) {
+            QMap<QString, BanInfo> list;
+            foreach (const BanInfo &inf, i.value()) {
+                if (!inf.isExpired())
+                    list.insert(inf.boardName, inf);
+            }
+            if (!list.isEmpty())
+                map.insert(i.key(), list);
+        }
+        return bRet(ok, true, error, QString(), map);
+    }
     TranslatorQt tq(l);
     try {
         Transaction t;
@@ -979,13 +1452,21 @@ QMap< QString, QMap<QString, BanInfo> > banInfos(bool *ok, QString *error, const
 
 bool banUser(const QString &ip, const QList<BanInfo> &bans, QString *error, const QLocale &l)
 {
-    return banUserInternal("", 0, bans, error, l, ip);
+    BanTableUpdate u;
+    if (!banUserInternal("", 0, bans, u, error, l, ip))
+        return false;
+    applyBanTableUpdate(u);
+    return true;
 }
 
 bool banUser(const QString &sourceBoard, quint64 postNumber, const QList<BanInfo> &bans, QString *error,
              const QLocale &l)
 {
-    return banUserInternal(sourceBoard, postNumber, bans, error, l);
+    BanTableUpdate u;
+    if (!banUserInternal(sourceBoard, postNumber, bans, u, error, l))
+        return false;
+    applyBanTableUpdate(u);
+    return true;
 }
 
 bool banUser(const cppcms::http::request &req, const QString &ip, const QList<BanInfo> &bans, QString *error)
@@ -1015,9 +1496,11 @@ bool banUser(const cppcms::http::request &req, const QString &ip, const QList<Ba
                     return bRet(error, tq.translate("banUser", "Not enough rights", "error"), false);
             }
         }
-        if (!banUser(ip, bans, error, tq.locale()))
+        BanTableUpdate u;
+        if (!banUserInternal("", 0, bans, u, error, tq.locale(), ip))
             return false;
         t.commit();
+        applyBanTableUpdate(u);
         return bRet(error, QString(), true);
     } catch (const odb::exception &e) {
         return bRet(error, Tools::fromStd(e.what()), false);
@@ -1050,9 +1533,11 @@ bool banPoster(const cppcms::http::request &req, const QString &sourceBoard, qui
             if (!moderOnBoard(req, sourceBoard, inf.boardName) || registeredUserLevel(post->hashpass()) >= lvl)
                 return bRet(error, tq.translate("banPoster", "Not enough rights", "error"), false);
         }
-        if (!banUser(sourceBoard, postNumber, bans, error, tq.locale()))
+        BanTableUpdate u;
+        if (!banUserInternal(sourceBoard, postNumber, bans, u, error, tq.locale()))
             return false;
         t.commit();
+        applyBanTableUpdate(u);
         return bRet(error, QString(), true);
     } catch (const odb::exception &e) {
         return bRet(error, Tools::fromStd(e.what()), false);
@@ -1061,38 +1546,33 @@ bool banPoster(const cppcms::http::request &req, const QString &sourceBoard, qui
 
 void checkOutdatedEntries()
 {
+    QList<quint64> expired;
+    QMultiMap<QDateTime, quint64> pending;
     try {
-        Transaction t;
+        Transaction t(Transaction::ReadOnlyMode);
         if (!t)
             return;
-        QList<BannedUser> list = queryAll<BannedUser>();
-        foreach (const BannedUser &u, list) {
-            typedef QLazyWeakPointer<Ban> LazyBan;
-            int expired = 0;
-            foreach (LazyBan lban, u.bans()) {
-                QSharedPointer<Ban> ban = lban.load();
-                QDateTime exp = ban->expirationDateTime();
-                if (exp.isValid() && exp <= QDateTime::currentDateTimeUtc()) {
-                    quint64 postId = ban->postId();
-                    t->erase(*ban);
-                    ++expired;
-                    if (postId) {
-                        Result<Post> post = queryOne<Post, Post>(odb::query<Post>::id == postId);
-                        if (post.error || !post)
-                            continue;
-                        post->setBannedFor(false);
-                        update(post);
-                        Cache::removePost(post->board(), post->number());
-                    }
-                }
-            }
-            if (expired >= u.bans().size())
-                t->erase(u);
+        QList<Ban> bans = query<Ban, Ban>(odb::query<Ban>::expirationDateTime.is_not_null());
+        QDateTime now = QDateTime::currentDateTimeUtc();
+        foreach (const Ban &ban, bans) {
+            QDateTime exp = ban.expirationDateTime();
+            if (!exp.isValid())
+                continue;
+            if (exp <= now)
+                expired << ban.id();
+            else
+                pending.insert(exp, ban.id());
         }
         t.commit();
     } catch (const odb::exception &e) {
         Tools::log("Database::checkOutdatedEntries", e);
+        return;
     }
+    if (!expireBans(expired))
+        retryBanExpiration(expired);
+    for (QMultiMap<QDateTime, quint64>::ConstIterator i = pending.begin(); i != pending.end(); ++i)
+        scheduleBanExpiration(i.value(), i.key());
+    loadBanTable();
 }
 
 bool createPost(CreatePostParameters &p, quint64 *postNumber)
@@ -1150,7 +1630,8 @@ quint64 createThread(CreateThreadParameters &p)
     QMutexLocker locker(&postMutex);
     try {
         QStringList filesToDelete;
-        Transaction t;
+        quint64 archivedThreadNumber = 0;
+        Transaction t(Transaction::WriteMode);
         if (!t)
             return bRet(p.error, tq.translate("createThread", "Internal database error", "error"), p.description,
                         tq.translate("createThread", "Internal database error", "error"), false);
@@ -1196,6 +1677,7 @@ quint64 createThread(CreateThreadParameters &p)
                     }
                     thread->setArchived(true);
                     update(thread);
+                    archivedThreadNumber = thread->number();
                 } else {
                     if (!deletePostInternal(boardName, list.last().number, p.description, p.locale, filesToDelete))
                         return bRet(p.error, tq.translate("createThread", "Internal error", "error"), 0L);
@@ -1213,6 +1695,17 @@ quint64 createThread(CreateThreadParameters &p)
             return 0L;
         t.commit();
         deleteFiles(boardName, filesToDelete);
+        ThreadIndex::removeThread(boardName, archivedThreadNumber);
+        ThreadIndex::ThreadInfo info;
+        info.number = postNumber;
+        info.dateTime = dt;
+        info.fixed = thread->fixed();
+        info.draft = board->draftsEnabled() && !p.params.value("draft").compare("true", Qt::CaseInsensitive);
+        info.opHashpass = Tools::hashpass(p.request);
+        ThreadIndex::addThread(boardName, info);
+        if (archivedThreadNumber)
+            Cache::removeThreadPages(boardName, archivedThreadNumber);
+        Cache::invalidatePages(boardName, postNumber);
         return bRet(p.error, QString(), p.description, QString(), postNumber);
     } catch (const odb::exception &e) {
         return bRet(p.error, tq.translate("createThread", "Internal error", "error"), p.description,
@@ -1312,6 +1805,7 @@ bool deleteFile(const QString &boardName, const QString &fileName,  const cppcms
         }
         Cache::removePost(boardName, post->number());
         Cache::removePost(boardName, threadNumber);
+        Cache::invalidatePages(boardName, threadNumber);
         deleteFiles(boardName, QStringList() << fileInfo->name() << fileInfo->thumbName());
         return bRet(error, QString(), true);
     } catch (const odb::exception &e) {
@@ -1418,6 +1912,7 @@ bool editAudioTags(const QString &boardName, const QString &fileName, const cppc
         t.commit();
         Cache::removePost(boardName, post->number());
         Cache::removePost(boardName, threadNumber);
+        Cache::invalidatePages(boardName, threadNumber);
         return bRet(error, QString(), true);
     } catch (const odb::exception &e) {
         return bRet(error, Tools::fromStd(e.what()), false);
@@ -1446,7 +1941,7 @@ bool editPost(EditPostParameters &p)
     QReadLocker locker(&processTextLock);
     QMutexLocker plocker(&postMutex);
     try {
-        Transaction t;
+        Transaction t(Transaction::WriteMode);
         if (!t)
             return bRet(p.error, tq.translate("editPost", "Internal database error", "error"), false);
         Result<Post> post = queryOne<Post, Post>(odb::query<Post>::number == p.postNumber
@@ -1510,7 +2005,10 @@ bool editPost(EditPostParameters &p)
         t->update(thread);
         update(post);
         t.commit();
+        if (post->draft() != wasDraft && thread.number() == post->number())
+            ThreadIndex::setThreadDraft(p.boardName, thread.number(), post->draft());
         Cache::removePost(p.boardName, p.postNumber);
+        Cache::invalidatePages(p.boardName, thread.number());
         if (post->number() == thread.number()) {
             Cache::removeOpPost(p.boardName, thread.number());
         } else {
@@ -1530,7 +2028,7 @@ unsigned int fileCount(const QString &boardName, quint64 postNumber)
     if (boardName.isEmpty() || !postNumber)
         return 0;
     try {
-        Transaction t;
+        Transaction t(Transaction::ReadOnlyMode);
         if (!t)
             return 0;
         Result<PostId> postId = queryOne<PostId, Post>(odb::query<Post>::board == boardName
@@ -1552,7 +2050,7 @@ bool fileExists(const QByteArray &hash, bool *ok)
     if (hash.isEmpty())
         return bRet(ok, false, false);
     try {
-        Transaction t;
+        Transaction t(Transaction::ReadOnlyMode);
         if (!t)
             return bRet(ok, false, false);
         Result<FileInfoCount> count = queryOne<FileInfoCount, FileInfo>(odb::query<FileInfo>::hash == hash);
@@ -1576,12 +2074,12 @@ bool fileExists(const QString &hashString, bool *ok)
     return fileExists(hash, ok);
 }
 
-QList<Post> findPosts(const Search::Query &query, const QString &boardName, bool *ok, QString *error,
-                      QString *description, const QLocale &l)
+QList<Post> findPosts(const Search::Query &query, const QString &boardName, int count, const QString &cursor,
+                      QString *nextCursor, bool *ok, QString *error, QString *description, const QLocale &l)
 {
     TranslatorQt tq(l);
     bool b = false;
-    Search::BoardMap result = Search::find(query, boardName, &b, description, l);
+    Search::ResultList result = Search::find(query, boardName, count, cursor, nextCursor, &b, description, l);
     if (!b)
         return bRet(ok, false, error, tq.translate("findPosts", "Query error", "error"), QList<Post>());
     if (result.isEmpty())
@@ -1592,16 +2090,26 @@ QList<Post> findPosts(const Search::Query &query, const QString &boardName, bool
             return bRet(ok, false, error, tq.translate("findPosts", "Internal error", "error"), description,
                         tq.translate("findPosts", "Internal database error", "description"), QList<Post>());
         }
-        QString qs;
-        for (Search::BoardMap::ConstIterator posts = result.begin(); posts != result.end(); ++posts) {
-            qs += "(board = '" + posts.key() + "' AND number IN (";
-            foreach (const quint64 &pn, posts.value().keys())
-                qs += QString::number(pn) + ", ";
-            qs.remove(qs.length() - 2, 2);
-            qs += ")) OR ";
+        QMap< QString, QList<quint64> > numbers;
+        foreach (const Search::Result &r, result)
+            numbers[r.boardName] << r.postNumber;
+        QMap< QPair<QString, quint64>, Post> posts;
+        for (QMap< QString, QList<quint64> >::ConstIterator i = numbers.begin(); i != numbers.end(); ++i) {
+            for (int j = 0; j < i->size(); j += MaxInRangeSize) {
+                QList<quint64> chunk = i->mid(j, MaxInRangeSize);
+                odb::query<Post> q = odb::query<Post>::board == i.key()
+                        && odb::query<Post>::number.in_range(chunk.begin(), chunk.end());
+                foreach (const Post &post, Database::query<Post, Post>(q))
+                    posts.insert(qMakePair(post.board(), post.number()), post);
+            }
+        }
+        QList<Post> list;
+        foreach (const Search::Result &r, result) {
+            QMap< QPair<QString, quint64>, Post>::ConstIterator i = posts.find(qMakePair(r.boardName, r.postNumber));
+            if (posts.end() != i)
+                list << i.value();
         }
-        qs.remove(qs.length() - 4, 4);
-        return bRet(ok, true, error, QString(), description, QString(), Database::query<Post, Post>(qs));
+        return bRet(ok, true, error, QString(), description, QString(), list);
     } catch (const odb::exception &e) {
         return bRet(ok, false, error, tq.translate("findPosts", "Internal error", "error"), description,
                     Tools::fromStd(e.what()), QList<Post>());
@@ -1744,19 +2252,24 @@ GeolocationInfo geolocationInfo(const QString &ip)
     unsigned int n = Tools::ipNum(ip);
     if (!n)
         return info;
-    BSqlDatabase db("QSQLITE", "ip2location" + BUuid::createUuid().toString(true));
-    db.setDatabaseName(BDirTools::findResource("geolocation/ip2location.sqlite"));
-    if (!db.open())
-        return info;
-    static const QStringList Fields = QStringList() << "ip_from" << "country_code" << "country_name" << "city_name";
-    BSqlResult r = db.select("ip2location", Fields, BSqlWhere("ip_to >= :ip LIMIT 1", ":ip", n));
-    if (!r)
+    QMutexLocker locker(&geolocationMutex);
+    QSharedPointer<const GeolocationTable> table = geolocationTable;
+    bool check = table.isNull() || geolocationCheckTimer.elapsed() >= GeolocationCheckInterval;
+    if (check)
+        geolocationCheckTimer.start();
+    locker.unlock();
+    if (check)
+        table = loadGeolocationTable(false);
+    QVector<unsigned int>::ConstIterator i = qLowerBound(table->ipTo.begin(), table->ipTo.end(), n);
+    if (table->ipTo.end() == i)
         return info;
-    if (r.value("ip_from").toUInt() < n)
+    int ind = i - table->ipTo.begin();
+    if (table->ipFrom.at(ind) > n)
         return info;
-    info.cityName = r.value("city_name").toString();
-    info.countryCode = r.value("country_code").toString();
-    info.countryName = r.value("country_name").toString();
+    const GeolocationInfo &inf = table->infos.at(table->locations.at(ind));
+    info.cityName = inf.cityName;
+    info.countryCode = inf.countryCode;
+    info.countryName = inf.countryName;
     return info;
 }
 
@@ -1768,7 +2281,7 @@ GeolocationInfo geolocationInfo(const cppcms::http::request &req)
 GeolocationInfo geolocationInfo(const QString &boardName, quint64 postNumber)
 {
     try {
-        Transaction t;
+        Transaction t(Transaction::ReadOnlyMode);
         if (!t)
             return GeolocationInfo();
         Result<Post> post = queryOne<Post, Post>(odb::query<Post>::board == boardName
@@ -1793,7 +2306,7 @@ QVariant getFileMetaData(const QString &fileName, bool *ok, QString *error, cons
     if (fileName.isEmpty())
         return bRet(ok, false, error, tq.translate("getFileMetaData", "Invalid file name", "error"), QVariant());
     try {
-        Transaction t;
+        Transaction t(Transaction::ReadOnlyMode);
         if (!t) {
             return bRet(ok, false, error, tq.translate("getFileMetaData", "Internal database error", "description"),
                         QVariant());
@@ -1871,7 +2384,7 @@ QList<Post> getNewPosts(const cppcms::http::request &req, const QString &boardNa
     if (!threadNumber)
         return bRet(ok, false, error, tq.translate("getNewPosts", "Invalid thread number", "error"), QList<Post>());
     try {
-        Transaction t;
+        Transaction t(Transaction::ReadOnlyMode);
         if (!t) {
             return bRet(ok, false, error, tq.translate("getNewPosts", "Internal database error", "error"),
                         QList<Post>());
@@ -2025,7 +2538,7 @@ bool isOp(const QString &boardName, quint64 threadNumber, const QString &userIp,
     if (!Tools::ipNum(userIp, &ok) || !ok)
         return false;
     try {
-        Transaction t;
+        Transaction t(Transaction::ReadOnlyMode);
         if (!t)
             return false;
         Result<Post> post = queryOne<Post, Post>(odb::query<Post>::board == boardName
@@ -2046,19 +2559,16 @@ quint64 lastPostNumber(const QString &boardName, QString *error, const QLocale &
     if (!AbstractBoard::boardNames().contains(boardName))
         return bRet(error, tq.translate("lastPostNumber", "Invalid board name", "error"), 0L);
     try {
-        Transaction t;
+        Transaction t(Transaction::ReadOnlyMode);
         if (!t)
             return bRet(error, tq.translate("lastPostNumber", "Invalid database connection", "error"), 0L);
         Result<PostCounter> counter = queryOne<PostCounter, PostCounter>(odb::query<PostCounter>::board == boardName);
-        if (!counter && !counter.error) {
-            PostCounter c(boardName);
-            t->persist(c);
-            counter = queryOne<PostCounter, PostCounter>(odb::query<PostCounter>::board == boardName);
-        }
-        if (counter.error || !counter)
+        if (counter.error)
             return bRet(error, tq.translate("incrementPostCounter", "Internal database error", "error"), 0L);
+        //NOTE: The counter is created by incrementPostCounter when the first post is made
+        quint64 pn = counter ? counter->lastPostNumber() : 0L;
         t.commit();
-        return bRet(error, QString(), counter->lastPostNumber());
+        return bRet(error, QString(), pn);
     } catch (const odb::exception &e) {
         return bRet(error, Tools::fromStd(e.what()), 0L);
     }
@@ -2066,21 +2576,12 @@ quint64 lastPostNumber(const QString &boardName, QString *error, const QLocale &
 
 bool moderOnBoard(const cppcms::http::request &req, const QString &board1, const QString &board2)
 {
-    QByteArray hp = Tools::hashpass(req);
-    if (hp.isEmpty())
-        return false;
-    return moderOnBoard(hp, board1, board2);
+    return moderOnBoardInternal(registeredUserLevel(req), registeredUserBoards(req), board1, board2);
 }
 
 bool moderOnBoard(const QByteArray &hashpass, const QString &board1, const QString &board2)
 {
-    int lvl = registeredUserLevel(hashpass);
-    if (lvl < RegisteredUser::ModerLevel)
-        return false;
-    if (lvl >= RegisteredUser::AdminLevel)
-        return true;
-    QStringList boards = registeredUserBoards(hashpass);
-    return (boards.contains("*") || (boards.contains(board1) && (board2.isEmpty() || boards.contains(board2))));
+    return moderOnBoardInternal(registeredUserLevel(hashpass), registeredUserBoards(hashpass), board1, board2);
 }
 
 quint64 moveThread(const cppcms::http::request &req, const QString &sourceBoard, quint64 threadNumber,
@@ -2108,7 +2609,7 @@ quint64 moveThread(const cppcms::http::request &req, const QString &sourceBoard,
     if (!BDirTools::mkpath(trgPath))
         return bRet(error, tq.translate("Database::moveThread", "Internal file system error", "error"), 0);
     try {
-        Transaction t;
+        Transaction t(Transaction::WriteMode);
         if (!t)
             return bRet(error, tq.translate("Database::moveThread", "Internal database error", "error"), 0);
         Result<Thread> thread = queryOne<Thread, Thread>(odb::query<Thread>::number == threadNumber
@@ -2152,6 +2653,7 @@ quint64 moveThread(const cppcms::http::request &req, const QString &sourceBoard,
                 sourcePost->setText(text);
                 t->update(sourcePost);
                 Cache::removePost(sourcePost->board(), sourcePost->number());
+                Cache::invalidatePages(sourcePost->board(), sourcePost->thread().load()->number());
             }
             QList<FileInfo> fileInfos = query<FileInfo, FileInfo>(odb::query<FileInfo>::post == post.id());
             foreach (int j, bRangeD(0, fileInfos.size() - 1)) {
@@ -2191,6 +2693,16 @@ quint64 moveThread(const cppcms::http::request &req, const QString &sourceBoard,
         thread->setNumber(newThreadNumber);
         update(thread);
         t.commit();
+        ThreadIndex::removeThread(sourceBoard, threadNumber);
+        ThreadIndex::ThreadInfo info;
+        info.number = newThreadNumber;
+        info.dateTime = thread->dateTime();
+        info.fixed = thread->fixed();
+        info.draft = posts.first().draft();
+        info.opHashpass = posts.first().hashpass();
+        ThreadIndex::addThread(targetBoard, info);
+        Cache::removeThreadPages(sourceBoard, threadNumber);
+        Cache::invalidatePages(targetBoard, newThreadNumber);
         Cache::removeThreadPosts(sourceBoard, threadNumber);
         Cache::removeLastNPosts(sourceBoard, threadNumber);
         Cache::removeOpPost(sourceBoard, threadNumber);
@@ -2204,7 +2716,7 @@ bool postExists(const QString &boardName, quint64 postNumber, quint64 *threadNum
 {
     QMutexLocker locker(&postMutex);
     try {
-        Transaction t;
+        Transaction t(Transaction::ReadOnlyMode);
         if (!t)
             return bRet(threadNumber, quint64(0), false);
         Result<Post> post = queryOne<Post, Post>(odb::query<Post>::board == boardName
@@ -2222,7 +2734,7 @@ bool postExists(const QString &boardName, quint64 postNumber, quint64 *threadNum
 QString posterIp(const QString &boardName, quint64 postNumber)
 {
     try {
-        Transaction t;
+        Transaction t(Transaction::ReadOnlyMode);
         if (!t)
             return "";
         Result<Post> post = queryOne<Post, Post>(odb::query<Post>::board == boardName
@@ -2239,7 +2751,7 @@ QString posterIp(const QString &boardName, quint64 postNumber)
 quint64 postThreadNumber(const QString &boardName, quint64 postNumber)
 {
     try {
-        Transaction t;
+        Transaction t(Transaction::ReadOnlyMode);
         if (!t)
             return 0;
         Result<Post> post = queryOne<Post, Post>(odb::query<Post>::board == boardName
@@ -2253,12 +2765,50 @@ quint64 postThreadNumber(const QString &boardName, quint64 postNumber)
     }
 }
 
+RefMap postThreadNumbers(const QList<RefKey> &posts, bool *ok)
+{
+    if (posts.isEmpty())
+        return bRet(ok, true, RefMap());
+    QMap< QString, QSet<quint64> > numbers;
+    foreach (const RefKey &key, posts)
+        numbers[key.boardName].insert(key.postNumber);
+    QMutexLocker locker(&postMutex);
+    try {
+        Transaction t(Transaction::ReadOnlyMode);
+        if (!t)
+            return bRet(ok, false, RefMap());
+        RefMap map;
+        for (QMap< QString, QSet<quint64> >::ConstIterator i = numbers.begin(); i != numbers.end(); ++i) {
+            QList<quint64> list = i->toList();
+            for (int j = 0; j < list.size(); j += MaxInRangeSize) {
+                QList<quint64> chunk = list.mid(j, MaxInRangeSize);
+                typedef odb::query<PostBoardNumberThreadNumber> Query;
+                Query q = Query::Post::board == i.key() && Query::Post::number.in_range(chunk.begin(), chunk.end());
+                foreach (const PostBoardNumberThreadNumber &p,
+                         query<PostBoardNumberThreadNumber, PostBoardNumberThreadNumber>(q)) {
+                    map.insert(RefKey(p.board, p.number), p.threadNumber);
+                }
+            }
+        }
+        return bRet(ok, true, map);
+    } catch (const odb::exception &e) {
+        Tools::log("Database::postThreadNumbers", e);
+        return bRet(ok, false, RefMap());
+    }
+}
+
 QStringList registeredUserBoards(const cppcms::http::request &req)
 {
+    RequestContext *c = RequestContext::current(req);
+    if (c && c->lookup(RequestContext::UserBoardsValue))
+        return c->userBoards;
     QByteArray hp = Tools::hashpass(req);
-    if (hp.isEmpty())
-        return QStringList();
-    return registeredUserBoards(hp);
+    QStringList boards = !hp.isEmpty() ? registeredUserBoards(hp) : QStringList();
+    if (c) {
+        c->userBoards = boards;
+        c->store(RequestContext::UserBoardsValue);
+    }
+    return boards;
 }
 
 QStringList registeredUserBoards(const QByteArray &hashpass)
@@ -2269,14 +2819,13 @@ QStringList registeredUserBoards(const QByteArray &hashpass)
     Tools::toString(hashpass, &b);
     if (!b)
         return QStringList();
-    registeredUserBoardsMutex.lock();
-    if (registeredUserBoardsMap.contains(hashpass)) {
-        registeredUserBoardsMutex.unlock();
-        return registeredUserBoardsMap.value(hashpass);
+    const RegisteredUserTable *users = registeredUsersSnapshot();
+    if (users) {
+        RegisteredUserTable::ConstIterator i = users->find(hashpass);
+        return (i != users->constEnd()) ? i.value().boards : QStringList();
     }
-    registeredUserBoardsMutex.unlock();
     try {
-        Transaction t;
+        Transaction t(Transaction::ReadOnlyMode);
         if (!t)
             return QStringList();
         Result<RegisteredUser> user = queryOne<RegisteredUser, RegisteredUser>(
@@ -2292,10 +2841,16 @@ QStringList registeredUserBoards(const QByteArray &hashpass)
 
 int registeredUserLevel(const cppcms::http::request &req)
 {
+    RequestContext *c = RequestContext::current(req);
+    if (c && c->lookup(RequestContext::UserLevelValue))
+        return c->userLevel;
     QByteArray hp = Tools::hashpass(req);
-    if (hp.isEmpty())
-        return -1;
-    return registeredUserLevel(hp);
+    int lvl = !hp.isEmpty() ? registeredUserLevel(hp) : -1;
+    if (c) {
+        c->userLevel = lvl;
+        c->store(RequestContext::UserLevelValue);
+    }
+    return lvl;
 }
 
 int registeredUserLevel(const QByteArray &hashpass)
@@ -2306,14 +2861,13 @@ int registeredUserLevel(const QByteArray &hashpass)
     Tools::toString(hashpass, &b);
     if (!b)
         return -1;
-    registeredUserLevelMutex.lock();
-    if (registeredUserLevelMap.contains(hashpass)) {
-        registeredUserLevelMutex.unlock();
-        return registeredUserLevelMap.value(hashpass);
+    const RegisteredUserTable *users = registeredUsersSnapshot();
+    if (users) {
+        RegisteredUserTable::ConstIterator i = users->find(hashpass);
+        return (i != users->constEnd()) ? i.value().level : -1;
     }
-    registeredUserLevelMutex.unlock();
     try {
-        Transaction t;
+        Transaction t(Transaction::ReadOnlyMode);
         if (!t)
             return -1;
         Result<RegisteredUserLevel> level = queryOne<RegisteredUserLevel, RegisteredUser>(
@@ -2347,127 +2901,126 @@ bool registerUser(const QByteArray &hashpass, RegisteredUser::Level level, const
         RegisteredUser user(hashpass, QDateTime::currentDateTimeUtc(), level, boards);
         t->persist(user);
         t.commit();
+        updateRegisteredUsers(user.hashpass(), user.level(), user.boards());
         return bRet(error, QString(), true);
     } catch (const odb::exception &e) {
         return bRet(error, Tools::fromStd(e.what()), false);
     }
 }
 
+bool reloadRegisteredUsers()
+{
+    QMutexLocker writeLocker(&registeredUsersWriteMutex);
+    QSharedPointer<RegisteredUserTable> table(new RegisteredUserTable);
+    try {
+        Transaction t(Transaction::ReadOnlyMode);
+        if (!t)
+            return false;
+        QList<RegisteredUser> users = queryAll<RegisteredUser>();
+        foreach (const RegisteredUser &user, users) {
+            RegisteredUserInfo inf;
+            inf.level = user.level();
+            inf.boards = user.boards();
+            table->insert(user.hashpass(), inf);
+        }
+        t.commit();
+    } catch (const odb::exception &e) {
+        Tools::log("Database::reloadRegisteredUsers", e);
+        return false;
+    }
+    setRegisteredUsers(table);
+    return true;
+}
+
 int rerenderPosts(const QStringList boardNames, QString *error, const QLocale &l)
 {
-    static const int Offset = 100;
+    static const int DefaultBatchSize = 100;
     TranslatorQt tq(l);
-    QWriteLocker locker(&processTextLock);
-    QMap<quint64, PostTmpInfo> postIds;
+    QStringList boards = boardNames;
+    boards.sort();
+    int batchSize = SettingsLocker()->value("Database/rerender_batch_size", DefaultBatchSize).toInt();
+    if (batchSize <= 0)
+        batchSize = DefaultBatchSize;
+    int threadCount = SettingsLocker()->value("Database/rerender_thread_count",
+                                              QThread::idealThreadCount()).toInt();
+    quint64 lastId = readRerenderCheckpoint(boards);
+    if (lastId) {
+        bWriteLine(tq.translate("rerenderPosts", "Resuming interrupted rerender after post ID", "message") + " "
+                   + QString::number(lastId));
+    }
     int count = 0;
     QElapsedTimer etmr;
     bWriteLine(tq.translate("rerenderPosts", "Reading post count...", "message"));
     etmr.start();
     try {
-        Transaction t;
+        Transaction t(Transaction::ReadOnlyMode);
         if (!t)
             return bRet(error, tq.translate("rerenderPosts", "Internal database error", "error"), -1);
-        odb::query<Post> q = (odb::query<Post>::rawHtml == false);
-        if (!boardNames.isEmpty()) {
-            odb::query<Post> qq = (odb::query<Post>::board == boardNames.first());
-            foreach (const QString &board, boardNames.mid(1))
-                qq = qq || (odb::query<Post>::board == board);
-            q = q && qq;
-        }
-        Result<PostCount> pc = queryOne<PostCount, Post>(q);
+        Result<PostCount> pc = queryOne<PostCount, Post>(rerenderQuery(boards, lastId));
         if (pc.error || !pc)
-            return bRet(error, tq.translate("rerenderPosts", "Internal database error", "error"), 0);
+            return bRet(error, tq.translate("rerenderPosts", "Internal database error", "error"), -1);
         count = pc->count;
         t.commit();
     } catch (const odb::exception &e) {
         return bRet(error, Tools::fromStd(e.what()), -1);
     }
-    qint64 elapsed = etmr.elapsed();
     bWriteLine(tq.translate("rerenderPosts", "Read post count:", "message") + " " + QString::number(count) + " ("
-               + QString::number(elapsed) + " " + tq.translate("rerenderPosts", "ms", "message") + ")");
-    bWriteLine(tq.translate("rerenderPosts", "Reading posts...", "message"));
-    for (int i = 0; i < count; i += Offset) {
-        int o = i + Offset;
-        if (o > count)
-            o = count;
+               + QString::number(etmr.elapsed()) + " " + tq.translate("rerenderPosts", "ms", "message") + ")");
+    QThreadPool pool;
+    pool.setMaxThreadCount((threadCount > 0) ? threadCount : 1);
+    int done = 0;
+    etmr.restart();
+    forever {
+        QMap<quint64, PostTmpInfo> postIds;
         try {
-            Transaction t;
+            Transaction t(Transaction::ReadOnlyMode);
             if (!t)
                 return bRet(error, tq.translate("rerenderPosts", "Internal database error", "error"), -1);
-            odb::query<Post> q = (odb::query<Post>::rawHtml == false);
-            if (!boardNames.isEmpty()) {
-                odb::query<Post> qq = (odb::query<Post>::board == boardNames.first());
-                foreach (const QString &board, boardNames.mid(1))
-                    qq = qq || (odb::query<Post>::board == board);
-                q = q && qq;
-            }
-            q = q + "LIMIT " + Tools::toStd(QString::number(Offset)) + " OFFSET " + Tools::toStd(QString::number(i));
-            QList<Post> ids = query<Post, Post>(q);
-            foreach (const Post &id, ids) {
+            odb::query<Post> q = rerenderQuery(boards, lastId) + " ORDER BY id ASC LIMIT "
+                    + Tools::toStd(QString::number(batchSize));
+            foreach (const PostIdBoardRawTextMarkup &p, query<PostIdBoardRawTextMarkup, Post>(q)) {
                 PostTmpInfo tmp;
-                tmp.board = id.board();
-                tmp.text = id.rawText();
-                tmp.extendedWakabaMarkEnabled = id.extendedWakabaMarkEnabled();
-                tmp.bbCodeEnabled = id.bbCodeEnabled();
-                postIds.insert(id.id(), tmp);
+                tmp.board = p.board;
+                tmp.rawText = p.rawText;
+                tmp.text = p.rawText;
+                tmp.extendedWakabaMarkEnabled = p.extendedWakabaMarkEnabled;
+                tmp.bbCodeEnabled = p.bbCodeEnabled;
+                postIds.insert(p.id, tmp);
             }
             t.commit();
         } catch (const odb::exception &e) {
             return bRet(error, Tools::fromStd(e.what()), -1);
         }
-        bWriteLine(tq.translate("rerenderPosts", "Read posts:", "message") + " " + QString::number(o) + "/"
-                   + QString::number(count) + " (" + QString::number(etmr.elapsed() - elapsed)
-                   + tq.translate("rerenderPosts", "ms", "message") + ")");
-        elapsed = etmr.elapsed();
-    }
-    if (postIds.isEmpty())
-        return bRet(error, QString(), 0);
-    int sz = postIds.keys().size();
-    int curr = 1;
-    foreach (quint64 id, postIds.keys()) {
-        bWriteLine(tq.translate("rerenderPosts", "Rendering post:", "message") + " "
-                   + QString::number(curr) + "/" + QString::number(sz) + " ID=" + QString::number(id));
-        PostTmpInfo &tmp = postIds[id];
-        Markup::MarkupLanguage ml = Markup::NoLanguage;
-        if (tmp.extendedWakabaMarkEnabled && tmp.bbCodeEnabled)
-            ml = Markup::AllLanguages;
-        else if (tmp.extendedWakabaMarkEnabled)
-            ml = Markup::ExtendedWakabaMarkLanguage;
-        else if (tmp.bbCodeEnabled)
-            ml = Markup::BBCodeLanguage;
-        tmp.text = Markup::processPostText(tmp.text, tmp.board, &tmp.refs, 0, ml);
-        bWriteLine(tq.translate("rerenderPosts", "Rendered post:", "message") + " " + QString::number(curr) + "/"
-                   + QString::number(sz) + " (" + QString::number(etmr.elapsed() - elapsed)
-                   + tq.translate("rerenderPosts", "ms", "message") + ")");
-        elapsed = etmr.elapsed();
-        ++curr;
-    }
-    count = 0;
-    int offset = 0;
-    bWriteLine(tq.translate("rerenderPosts", "Writing posts...", "message"));
-    while (offset < postIds.size()) {
-        int o = offset + Offset;
-        if (o > postIds.size())
-            o = postIds.size();
-        bWriteLine(tq.translate("rerenderPosts", "Writing posts:", "message") + " "
-                   + QString::number(o) + "/" + QString::number(postIds.size()));
+        if (postIds.isEmpty())
+            break;
+        foreach (quint64 id, postIds.keys())
+            pool.start(new RerenderTask(postIds[id]));
+        pool.waitForDone();
+        //NOTE: Rendering runs without processTextLock; edits made meanwhile are detected by the rawText check below
+        QMutexLocker plocker(&postMutex);
+        QReadLocker locker(&processTextLock);
         try {
-            Transaction t;
+            Transaction t(Transaction::WriteMode);
             if (!t)
                 return bRet(error, tq.translate("rerenderPosts", "Internal database error", "error"), -1);
-            QString qs = "id IN (";
-            foreach (quint64 id, postIds.keys().mid(count, Offset))
-                qs += QString::number(id) + ", ";
-            qs.remove(qs.length() - 2, 2);
-            qs += ")";
-            QList<Post> posts = query<Post, Post>(qs);
+            QList<quint64> ids = postIds.keys();
+            QList<Post> posts;
+            for (int i = 0; i < ids.size(); i += MaxInRangeSize) {
+                QList<quint64> chunk = ids.mid(i, MaxInRangeSize);
+                posts << query<Post, Post>(odb::query<Post>::id.in_range(chunk.begin(), chunk.end()));
+            }
             foreach (int i, bRangeD(0, posts.size() - 1)) {
                 Post &post = posts[i];
+                const PostTmpInfo &tmp = postIds.value(post.id());
+                //NOTE: The post was edited after it had been read, so its text is already rendered from the new source
+                if (post.rawText() != tmp.rawText || post.extendedWakabaMarkEnabled() != tmp.extendedWakabaMarkEnabled
+                        || post.bbCodeEnabled() != tmp.bbCodeEnabled) {
+                    continue;
+                }
                 if (!post.draft() && !removeFromReferencedPosts(post.id(), error, tq.locale()))
                     return -1;
                 if (post.rawHtml())
                     continue;
-                const PostTmpInfo &tmp = postIds.value(post.id());
                 post.setText(tmp.text);
                 QSharedPointer<Post> sp(new Post(post));
                 if (!post.draft() && !addToReferencedPosts(sp, tmp.refs, error, 0, tq.locale()))
@@ -2476,20 +3029,27 @@ int rerenderPosts(const QStringList boardNames, QString *error, const QLocale &l
                 Cache::removePost(post.board(), post.number());
             }
             t.commit();
-            count += posts.size();
-            offset += Offset;
         } catch (const odb::exception &e) {
             return bRet(error, Tools::fromStd(e.what()), -1);
         }
-        bWriteLine(tq.translate("rerenderPosts", "Wrote posts:", "message") + " " + QString::number(o) + "/"
-                   + QString::number(postIds.size()) + " (" + QString::number(etmr.elapsed() - elapsed)
-                   + tq.translate("rerenderPosts", "ms", "message") + ")");
-        elapsed = etmr.elapsed();
-    }
+        locker.unlock();
+        plocker.unlock();
+        lastId = postIds.lastKey();
+        done += postIds.size();
+        writeRerenderCheckpoint(boards, lastId);
+        qint64 elapsed = qMax(etmr.elapsed(), qint64(1));
+        bWriteLine(tq.translate("rerenderPosts", "Rerendered posts:", "message") + " " + QString::number(done) + "/"
+                   + QString::number(qMax(count, done)) + " (" + QString::number(elapsed) + " "
+                   + tq.translate("rerenderPosts", "ms", "message") + ", "
+                   + QString::number(qint64(done) * 1000 / elapsed) + " "
+                   + tq.translate("rerenderPosts", "posts/s", "message") + ")");
+    }
+    QFile::remove(Tools::rerenderCheckpointFile());
     Cache::clearLastNPostsCache();
+    Cache::clearPagesCache();
     bWriteLine(tq.translate("rerenderPosts", "Finished! Operation took", "message") + " "
                + QString::number(etmr.elapsed()) + tq.translate("rerenderPosts", "ms", "message"));
-    return bRet(error, QString(), count);
+    return bRet(error, QString(), done);
 }
 
 QString rss(const QString &boardName)
@@ -2498,6 +3058,29 @@ QString rss(const QString &boardName)
     return rssMap.value(boardName);
 }
 
+Search::DocumentList searchDocuments(bool *ok, QString *error, const QLocale &l)
+{
+    TranslatorQt tq(l);
+    try {
+        Transaction t(Transaction::ReadOnlyMode);
+        if (!t) {
+            return bRet(ok, false, error, tq.translate("searchDocuments", "Internal database error", "error"),
+                        Search::DocumentList());
+        }
+        Search::DocumentList list;
+        foreach (const Post &post, queryAll<Post>()) {
+            Search::Document d;
+            d.boardName = post.board();
+            d.postNumber = post.number();
+            d.text = post.rawText();
+            list << d;
+        }
+        return bRet(ok, true, error, QString(), list);
+    } catch (const odb::exception &e) {
+        return bRet(ok, false, error, Tools::fromStd(e.what()), Search::DocumentList());
+    }
+}
+
 bool setThreadFixed(const QString &board, quint64 threadNumber, bool fixed, QString *error, const QLocale &l)
 {
     return setThreadFixedInternal(board, threadNumber, fixed, error, l);
@@ -2609,6 +3192,20 @@ bool setVoteOpened(quint64 postNumber, bool opened, const QByteArray &password,
     }
 }
 
+void stopBanExpiry()
+{
+    QMutexLocker locker(&banExpirationsMutex);
+    banExpiryStopped = true;
+    banExpirationsCondition.wakeAll();
+    BanExpiryThread *t = banExpiryThread;
+    banExpiryThread = 0;
+    locker.unlock();
+    if (!t)
+        return;
+    t->wait();
+    delete t;
+}
+
 bool unvote(quint64 postNumber, const cppcms::http::request &req, QString *error)
 {
     TranslatorQt tq(req);
@@ -2678,6 +3275,17 @@ QMap<QString, BanInfo> userBanInfo(const QString &ip, bool *ok, QString *error,
     TranslatorQt tq(l);
     if (ip.isEmpty())
         return bRet(ok, false, error, tq.translate("userBanInfo", "Internal logic error", "error"), map);
+    QSharedPointer<const BanTable> table = banTableSnapshot();
+    if (!table.isNull()) {
+        BanTable::ConstIterator i = table->find(ip);
+        if (table->end() == i)
+            return bRet(ok, true, error, QString(), map);
+        foreach (const BanInfo &inf, i.value()) {
+            if (!inf.isExpired())
+                map.insert(inf.boardName, inf);
+        }
+        return bRet(ok, true, error, QString(), map);
+    }
     try {
         Transaction t;
         if (!t)
@@ -2711,6 +3319,23 @@ QMap<QString, BanInfo> userBanInfo(const QString &boardName, quint64 postNumber,
     return userBanInfo(posterIp(boardName, postNumber), ok, error, l);
 }
 
+QMap<QString, BanInfo> userBanInfo(const cppcms::http::request &req, bool *ok, QString *error)
+{
+    RequestContext *c = RequestContext::current(req);
+    if (c && c->lookup(RequestContext::BanInfoValue))
+        return bRet(ok, c->banInfoOk, error, c->banInfoError, c->banInfo);
+    bool b = false;
+    QString err;
+    QMap<QString, BanInfo> map = userBanInfo(Tools::userIp(req), &b, &err, Tools::locale(req));
+    if (c) {
+        c->banInfo = map;
+        c->banInfoOk = b;
+        c->banInfoError = err;
+        c->store(RequestContext::BanInfoValue);
+    }
+    return bRet(ok, b, error, err, map);
+}
+
 bool vote(quint64 postNumber, const QStringList &votes, const cppcms::http::request &req, QString *error)
 {
     TranslatorQt tq(req);
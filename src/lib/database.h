@@ -285,7 +285,6 @@ public:
 
 OLOLORD_EXPORT bool addFile(const cppcms::http::request &req, const QMap<QString, QString> &params,
                             const QList<Tools::File> &files, QString *error = 0, QString *description = 0);
-OLOLORD_EXPORT int addPostsToIndex(QString *error = 0, const QLocale &l = BCoreApplication::locale());
 OLOLORD_EXPORT QMap< QString, QMap<QString, BanInfo> > banInfos(bool *ok = 0, QString *error = 0,
                                                                 const QLocale &l = BCoreApplication::locale());
 OLOLORD_EXPORT bool banUser(const QString &ip, const QList<BanInfo> &bans, QString *error = 0,
@@ -314,7 +313,8 @@ OLOLORD_EXPORT bool editPost(EditPostParameters &p);
 OLOLORD_EXPORT unsigned int fileCount(const QString &boardName, quint64 postNumber);
 OLOLORD_EXPORT bool fileExists(const QByteArray &hash, bool *ok = 0);
 OLOLORD_EXPORT bool fileExists(const QString &hashString, bool *ok = 0);
-OLOLORD_EXPORT QList<Post> findPosts(const Search::Query &query, const QString &boardName = QString(), bool *ok = 0,
+OLOLORD_EXPORT QList<Post> findPosts(const Search::Query &query, const QString &boardName = QString(), int count = 0,
+                                     const QString &cursor = QString(), QString *nextCursor = 0, bool *ok = 0,
                                      QString *error = 0, QString *description = 0,
                                      const QLocale &l = BCoreApplication::locale());
 OLOLORD_EXPORT void generateRss();
@@ -350,6 +350,7 @@ OLOLORD_EXPORT quint64 moveThread(const cppcms::http::request &req, const QStrin
 OLOLORD_EXPORT bool postExists(const QString &boardName, quint64 postNumber, quint64 *threadNumber = 0);
 OLOLORD_EXPORT QString posterIp(const QString &boardName, quint64 postNumber);
 OLOLORD_EXPORT quint64 postThreadNumber(const QString &boardName, quint64 postNumber);
+OLOLORD_EXPORT RefMap postThreadNumbers(const QList<RefKey> &posts, bool *ok = 0);
 OLOLORD_EXPORT QStringList registeredUserBoards(const cppcms::http::request &req);
 OLOLORD_EXPORT QStringList registeredUserBoards(const QByteArray &hashpass);
 OLOLORD_EXPORT int registeredUserLevel(const cppcms::http::request &req);
@@ -357,9 +358,12 @@ OLOLORD_EXPORT int registeredUserLevel(const QByteArray &hashpass);
 OLOLORD_EXPORT bool registerUser(const QByteArray &hashpass, RegisteredUser::Level level = RegisteredUser::UserLevel,
                                  const QStringList &boards = QStringList("*"), QString *error = 0,
                                  const QLocale &l = BCoreApplication::locale());
+OLOLORD_EXPORT bool reloadRegisteredUsers();
 OLOLORD_EXPORT int rerenderPosts(const QStringList boardNames = QStringList(), QString *error = 0,
                                  const QLocale &l = BCoreApplication::locale());
 OLOLORD_EXPORT QString rss(const QString &boardName);
+OLOLORD_EXPORT Search::DocumentList searchDocuments(bool *ok = 0, QString *error = 0,
+                                                   const QLocale &l = BCoreApplication::locale());
 OLOLORD_EXPORT bool setThreadFixed(const QString &boardName, quint64 threadNumber, bool fixed, QString *error = 0,
                                    const QLocale &l = BCoreApplication::locale());
 OLOLORD_EXPORT bool setThreadFixed(const QString &boardName, quint64 threadNumber, bool fixed,
@@ -370,11 +374,14 @@ OLOLORD_EXPORT bool setThreadOpened(const QString &boardName, quint64 threadNumb
                                     const cppcms::http::request &req, QString *error = 0);
 OLOLORD_EXPORT bool setVoteOpened(quint64 postNumber, bool opened, const QByteArray &password,
                                   const cppcms::http::request &req, QString *error = 0);
+OLOLORD_EXPORT void stopBanExpiry();
 OLOLORD_EXPORT bool unvote(quint64 postNumber, const cppcms::http::request &req, QString *error = 0);
 OLOLORD_EXPORT QMap<QString, BanInfo> userBanInfo(const QString &ip, bool *ok = 0, QString *error = 0,
                                                   const QLocale &l = BCoreApplication::locale());
 OLOLORD_EXPORT QMap<QString, BanInfo> userBanInfo(const QString &boardName, quint64 postNumber, bool *ok = 0,
                                                   QString *error = 0, const QLocale &l = BCoreApplication::locale());
+OLOLORD_EXPORT QMap<QString, BanInfo> userBanInfo(const cppcms::http::request &req, bool *ok = 0,
+                                                  QString *error = 0);
 OLOLORD_EXPORT bool vote(quint64 postNumber, const QStringList &votes, const cppcms::http::request &req,
                          QString *error = 0);
 
@@ -17,25 +17,34 @@ DEFINES += OLOLORD_BUILD_LIB
 
 SOURCES += \
     cache.cpp \
+    cachewarmup.cpp \
     controller.cpp \
     database.cpp \
     markup.cpp \
     ololordapplication.cpp \
+    requestcontext.cpp \
     search.cpp \
+    searchanalyzer.cpp \
     settingslocker.cpp \
+    threadindex.cpp \
     tools.cpp \
     transaction.cpp \
     translator.cpp
 
 HEADERS += \
     cache.h \
+    cachewarmup.h \
     controller.h \
     database.h \
     global.h \
     markup.h \
     ololordapplication.h \
+    requestcontext.h \
     search.h \
+    searchanalyzer.h \
     settingslocker.h \
+    shardedcache.h \
+    threadindex.h \
     tools.h \
     transaction.h \
     translator.h
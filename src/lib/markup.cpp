@@ -21,6 +21,8 @@
 #include <QList>
 #include <QLocale>
 #include <QMap>
+#include <QMutex>
+#include <QMutexLocker>
 #include <QPair>
 #include <QRegExp>
 #include <QSettings>
@@ -29,6 +31,7 @@
 #include <QString>
 #include <QStringList>
 #include <QVariant>
+#include <QVector>
 
 #include <cppcms/http_request.h>
 
@@ -67,7 +70,12 @@ public:
     Database::RefMap * const ReferencedPosts;
 private:
     QList<SkipInfo> skipList;
+    mutable QVector<int> skipEnds;
+    mutable bool skipEndsValid;
     QString &mtext;
+    Database::RefMap threadNumbers;
+    QString mpathPrefix;
+    bool pathPrefixRead;
 public:
     explicit ProcessingInfo(QString &txt, const QString &boardName, Database::RefMap *referencedPosts,
                             quint64 deletedPost);
@@ -75,9 +83,32 @@ public:
     int find(const QRegExp &rx, int from = 0, bool escapable = false) const;
     bool in(int start, int length, SkipType type = CodeSkip) const;
     void insert(int from, const QString &txt, SkipType type = HtmlSkip);
+    QString pathPrefix();
     void replace(int from, int length, const QString &txt, int correction, SkipType type = HtmlSkip);
+    void resolvePosts(const QList<Database::RefKey> &posts);
     const QString &text() const;
+    quint64 threadNumber(const QString &boardName, quint64 postNumber);
     QString toHtml() const;
+private:
+    int skipEnd(int pos) const;
+};
+
+enum Marker
+{
+    NoMarker = 0x0000,
+    BacktickMarker = 0x0001,
+    QuoteMarker = 0x0002,
+    SlashMarker = 0x0004,
+    BracketMarker = 0x0008,
+    DotMarker = 0x0010,
+    ColonMarker = 0x0020,
+    CaretMarker = 0x0040,
+    QuestionMarker = 0x0080,
+    GreaterMarker = 0x0100,
+    DashMarker = 0x0200,
+    AsteriskMarker = 0x0400,
+    UnderscoreMarker = 0x0800,
+    PercentMarker = 0x1000
 };
 
 struct ListInfo
@@ -88,35 +119,30 @@ struct ListInfo
     QString type;
 };
 
+static QRegExp compiledRegExp(const QRegExp &rx);
 static bool isEscaped(const QString &s, int pos);
+static int scanMarkers(const QString &text);
 static QString withoutEscaped(const QString &text);
 
 ProcessingInfo::ProcessingInfo(QString &txt, const QString &boardName, Database::RefMap *referencedPosts,
                                quint64 deletedPost) :
     BoardName(boardName), DeletedPost(deletedPost), ReferencedPosts(referencedPosts), mtext(txt)
 {
-    //
+    skipEndsValid = true;
+    pathPrefixRead = false;
 }
 
 int ProcessingInfo::find(const QRegExp &rx, int from, bool escapable) const
 {
     int ind = rx.indexIn(mtext, from);
     while (ind >= 0) {
-        bool in = false;
-        foreach (int i, bRangeD(0, skipList.length() - 1)) {
-            const SkipInfo &inf = skipList.at(i);
-            if (ind >= inf.from && ind < (inf.from + inf.length)) {
-                ind = rx.indexIn(mtext, inf.from + inf.length);
-                in = true;
-                break;
-            }
-        }
-        if (!in) {
-            if (escapable && isEscaped(mtext, ind))
-                ind = rx.indexIn(mtext, ind + 1);
-            else
-                return ind;
-        }
+        int end = skipEnd(ind);
+        if (end > ind)
+            ind = rx.indexIn(mtext, end);
+        else if (escapable && isEscaped(mtext, ind))
+            ind = rx.indexIn(mtext, ind + 1);
+        else
+            return ind;
     }
     return -1;
 }
@@ -127,14 +153,8 @@ bool ProcessingInfo::in(int start, int length, SkipType type) const
         return false;
     foreach (int i, bRangeD(0, skipList.length() - 1)) {
         const SkipInfo &inf = skipList.at(i);
-        if (inf.type != type)
-            continue;
-        int x = start;
-        while (x < start + length) {
-            if (x >= inf.from && x <= (inf.from + inf.length))
-                return true;
-            ++x;
-        }
+        if (inf.type == type && start <= (inf.from + inf.length) && (start + length) > inf.from)
+            return true;
     }
     return false;
 }
@@ -160,9 +180,19 @@ void ProcessingInfo::insert(int from, const QString &txt, SkipType type)
     }
     if (!found && NoSkip != type)
         skipList.prepend(info);
+    skipEndsValid = false;
     mtext.insert(from, txt);
 }
 
+QString ProcessingInfo::pathPrefix()
+{
+    if (!pathPrefixRead) {
+        mpathPrefix = SettingsLocker()->value("Site/path_prefix").toString();
+        pathPrefixRead = true;
+    }
+    return mpathPrefix;
+}
+
 void ProcessingInfo::replace(int from, int length, const QString &txt, int correction, SkipType type)
 {
     if (from < 0 || length <= 0 || txt.isEmpty() || (length + from) > mtext.length())
@@ -187,14 +217,63 @@ void ProcessingInfo::replace(int from, int length, const QString &txt, int corre
     }
     if (!found && NoSkip != type)
         skipList.prepend(info);
+    skipEndsValid = false;
     mtext.replace(from, length, txt);
 }
 
+void ProcessingInfo::resolvePosts(const QList<Database::RefKey> &posts)
+{
+    bool ok = false;
+    Database::RefMap map = Database::postThreadNumbers(posts, &ok);
+    if (!ok)
+        return;
+    foreach (const Database::RefKey &key, posts)
+        threadNumbers.insert(key, map.value(key));
+}
+
 const QString &ProcessingInfo::text() const
 {
     return mtext;
 }
 
+quint64 ProcessingInfo::threadNumber(const QString &boardName, quint64 postNumber)
+{
+    Database::RefKey key(boardName, postNumber);
+    Database::RefMap::ConstIterator i = threadNumbers.find(key);
+    if (threadNumbers.end() != i)
+        return i.value();
+    quint64 tn = 0;
+    Database::postExists(boardName, postNumber, &tn);
+    threadNumbers.insert(key, tn);
+    return tn;
+}
+
+int ProcessingInfo::skipEnd(int pos) const
+{
+    //NOTE: skipList is sorted by position, so the skipped part with the farthest end among those starting at or
+    //before pos contains pos if any of them does
+    if (!skipEndsValid) {
+        skipEnds.resize(skipList.size());
+        int end = 0;
+        foreach (int i, bRangeD(0, skipList.size() - 1)) {
+            const SkipInfo &inf = skipList.at(i);
+            end = qMax(end, inf.from + inf.length);
+            skipEnds[i] = end;
+        }
+        skipEndsValid = true;
+    }
+    int lo = 0;
+    int hi = skipList.size();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (skipList.at(mid).from <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo ? skipEnds.at(lo - 1) : -1;
+}
+
 QString ProcessingInfo::toHtml() const
 {
     QString s;
@@ -206,11 +285,24 @@ QString ProcessingInfo::toHtml() const
         last = inf.from + inf.length;
     }
     s += BTextTools::toHtml(mtext.mid(last), false);
-    s.replace(QRegExp("</li>(\\s|&nbsp;|<br />)+<li"), "</li><li");
-    s.replace(QRegExp("</li>(\\s|&nbsp;|<br />)+</ul"), "</li></ul");
-    s.replace(QRegExp("</li>(\\s|&nbsp;|<br />)+</ol"), "</li></ol");
-    s.replace(QRegExp("<ol>(\\s|&nbsp;|<br />)+<li"), "<ol><li");
-    QRegExp rx("<ul type\\=\"(disc|circle|square)\">(\\s|&nbsp;|<br />)+<li");
+    typedef QList<QRegExp> RegExpList;
+    init_once(RegExpList, rxList, RegExpList()) {
+        rxList << compiledRegExp(QRegExp("</li>(\\s|&nbsp;|<br />)+<li"));
+        rxList << compiledRegExp(QRegExp("</li>(\\s|&nbsp;|<br />)+</ul"));
+        rxList << compiledRegExp(QRegExp("</li>(\\s|&nbsp;|<br />)+</ol"));
+        rxList << compiledRegExp(QRegExp("<ol>(\\s|&nbsp;|<br />)+<li"));
+        rxList << compiledRegExp(QRegExp("<ul type\\=\"(disc|circle|square)\">(\\s|&nbsp;|<br />)+<li"));
+    }
+    if (s.contains("</li>")) {
+        s.replace(QRegExp(rxList.at(0)), "</li><li");
+        s.replace(QRegExp(rxList.at(1)), "</li></ul");
+        s.replace(QRegExp(rxList.at(2)), "</li></ol");
+    }
+    if (s.contains("<ol>"))
+        s.replace(QRegExp(rxList.at(3)), "<ol><li");
+    if (!s.contains("<ul type=\""))
+        return s;
+    QRegExp rx(rxList.at(4));
     int ind = rx.indexIn(s);
     while (ind >= 0) {
         QString ns = "<ul type=\"" + rx.cap(1) + "\"><li";
@@ -220,6 +312,13 @@ QString ProcessingInfo::toHtml() const
     return s;
 }
 
+QRegExp compiledRegExp(const QRegExp &rx)
+{
+    //NOTE: isValid() compiles the pattern, so that the copies made for every post share the compiled engine
+    rx.isValid();
+    return rx;
+}
+
 bool isEscaped(const QString &s, int pos)
 {
     if (pos <= 0 || pos >= s.length())
@@ -233,17 +332,73 @@ bool isEscaped(const QString &s, int pos)
     return (n % 2);
 }
 
+int scanMarkers(const QString &text)
+{
+    int markers = NoMarker;
+    const QChar *d = text.unicode();
+    const QChar *end = d + text.length();
+    for (; d != end; ++d) {
+        switch (d->unicode()) {
+        case '`':
+            markers |= BacktickMarker;
+            break;
+        case '\'':
+            markers |= QuoteMarker;
+            break;
+        case '/':
+            markers |= SlashMarker;
+            break;
+        case '[':
+            markers |= BracketMarker;
+            break;
+        case '.':
+            markers |= DotMarker;
+            break;
+        case ':':
+            markers |= ColonMarker;
+            break;
+        case '^':
+            markers |= CaretMarker;
+            break;
+        case '?':
+            markers |= QuestionMarker;
+            break;
+        case '>':
+            markers |= GreaterMarker;
+            break;
+        case '-':
+            markers |= DashMarker;
+            break;
+        case '*':
+            markers |= AsteriskMarker;
+            break;
+        case '_':
+            markers |= UnderscoreMarker;
+            break;
+        case '%':
+            markers |= PercentMarker;
+            break;
+        default:
+            break;
+        }
+    }
+    return markers;
+}
+
 QString withoutEscaped(const QString &text)
 {
+    init_once(QRegExp, rxProto, QRegExp())
+        rxProto = compiledRegExp(QRegExp("``|''"));
     QString ntext = text;
-    int ind = ntext.lastIndexOf(QRegExp("``|''"));
+    QRegExp rx(rxProto);
+    int ind = ntext.lastIndexOf(rx);
     while (ind >= 0) {
         if (isEscaped(ntext, ind)) {
             ntext.remove(ind - 1, 1);
-            ind = ntext.lastIndexOf(QRegExp("``|''"), ind - ntext.length() - 3);
+            ind = ntext.lastIndexOf(rx, ind - ntext.length() - 3);
             continue;
         }
-        ind = ntext.lastIndexOf(QRegExp("``|''"), ind - ntext.length() - 2);
+        ind = ntext.lastIndexOf(rx, ind - ntext.length() - 2);
     }
     return ntext;
 }
@@ -333,7 +488,9 @@ static void process(ProcessingInfo &info, ConversionFunction conversionFunction,
 
 static void processStrikedOutShitty(ProcessingInfo &info)
 {
-    QRegExp rx("(\\^H)+");
+    init_once(QRegExp, rxProto, QRegExp())
+        rxProto = compiledRegExp(QRegExp("(\\^H)+"));
+    QRegExp rx(rxProto);
     int ind = info.find(rx);
     while (ind >= 0) {
         int s = ind - (rx.matchedLength() / 2);
@@ -349,7 +506,9 @@ static void processStrikedOutShitty(ProcessingInfo &info)
 
 static void processStrikedOutShittyWord(ProcessingInfo &info)
 {
-    QRegExp rx("(\\^W)+");
+    init_once(QRegExp, rxProto, QRegExp())
+        rxProto = compiledRegExp(QRegExp("(\\^W)+"));
+    QRegExp rx(rxProto);
     int ind = info.find(rx);
     const QString &txt = info.text();
     while (ind >= 0) {
@@ -412,6 +571,38 @@ static QString convertPre(ProcessingInfo &, const QString &text, const QRegExp &
     return withoutEscaped(text);
 }
 
+typedef QList<srchilite::SourceHighlight *> SourceHighlightList;
+
+static const int MaxIdleHighlighters = 8;
+
+static QMap<QString, SourceHighlightList> highlighters;
+static QMutex highlightersMutex;
+
+static srchilite::SourceHighlight *takeHighlighter(const QString &lang, const QString &dataDir)
+{
+    {
+        QMutexLocker locker(&highlightersMutex);
+        SourceHighlightList &list = highlighters[lang];
+        if (!list.isEmpty())
+            return list.takeLast();
+    }
+    srchilite::SourceHighlight *sh = new srchilite::SourceHighlight("html.outlang");
+    sh->setDataDir(Tools::toStd(dataDir));
+    return sh;
+}
+
+static void returnHighlighter(const QString &lang, srchilite::SourceHighlight *sh)
+{
+    QMutexLocker locker(&highlightersMutex);
+    SourceHighlightList &list = highlighters[lang];
+    if (list.size() >= MaxIdleHighlighters) {
+        locker.unlock();
+        delete sh;
+        return;
+    }
+    list << sh;
+}
+
 static QString convertCode(ProcessingInfo &, const QString &text, const QRegExp &rxOp, const QRegExp &, QString &op,
                            QString &cl, ProcessingInfo::SkipType &type)
 {
@@ -426,23 +617,32 @@ static QString convertCode(ProcessingInfo &, const QString &text, const QRegExp
     lang.replace("++", "pp");
     if (lang.isEmpty())
         lang = "nohilite";
+    QString key = lang + "/" + QCryptographicHash::hash(text.toUtf8(), QCryptographicHash::Md5).toHex();
+    QString html;
+    if (Cache::highlightedCode(key, &html))
+        return html;
     std::istringstream in(Tools::toStd(text));
     std::ostringstream out;
+    srchilite::SourceHighlight *sh = takeHighlighter(lang, srchighlightPath);
     try {
-        srchilite::SourceHighlight sourceHighlight("html.outlang");
-        sourceHighlight.setDataDir(Tools::toStd(srchighlightPath));
-        sourceHighlight.highlight(in, out, Tools::toStd(lang + ".lang"));
+        sh->highlight(in, out, Tools::toStd(lang + ".lang"));
     } catch (const srchilite::ParserException &e) {
         Tools::log("Markup::convertCode", e);
+        delete sh;
         return "";
     } catch (const srchilite::IOException &e) {
         Tools::log("Markup::convertCode", e);
+        delete sh;
         return "";
     } catch (const std::exception &e) {
         Tools::log("Markup::convertCode", e);
+        delete sh;
         return "";
     }
-    return Tools::fromStd(out.str());
+    returnHighlighter(lang, sh);
+    html = Tools::fromStd(out.str());
+    Cache::cacheHighlightedCode(key, html);
+    return html;
 }
 
 static QString convertExternalLink(ProcessingInfo &, const QString &, const QRegExp &rxOp, const QRegExp &,
@@ -472,20 +672,37 @@ static QString convertTooltipShitty(ProcessingInfo &, const QString &, const QRe
     return rxOp.cap(1);
 }
 
+static QList<Database::RefKey> postLinks(const QString &text, const QString &boardName, const QString &boards)
+{
+    QList<Database::RefKey> list;
+    QRegExp rx(">>([1-9][0-9]*)");
+    int ind = rx.indexIn(text);
+    while (ind >= 0) {
+        list << Database::RefKey(boardName, rx.cap(1).toULongLong());
+        ind = rx.indexIn(text, ind + rx.matchedLength());
+    }
+    rx = QRegExp(">>/(" + boards + ")/([1-9][0-9]*)");
+    ind = rx.indexIn(text);
+    while (ind >= 0) {
+        list << Database::RefKey(rx.cap(1), rx.cap(2).toULongLong());
+        ind = rx.indexIn(text, ind + rx.matchedLength());
+    }
+    return list;
+}
+
 static QString convertPostLink(ProcessingInfo &info, const QString &, const QRegExp &rxOp, const QRegExp &,
                                QString &, QString &, ProcessingInfo::SkipType &type)
 {
     type = ProcessingInfo::HtmlSkip;
-    QString prefix = SettingsLocker()->value("Site/path_prefix").toString();
     QString boardName = (rxOp.captureCount() > 1) ? rxOp.cap(1) : info.BoardName;
     QString postNumber = rxOp.cap((rxOp.captureCount() > 1) ? 2 : 1);
     quint64 pn = postNumber.toULongLong();
-    quint64 tn = 0;
-    if (pn && (pn != info.DeletedPost) && Database::postExists(boardName, pn, &tn)) {
+    quint64 tn = (pn && (pn != info.DeletedPost)) ? info.threadNumber(boardName, pn) : 0;
+    if (tn) {
         if (info.ReferencedPosts)
             info.ReferencedPosts->insert(Database::RefKey(boardName, pn), tn);
         QString threadNumber = QString::number(tn);
-        QString href = "href=\"/" + prefix + boardName + "/thread/" + threadNumber + ".html#" + postNumber + "\"";
+        QString href = "href=\"/" + info.pathPrefix() + boardName + "/thread/" + threadNumber + ".html#" + postNumber + "\"";
         return "<a " + href + ">" + rxOp.cap().replace(">", "&gt;") + "</a>";
     } else {
         return rxOp.cap().replace(">", "&gt;");
@@ -618,99 +835,175 @@ static QString convertCitation(ProcessingInfo &, const QString &text, const QReg
     return text;
 }
 
-QString processPostText(QString text, const QString &boardName, Database::RefMap *referencedPosts, quint64 deletedPost,
-                        MarkupLanguage languages)
+enum SpecialPass
+{
+    NoSpecialPass = 0,
+    StrikedOutShittyPass,
+    PostLinkPass
+};
+
+struct Pass
+{
+    int languages;
+    int markers;
+    SpecialPass special;
+    ConversionFunction conversionFunction;
+    QRegExp rxOp;
+    QRegExp rxCl;
+    bool nestable;
+    bool escapable;
+    CheckFunction checkFunction;
+};
+
+typedef QList<Pass> PassList;
+
+static QRegExp fixedRegExp(const QString &s)
+{
+    return compiledRegExp(QRegExp(s, Qt::CaseInsensitive, QRegExp::FixedString));
+}
+
+static QRegExp markupRegExp(const QString &pattern, Qt::CaseSensitivity cs = Qt::CaseInsensitive)
 {
-    init_once(QString, langs, QString()) {
+    return compiledRegExp(QRegExp(pattern, cs));
+}
+
+static Pass makePass(int languages, int markers, ConversionFunction conversionFunction, const QRegExp &rxOp,
+                     const QRegExp &rxCl, bool nestable = false, bool escapable = false,
+                     CheckFunction checkFunction = 0)
+{
+    Pass p;
+    p.languages = languages;
+    p.markers = markers;
+    p.special = NoSpecialPass;
+    p.conversionFunction = conversionFunction;
+    p.rxOp = rxOp;
+    p.rxCl = rxCl;
+    p.nestable = nestable;
+    p.escapable = escapable;
+    p.checkFunction = checkFunction;
+    return p;
+}
+
+static Pass makeSpecialPass(int languages, int markers, SpecialPass special)
+{
+    Pass p = makePass(languages, markers, 0, QRegExp(), QRegExp());
+    p.special = special;
+    return p;
+}
+
+static Pass makeFixedPass(int languages, int markers, ConversionFunction conversionFunction, const QString &op,
+                          const QString &cl, bool nestable = false, bool escapable = false)
+{
+    return makePass(languages, markers, conversionFunction, fixedRegExp(op), fixedRegExp(cl), nestable, escapable);
+}
+
+static const PassList &passes()
+{
+    init_once(PassList, list, PassList()) {
         QStringList sl = Tools::supportedCodeLanguages();
         sl.removeAll("url");
-        langs = sl.join("|").replace("+", "\\+");
+        QString langs = sl.join("|").replace("+", "\\+");
+        const int W = ExtendedWakabaMarkLanguage;
+        const int B = BBCodeLanguage;
+        const int A = ExtendedWakabaMarkLanguage | BBCodeLanguage;
+        QRegExp rxPreCl = markupRegExp("\\s+\\\\\\-\\-");
+        list << makeFixedPass(W, BacktickMarker, &convertMonospace, "``", "``", false, true);
+        list << makeFixedPass(W, QuoteMarker, &convertNomarkup, "''", "''", false, true);
+        list << makePass(W, SlashMarker, &convertPre, markupRegExp("/\\-\\-pre\\s+"), rxPreCl);
+        list << makePass(W, SlashMarker, &convertCode, markupRegExp("/\\-\\-code\\s+(" + langs + ")\\s+"), rxPreCl);
+        list << makeFixedPass(B, BracketMarker, &convertPre, "[pre]", "[/pre]");
+        list << makeFixedPass(B, BracketMarker, &convertCode, "[code]", "[/code]");
+        list << makePass(B, BracketMarker, &convertCode, markupRegExp("\\[code\\s+lang\\=\"?(" + langs + ")\"?\\s*\\]"),
+                         fixedRegExp("[/code]"));
+        list << makePass(B, BracketMarker, &convertCode, markupRegExp("\\[(" + langs + ")\\]"),
+                         markupRegExp("\\[/(" + langs + ")\\]"), false, false, &checkLangsMatch);
+        list << makeFixedPass(B, BracketMarker, &convertMonospace, "[m]", "[/m]");
+        list << makeFixedPass(B, BracketMarker, &convertNomarkup, "[n]", "[/n]");
+        list << makePass(A, DotMarker, &convertExternalLink,
+                         markupRegExp(Tools::externalLinkRegexpPattern(), Qt::CaseSensitive), QRegExp(), false, false,
+                         &checkExternalLink);
+        list << makePass(A, ColonMarker, &convertProtocol, markupRegExp("(mailto|irc|news):(\\S+)", Qt::CaseSensitive),
+                         QRegExp());
+        list << makeSpecialPass(A, CaretMarker, StrikedOutShittyPass);
+        list << makePass(A, QuestionMarker, &convertTooltipShitty,
+                         markupRegExp("([^\\?\\s]+)\\?{3}\"([^\"]+)\"", Qt::CaseSensitive), QRegExp());
+        Pass postLinkPass = makePass(A, GreaterMarker, &convertPostLink,
+                                     markupRegExp(">>([1-9][0-9]*)", Qt::CaseSensitive), QRegExp());
+        postLinkPass.special = PostLinkPass;
+        list << postLinkPass;
+        list << makePass(A, DashMarker, &convertMarkup, fixedRegExp("----"), QRegExp());
+        list << makeFixedPass(W, DashMarker, &convertMarkup, "---", "---");
+        list << makePass(A, DashMarker, &convertMarkup, fixedRegExp("--"), QRegExp());
+        list << makeFixedPass(W, AsteriskMarker, &convertMarkup, "***", "***");
+        list << makeFixedPass(W, AsteriskMarker, &convertMarkup, "**", "**");
+        list << makeFixedPass(W, AsteriskMarker, &convertMarkup, "*", "*");
+        list << makeFixedPass(W, UnderscoreMarker, &convertMarkup, "___", "___");
+        list << makeFixedPass(W, UnderscoreMarker, &convertMarkup, "__", "__");
+        list << makeFixedPass(W, UnderscoreMarker, &convertMarkup, "_", "_");
+        list << makeFixedPass(W, SlashMarker, &convertMarkup, "///", "///");
+        list << makeFixedPass(W, PercentMarker, &convertCSpoiler, "%%%", "%%%");
+        list << makeFixedPass(W, PercentMarker, &convertMarkup, "%%", "%%");
+        list << makeFixedPass(B, BracketMarker, &convertMarkup, "[b]", "[/b]", true);
+        list << makeFixedPass(B, BracketMarker, &convertMarkup, "[i]", "[/i]", true);
+        list << makeFixedPass(B, BracketMarker, &convertMarkup, "[s]", "[/s]", true);
+        list << makeFixedPass(B, BracketMarker, &convertMarkup, "[u]", "[/u]", true);
+        list << makeFixedPass(B, BracketMarker, &convertMarkup, "[sub]", "[/sub]", true);
+        list << makeFixedPass(B, BracketMarker, &convertMarkup, "[sup]", "[/sup]", true);
+        list << makeFixedPass(B, BracketMarker, &convertMarkup, "[spoiler]", "[/spoiler]", true);
+        list << makeFixedPass(B, BracketMarker, &convertUrl, "[url]", "[/url]", true);
+        list << makeFixedPass(B, BracketMarker, &convertCSpoiler, "[cspoiler]", "[/cspoiler]", true);
+        list << makePass(B, BracketMarker, &convertCSpoiler,
+                         markupRegExp("\\[cspoiler\\s+title\\=\"([^\"]*)\"\\s*\\]"), fixedRegExp("[/cspoiler]"), true);
+        list << makePass(B, BracketMarker, &convertTooltip, markupRegExp("\\[tooltip\\s+value\\=\"([^\"]*)\"\\s*\\]"),
+                         fixedRegExp("[/tooltip]"), true);
+        list << makePass(B, BracketMarker, &convertUnorderedList,
+                         markupRegExp("\\[ul\\s+type\\=\"?(disc|circle|square|d|c|s)\"?\\s*\\]"),
+                         fixedRegExp("[/ul]"), true);
+        list << makeFixedPass(B, BracketMarker, &convertOrderedList, "[ol]", "[/ol]", true);
+        list << makePass(B, BracketMarker, &convertListItem, markupRegExp("\\[li(\\s+value\\=\"?(\\d+)\"?\\s*)?\\]"),
+                         fixedRegExp("[/li]"), true);
+        list << makePass(A, GreaterMarker, &convertCitation, markupRegExp(">", Qt::CaseSensitive),
+                         markupRegExp("\n|$", Qt::CaseSensitive), false, false, &checkNotInterrupted);
     }
-    text.replace(QRegExp("\r+\n"), "\n");
+    return list;
+}
+
+QString processPostText(QString text, const QString &boardName, Database::RefMap *referencedPosts, quint64 deletedPost,
+                        MarkupLanguage languages)
+{
+    init_once(QRegExp, rxNewLine, QRegExp())
+        rxNewLine = compiledRegExp(QRegExp("\r+\n"));
+    text.replace(QRegExp(rxNewLine), "\n");
     text.replace("\r", "\n");
     ProcessingInfo info(text, boardName, referencedPosts, deletedPost);
-    if (ExtendedWakabaMarkLanguage & languages) {
-        process(info, &convertMonospace, QRegExp("``", Qt::CaseInsensitive, QRegExp::FixedString), false, true);
-        process(info, &convertNomarkup, QRegExp("''", Qt::CaseInsensitive, QRegExp::FixedString), false, true);
-        process(info, &convertPre, QRegExp("/\\-\\-pre\\s+", Qt::CaseInsensitive),
-                QRegExp("\\s+\\\\\\-\\-", Qt::CaseInsensitive));
-        process(info, &convertCode, QRegExp("/\\-\\-code\\s+(" + langs + ")\\s+", Qt::CaseInsensitive),
-                QRegExp("\\s+\\\\\\-\\-", Qt::CaseInsensitive));
-    }
-    if (BBCodeLanguage & languages) {
-        process(info, &convertPre, QRegExp("[pre]", Qt::CaseInsensitive, QRegExp::FixedString),
-                QRegExp("[/pre]", Qt::CaseInsensitive, QRegExp::FixedString));
-        process(info, &convertCode, QRegExp("[code]", Qt::CaseInsensitive, QRegExp::FixedString),
-                QRegExp("[/code]", Qt::CaseInsensitive, QRegExp::FixedString));
-        process(info, &convertCode, QRegExp("\\[code\\s+lang\\=\"?(" + langs + ")\"?\\s*\\]", Qt::CaseInsensitive),
-                QRegExp("[/code]", Qt::CaseInsensitive, QRegExp::FixedString));
-        process(info, &convertCode, QRegExp("\\[(" + langs + ")\\]", Qt::CaseInsensitive),
-                QRegExp("\\[/(" + langs + ")\\]", Qt::CaseInsensitive), false, false, &checkLangsMatch);
-        process(info, &convertMonospace, QRegExp("[m]", Qt::CaseInsensitive, QRegExp::FixedString),
-                QRegExp("[/m]", Qt::CaseInsensitive, QRegExp::FixedString));
-        process(info, &convertNomarkup, QRegExp("[n]", Qt::CaseInsensitive, QRegExp::FixedString),
-                QRegExp("[/n]", Qt::CaseInsensitive, QRegExp::FixedString));
-    }
-    if ((ExtendedWakabaMarkLanguage & languages) || (BBCodeLanguage & languages)) {
-        process(info, &convertExternalLink, QRegExp(Tools::externalLinkRegexpPattern()), QRegExp(), false, false,
-                &checkExternalLink);
-        process(info, &convertProtocol, QRegExp("(mailto|irc|news):(\\S+)"), QRegExp());
-        processStrikedOutShitty(info);
-        processStrikedOutShittyWord(info);
-        process(info, &convertTooltipShitty, QRegExp("([^\\?\\s]+)\\?{3}\"([^\"]+)\""), QRegExp());
-        process(info, &convertPostLink, QRegExp(">>([1-9][0-9]*)"), QRegExp());
-        QString boards = AbstractBoard::boardNames().join("|");
-        process(info, &convertPostLink, QRegExp(">>/(" + boards + ")/([1-9][0-9]*)"), QRegExp());
-        process(info, &convertMarkup, QRegExp("----", Qt::CaseInsensitive, QRegExp::FixedString), QRegExp());
-    }
-    if (ExtendedWakabaMarkLanguage & languages)
-        process(info, &convertMarkup, QRegExp("---", Qt::CaseInsensitive, QRegExp::FixedString));
-    if ((ExtendedWakabaMarkLanguage & languages) || (BBCodeLanguage & languages))
-        process(info, &convertMarkup, QRegExp("--", Qt::CaseInsensitive, QRegExp::FixedString), QRegExp());
-    if (ExtendedWakabaMarkLanguage & languages) {
-        process(info, &convertMarkup, QRegExp("***", Qt::CaseInsensitive, QRegExp::FixedString));
-        process(info, &convertMarkup, QRegExp("**", Qt::CaseInsensitive, QRegExp::FixedString));
-        process(info, &convertMarkup, QRegExp("*", Qt::CaseInsensitive, QRegExp::FixedString));
-        process(info, &convertMarkup, QRegExp("___", Qt::CaseInsensitive, QRegExp::FixedString));
-        process(info, &convertMarkup, QRegExp("__", Qt::CaseInsensitive, QRegExp::FixedString));
-        process(info, &convertMarkup, QRegExp("_", Qt::CaseInsensitive, QRegExp::FixedString));
-        process(info, &convertMarkup, QRegExp("///", Qt::CaseInsensitive, QRegExp::FixedString));
-        process(info, &convertCSpoiler, QRegExp("%%%", Qt::CaseInsensitive, QRegExp::FixedString));
-        process(info, &convertMarkup, QRegExp("%%", Qt::CaseInsensitive, QRegExp::FixedString));
-    }
-    if (BBCodeLanguage & languages) {
-        process(info, &convertMarkup, QRegExp("[b]", Qt::CaseInsensitive, QRegExp::FixedString),
-                QRegExp("[/b]", Qt::CaseInsensitive, QRegExp::FixedString), true);
-        process(info, &convertMarkup, QRegExp("[i]", Qt::CaseInsensitive, QRegExp::FixedString),
-                QRegExp("[/i]", Qt::CaseInsensitive, QRegExp::FixedString), true);
-        process(info, &convertMarkup, QRegExp("[s]", Qt::CaseInsensitive, QRegExp::FixedString),
-                QRegExp("[/s]", Qt::CaseInsensitive, QRegExp::FixedString), true);
-        process(info, &convertMarkup, QRegExp("[u]", Qt::CaseInsensitive, QRegExp::FixedString),
-                QRegExp("[/u]", Qt::CaseInsensitive, QRegExp::FixedString), true);
-        process(info, &convertMarkup, QRegExp("[sub]", Qt::CaseInsensitive, QRegExp::FixedString),
-                QRegExp("[/sub]", Qt::CaseInsensitive, QRegExp::FixedString), true);
-        process(info, &convertMarkup, QRegExp("[sup]", Qt::CaseInsensitive, QRegExp::FixedString),
-                QRegExp("[/sup]", Qt::CaseInsensitive, QRegExp::FixedString), true);
-        process(info, &convertMarkup, QRegExp("[spoiler]", Qt::CaseInsensitive, QRegExp::FixedString),
-                QRegExp("[/spoiler]", Qt::CaseInsensitive, QRegExp::FixedString), true);
-        process(info, &convertUrl, QRegExp("[url]", Qt::CaseInsensitive, QRegExp::FixedString),
-                QRegExp("[/url]", Qt::CaseInsensitive, QRegExp::FixedString), true);
-        process(info, &convertCSpoiler, QRegExp("[cspoiler]", Qt::CaseInsensitive, QRegExp::FixedString),
-                QRegExp("[/cspoiler]", Qt::CaseInsensitive, QRegExp::FixedString), true);
-        process(info, &convertCSpoiler, QRegExp("\\[cspoiler\\s+title\\=\"([^\"]*)\"\\s*\\]", Qt::CaseInsensitive),
-                QRegExp("[/cspoiler]", Qt::CaseInsensitive, QRegExp::FixedString), true);
-        process(info, &convertTooltip, QRegExp("\\[tooltip\\s+value\\=\"([^\"]*)\"\\s*\\]", Qt::CaseInsensitive),
-                QRegExp("[/tooltip]", Qt::CaseInsensitive, QRegExp::FixedString), true);
-        process(info, &convertUnorderedList, QRegExp("\\[ul\\s+type\\=\"?(disc|circle|square|d|c|s)\"?\\s*\\]",
-                                                     Qt::CaseInsensitive),
-                QRegExp("[/ul]", Qt::CaseInsensitive, QRegExp::FixedString), true);
-        process(info, &convertOrderedList, QRegExp("[ol]", Qt::CaseInsensitive, QRegExp::FixedString),
-                QRegExp("[/ol]", Qt::CaseInsensitive, QRegExp::FixedString), true);
-        process(info, &convertListItem, QRegExp("\\[li(\\s+value\\=\"?(\\d+)\"?\\s*)?\\]", Qt::CaseInsensitive),
-                QRegExp("[/li]", Qt::CaseInsensitive, QRegExp::FixedString), true);
-    }
-    if ((ExtendedWakabaMarkLanguage & languages) || (BBCodeLanguage & languages)) {
-        process(info, &convertCitation, QRegExp(">"), QRegExp("\n|$"), false, false, &checkNotInterrupted);
+    //Every match starts outside of the already processed parts, i.e. at a character of the source text, so a pass
+    //whose first character never occurs in the source text is a no-op and is skipped.
+    int markers = scanMarkers(text);
+    //NOTE: The passes are built once; every pass works on its own copies of the regexps, since QRegExp keeps the
+    //match state and may not be shared between threads
+    foreach (const Pass &p, passes()) {
+        if (!(languages & p.languages) || !(markers & p.markers))
+            continue;
+        switch (p.special) {
+        case StrikedOutShittyPass:
+            processStrikedOutShitty(info);
+            processStrikedOutShittyWord(info);
+            break;
+        case PostLinkPass: {
+            //NOTE: Boards may be reloaded, so the board names are not a part of the prebuilt regexps
+            QString boards = AbstractBoard::boardNames().join("|");
+            info.resolvePosts(postLinks(text, boardName, boards));
+            process(info, p.conversionFunction, QRegExp(p.rxOp), QRegExp());
+            process(info, p.conversionFunction, QRegExp(">>/(" + boards + ")/([1-9][0-9]*)"), QRegExp());
+            break;
+        }
+        default: {
+            QRegExp rxOp(p.rxOp);
+            QRegExp rxCl(p.rxCl);
+            process(info, p.conversionFunction, rxOp, rxCl, p.nestable, p.escapable, p.checkFunction);
+            break;
+        }
+        }
     }
     return info.toHtml();
 }
@@ -28,7 +28,6 @@ OlolordApplication::OlolordApplication(int &argc, char **argv, const QString &ap
     Q_INIT_RESOURCE(ololord_static_video);
 #endif
     captchaQuotaTimerId = startTimer(10 * BeQt::Minute);
-    outdatedTimerId = startTimer(BeQt::Hour);
     rssTimerId = startTimer(BeQt::Hour);
     searchTimerId = startTimer(10 * BeQt::Minute);
     uptimeTimer.start();
@@ -47,7 +46,6 @@ OlolordApplication::OlolordApplication(int &argc, char **argv, const InitialSett
     Q_INIT_RESOURCE(ololord_static_video);
 #endif
     captchaQuotaTimerId = startTimer(10 * BeQt::Minute);
-    outdatedTimerId = startTimer(BeQt::Hour);
     rssTimerId = startTimer(BeQt::Hour);
     searchTimerId = startTimer(10 * BeQt::Minute);
     uptimeTimer.start();
@@ -74,10 +72,8 @@ void OlolordApplication::timerEvent(QTimerEvent *e)
 {
     if (!e)
         return;
-    if (e->timerId() == outdatedTimerId)
-        Database::checkOutdatedEntries();
-    else if (e->timerId() == searchTimerId && Search::isModified())
-        BDirTools::writeFile(Tools::searchIndexFile(), Search::saveIndex());
+    if (e->timerId() == searchTimerId && Search::isModified())
+        Search::saveIndex();
     else if (e->timerId() == rssTimerId)
         Database::generateRss();
     else if (e->timerId() == captchaQuotaTimerId && AbstractBoard::isCaptchaQuotaModified())
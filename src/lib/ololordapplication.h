@@ -23,7 +23,6 @@ class OLOLORD_EXPORT OlolordApplication : public BCoreApplication
     Q_OBJECT
 private:
     int captchaQuotaTimerId;
-    int outdatedTimerId;
     int rssTimerId;
     int searchTimerId;
     QElapsedTimer uptimeTimer;
@@ -0,0 +1,111 @@
+#include "requestcontext.h"
+
+#include <BeQt>
+
+#include <QMutex>
+#include <QMutexLocker>
+#include <QString>
+#include <QThreadStorage>
+
+#include <cppcms/http_request.h>
+
+static QThreadStorage<RequestContext *> contexts;
+static RequestContext::Statistics stats;
+static QMutex statisticsMutex;
+
+RequestContext::Scope::Scope(const cppcms::http::request &req)
+{
+    if (!contexts.hasLocalData())
+        contexts.setLocalData(new RequestContext);
+    contexts.localData()->reset(&req);
+}
+
+RequestContext::Scope::~Scope()
+{
+    RequestContext *c = contexts.localData();
+    QMutexLocker locker(&statisticsMutex);
+    ++stats.requests;
+    foreach (int i, bRangeD(0, ValueCount - 1)) {
+        stats.computed[i] += c->computed[i];
+        stats.hits[i] += c->hits[i];
+        if (c->computed[i] > stats.maxComputed[i])
+            stats.maxComputed[i] = c->computed[i];
+    }
+    locker.unlock();
+    c->reset(0);
+}
+
+RequestContext *RequestContext::current(const cppcms::http::request &req)
+{
+    if (!contexts.hasLocalData())
+        return 0;
+    RequestContext *c = contexts.localData();
+    return (c->request == &req) ? c : 0;
+}
+
+QString RequestContext::valueName(Value v)
+{
+    switch (v) {
+    case UserIpValue:
+        return "user_ip";
+    case HashpassValue:
+        return "hashpass";
+    case LocaleValue:
+        return "locale";
+    case UserLevelValue:
+        return "user_level";
+    case UserBoardsValue:
+        return "user_boards";
+    case IpBanLevelValue:
+        return "ip_ban_level";
+    case BanInfoValue:
+        return "ban_info";
+    default:
+        return QString();
+    }
+}
+
+RequestContext::Statistics RequestContext::statistics()
+{
+    QMutexLocker locker(&statisticsMutex);
+    return stats;
+}
+
+RequestContext::RequestContext()
+{
+    reset(0);
+}
+
+bool RequestContext::lookup(Value v)
+{
+    if (!(known & (1 << v)))
+        return false;
+    ++hits[v];
+    return true;
+}
+
+void RequestContext::store(Value v)
+{
+    known |= (1 << v);
+    ++computed[v];
+}
+
+void RequestContext::reset(const cppcms::http::request *req)
+{
+    request = req;
+    known = 0;
+    foreach (int i, bRangeD(0, ValueCount - 1)) {
+        computed[i] = 0;
+        hits[i] = 0;
+    }
+    userIp.clear();
+    userIpProxy = false;
+    hashpass.clear();
+    locale = QLocale::c();
+    userLevel = -1;
+    userBoards.clear();
+    ipBanLevel = 0;
+    banInfo.clear();
+    banInfoOk = false;
+    banInfoError.clear();
+}
@@ -0,0 +1,86 @@
+#ifndef OLOLORD_REQUESTCONTEXT_H
+#define OLOLORD_REQUESTCONTEXT_H
+
+namespace cppcms
+{
+
+namespace http
+{
+
+class request;
+
+}
+
+}
+
+#include "database.h"
+#include "global.h"
+
+#include <QByteArray>
+#include <QLocale>
+#include <QMap>
+#include <QString>
+#include <QStringList>
+
+class OLOLORD_EXPORT RequestContext
+{
+public:
+    enum Value
+    {
+        UserIpValue = 0,
+        HashpassValue,
+        LocaleValue,
+        UserLevelValue,
+        UserBoardsValue,
+        IpBanLevelValue,
+        BanInfoValue,
+        ValueCount
+    };
+public:
+    class OLOLORD_EXPORT Scope
+    {
+    public:
+        explicit Scope(const cppcms::http::request &req);
+        ~Scope();
+    private:
+        Q_DISABLE_COPY(Scope)
+    };
+    struct OLOLORD_EXPORT Statistics
+    {
+        quint64 requests;
+        quint64 computed[ValueCount];
+        quint64 hits[ValueCount];
+        int maxComputed[ValueCount];
+    };
+public:
+    QString userIp;
+    bool userIpProxy;
+    QByteArray hashpass;
+    QLocale locale;
+    int userLevel;
+    QStringList userBoards;
+    int ipBanLevel;
+    QMap<QString, Database::BanInfo> banInfo;
+    bool banInfoOk;
+    QString banInfoError;
+private:
+    const cppcms::http::request *request;
+    unsigned int known;
+    int computed[ValueCount];
+    int hits[ValueCount];
+public:
+    static RequestContext *current(const cppcms::http::request &req);
+    static QString valueName(Value v);
+    static Statistics statistics();
+public:
+    explicit RequestContext();
+public:
+    bool lookup(Value v);
+    void store(Value v);
+private:
+    void reset(const cppcms::http::request *req);
+private:
+    Q_DISABLE_COPY(RequestContext)
+};
+
+#endif // OLOLORD_REQUESTCONTEXT_H
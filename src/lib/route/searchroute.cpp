@@ -5,6 +5,7 @@
 #include "database.h"
 #include "markup.h"
 #include "search.h"
+#include "settingslocker.h"
 #include "stored/thread.h"
 #include "stored/thread-odb.hxx"
 #include "tools.h"
@@ -16,8 +17,10 @@
 #include <QDebug>
 #include <QList>
 #include <QRegExp>
+#include <QSettings>
 #include <QString>
 #include <QStringList>
+#include <QUrl>
 
 #include <cppcms/application.h>
 #include <cppcms/http_request.h>
@@ -34,6 +37,7 @@ void SearchRoute::handle()
     Tools::GetParameters params = Tools::getParameters(application.request());
     QString query = params.value("query");
     QString boardName = params.value("board");
+    QString cursor = params.value("cursor");
     if (boardName.isEmpty())
         boardName = "*";
     QString logTarget = boardName + "/" + query;
@@ -74,9 +78,19 @@ void SearchRoute::handle()
             DDOS_POST_A
             return;
         }
+        QString queryBoard = boardName;
         if ("*" == boardName)
             boardName.clear();
-        QList<Post> list = Database::findPosts(q, boardName, &ok, &err, &desc, tq.locale());
+        int count = SettingsLocker()->value("Search/results_per_page", 20).toInt();
+        QString nextCursor;
+        QList<Post> list = Database::findPosts(q, boardName, count, cursor, &nextCursor, &ok, &err, &desc,
+                                               tq.locale());
+        if (!nextCursor.isEmpty()) {
+            QString url = "search?query=" + QString::fromLatin1(QUrl::toPercentEncoding(query)) + "&board="
+                    + QString::fromLatin1(QUrl::toPercentEncoding(queryBoard)) + "&cursor="
+                    + QString::fromLatin1(QUrl::toPercentEncoding(nextCursor));
+            c.nextPageUrl = Tools::toStd(url);
+        }
         foreach (Post post, list) {
             Content::Search::SearchResult r;
             r.boardName = Tools::toStd(post.board());
@@ -92,7 +106,11 @@ void SearchRoute::handle()
                 subj = subj.left(97) + "...";
             r.subject = Tools::toStd(subj);
             txt = BTextTools::toHtml(txt, false);
-            foreach (const QString &phrase, q.requiredPhrases + q.possiblePhrases) {
+            foreach (QString phrase, q.requiredPhrases + q.possiblePhrases) {
+                if (phrase.endsWith('*'))
+                    phrase.chop(1);
+                if (phrase.isEmpty())
+                    continue;
                 int ind = txt.indexOf(phrase, Qt::CaseInsensitive);
                 while (ind >= 0) {
                     QString nphrase = "<b><font color=\"red\">" + phrase + "</font></b>";
@@ -119,6 +137,7 @@ void SearchRoute::handle()
     c.errorDescription = Tools::toStd(desc);
     c.resultsMessage = ts.translate("SearchRoute", "Search results", "resultsMessage");
     c.nothingFoundMessage = ts.translate("SearchRoute", "Nothing found", "nothingFoundMessage");
+    c.toNextPageText = ts.translate("SearchRoute", "Next page", "toNextPageText");
     Tools::render(application, "search", c);
     Tools::log(application, "search", "success", logTarget);
     DDOS_POST_A
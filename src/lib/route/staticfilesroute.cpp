@@ -18,6 +18,7 @@
 #include <QPair>
 #include <QRegExp>
 #include <QSettings>
+#include <QSharedPointer>
 #include <QString>
 #include <QStringList>
 #include <QTextCodec>
@@ -42,8 +43,8 @@ void StaticFilesRoute::handle(std::string p)
     QString logAction = QString(StaticFilesMode == mode ? "static" : "dynamic") + "_file";
     QString logTarget = path;
     Tools::log(application, logAction, "begin", logTarget);
-    typedef Cache::File *(*GetCacheFunction)(const QString &path);
-    typedef Cache::File *(*SetCacheFunction)(const QString &path, const QByteArray &file);
+    typedef QSharedPointer<Cache::File> (*GetCacheFunction)(const QString &path);
+    typedef QSharedPointer<Cache::File> (*SetCacheFunction)(const QString &path, const QByteArray &file);
     QString err;
     if (!Controller::testRequestNonAjax(application, Controller::GetRequest, &err)) {
         Tools::log(application, logAction, "fail:" + err, logTarget);
@@ -58,7 +59,7 @@ void StaticFilesRoute::handle(std::string p)
     }
     GetCacheFunction getCache = (StaticFilesMode == mode) ? &Cache::staticFile : &Cache::dynamicFile;
     SetCacheFunction setCache = (StaticFilesMode == mode) ? &Cache::cacheStaticFile : &Cache::cacheDynamicFile;
-    Cache::File *file = getCache(path);
+    QSharedPointer<Cache::File> file = getCache(path);
     QString ct; // = path.endsWith(".css", Qt::CaseInsensitive) ? "text/css" : ""; //TODO: This causes page to freeze
     if (file) {
         write(file->data, ct, file->msecsSinceEpoch);
@@ -1,24 +1,43 @@
 #include "search.h"
 
 #include "database.h"
+#include "searchanalyzer.h"
+#include "tools.h"
 #include "translator.h"
 
+#include <BDirTools>
 #include <BeQt>
+#include <BTerminal>
 #include <BTextTools>
 
 #include <QByteArray>
 #include <QChar>
 #include <QDataStream>
 #include <QDebug>
+#include <QFile>
+#include <QFileInfo>
 #include <QHash>
 #include <QIODevice>
+#include <QList>
 #include <QLocale>
-#include <QMultiMap>
-#include <QReadLocker>
-#include <QReadWriteLock>
+#include <QMap>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QPair>
+#include <QRunnable>
+#include <QSet>
+#include <QSharedPointer>
 #include <QString>
 #include <QStringList>
-#include <QWriteLocker>
+#include <QtAlgorithms>
+#include <QtEndian>
+#include <QThread>
+#include <QThreadPool>
+#include <QVector>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 
 namespace Search
 {
@@ -28,217 +47,1745 @@ bool Query::isValid() const
     return !requiredPhrases.isEmpty() || !possiblePhrases.isEmpty();
 }
 
+typedef QSet<quint32> PositionSet;
+typedef QMap<quint64, PositionSet> PostMap;
+typedef QHash<QString, PostMap> BoardMap;
+typedef QPair<quint32, quint64> DocKey;
+typedef QSet<DocKey> DocKeySet;
+typedef QMap<DocKey, quint32> DocLengthMap;
+
+struct Postings
+{
+    quint32 board;
+    quint64 lastPost;
+    quint32 count;
+    QByteArray posts;
+    QByteArray positions;
+};
+
+struct Hit
+{
+    quint32 board;
+    quint64 post;
+    QVector<quint32> positions;
+};
+
+typedef QVector<Hit> HitList;
+typedef QVector<Postings> PostingsList;
 typedef QMap<QString, BoardMap> WordMap;
 
-static WordMap index;
-static QReadWriteLock indexLock(QReadWriteLock::Recursive);
+struct MemorySegment
+{
+    QHash<QString, quint32> termIds;
+    QStringList terms;
+    QVector<PostingsList> postings;
+    DocLengthMap lengths;
+    quint64 totalLength;
+public:
+    explicit MemorySegment();
+};
+
+struct Tokens
+{
+    QMap< QString, QVector<quint32> > positions;
+    quint32 length;
+};
+
+class PostingsReader
+{
+public:
+    quint64 post;
+    quint32 positionCount;
+private:
+    const uchar *p;
+    const uchar *end;
+    const uchar *pos;
+    int positionBytes;
+public:
+    explicit PostingsReader(const uchar *posts, int postsLength, const uchar *positions);
+public:
+    bool next();
+    QVector<quint32> positions() const;
+};
+
+class Segment
+{
+public:
+    enum
+    {
+        HeaderSize = 64,
+        LegacyHeaderSize = 40,
+        TermRecordSize = 16,
+        BlockRecordSize = 40,
+        DocumentRecordSize = 16
+    };
+public:
+    const QString FileName;
+private:
+    QFile file;
+    bool obsolete;
+    const uchar *data;
+    qint64 size;
+    quint32 mtermCount;
+    quint32 blockCount;
+    quint32 mdocumentCount;
+    quint64 mtotalLength;
+    const uchar *names;
+    const uchar *termTable;
+    const uchar *blockTable;
+    const uchar *documentTable;
+public:
+    explicit Segment(const QString &fileName);
+    ~Segment();
+public:
+    void decodeTerm(int index, int board, const DocKeySet &deletedKeys, HitList &hits) const;
+    DocKey document(int index, quint32 *length = 0) const;
+    int documentCount() const;
+    qint64 fileSize() const;
+    int indexOfTerm(const QByteArray &term) const;
+    bool isValid() const;
+    quint32 length(const DocKey &key) const;
+    int lowerBound(const QByteArray &term) const;
+    void setObsolete();
+    QByteArray term(int index) const;
+    int termCount() const;
+    quint64 totalLength() const;
+private:
+    Q_DISABLE_COPY(Segment)
+};
+
+class SegmentWriter
+{
+private:
+    QFile file;
+    QDataStream out;
+    QByteArray names;
+    QByteArray terms;
+    QByteArray blocks;
+    QByteArray documents;
+    quint32 termCount;
+    quint32 blockCount;
+    quint32 documentCount;
+    quint64 totalLength;
+public:
+    explicit SegmentWriter(const QString &fileName);
+public:
+    void addDocument(const DocKey &key, quint32 length);
+    void addTerm(const QByteArray &term, const PostingsList &list);
+    bool finish();
+private:
+    Q_DISABLE_COPY(SegmentWriter)
+};
+
+struct SegmentRef
+{
+    QSharedPointer<Segment> segment;
+    DocKeySet deleted;
+    quint32 deletedCount;
+    quint64 deletedLength;
+public:
+    explicit SegmentRef();
+};
+
+struct MemoryRef
+{
+    QSharedPointer<const MemorySegment> segment;
+    DocKeySet deleted;
+    quint32 deletedCount;
+    quint64 deletedLength;
+public:
+    explicit MemoryRef();
+};
+
+struct Snapshot
+{
+    QHash<QString, quint32> boardIds;
+    QStringList boardNames;
+    QList<MemoryRef> memory;
+    QList<MemoryRef> frozen;
+    QList<SegmentRef> segments;
+};
+
+typedef QSharedPointer<const Snapshot> SnapshotPointer;
+
+struct Update
+{
+    QString boardName;
+    quint64 postNumber;
+    QString text;
+    bool remove;
+};
+
+class MergeTask : public QRunnable
+{
+public:
+    void run();
+};
+
+class RebuildTask : public QRunnable
+{
+public:
+    void run();
+};
+
+class TokenizeTask : public QRunnable
+{
+public:
+    const DocumentList &Documents;
+    const int Begin;
+    const int End;
+private:
+    Tokens * const tokens;
+public:
+    explicit TokenizeTask(const DocumentList &documents, int begin, int end, Tokens *tokens);
+public:
+    void run();
+};
+
+class UpdateTask : public QRunnable
+{
+public:
+    void run();
+};
+
+static const quint32 IndexMagic = 0x4F4C5349; //"OLSI"
+static const quint32 IndexVersion = 1;
+static const quint32 ManifestMagic = 0x4F4C534D; //"OLSM"
+static const quint32 ManifestVersion = 2;
+static const quint32 SegmentMagic = 0x4F4C5347; //"OLSG"
+static const quint32 SegmentVersion = 2;
+static const int MaxSegmentCount = 16;
+static const int MemoryTierRatio = 2;
+static const int MergeFactor = 4;
+static const double Bm25K1 = 1.2;
+static const double Bm25B = 0.75;
+static const double RecencyWeight = 0.5;
+static const int TokenizeChunkSize = 10000;
+static const int MinPrefixLength = 2;
+static const int MaxPrefixTerms = 64;
+
+static SnapshotPointer current;
+static QMutex snapshotMutex;
+static QList<Update> pending;
+static bool updateScheduled = false;
+static QMutex pendingMutex;
+static QList<Update> rebuildLog;
+static bool rebuilding = false;
+static quint32 nextSegment = 0;
+static quint64 generation = 0;
+static bool merging = false;
 static bool modified = false;
+static bool outdated = false;
+static QMutex writeMutex(QMutex::Recursive);
+static QMutex saveMutex(QMutex::Recursive);
+static QMutex rebuildMutex;
 
-static BoardMap complement(const BoardMap &boards1, const BoardMap &boards2)
-{
-    BoardMap boards;
-    for (BoardMap::ConstIterator posts1 = boards1.begin(); posts1 != boards1.end(); ++posts1) {
-        BoardMap::ConstIterator posts2 = boards2.find(posts1.key());
-        if (posts2 != boards2.end()) {
-            PostMap posts;
-            for (PostMap::ConstIterator positions1 = posts1->begin(); positions1 != posts1->end(); ++positions1) {
-                PostMap::ConstIterator positions2 = posts2->find(positions1.key());
-                if (positions2 != posts2->end())
-                    continue;
-                posts.insert(positions1.key(), positions1.value());
-            }
-            if (posts.isEmpty())
-                continue;
-            boards.insert(posts1.key(), posts);
+static QThreadPool *mergePool()
+{
+    init_once(QThreadPool *, pool, new QThreadPool) {
+        pool->setMaxThreadCount(1);
+    }
+    return pool;
+}
+
+static QThreadPool *rebuildPool()
+{
+    init_once(QThreadPool *, pool, new QThreadPool) {
+        pool->setMaxThreadCount(1);
+    }
+    return pool;
+}
+
+static QThreadPool *updatePool()
+{
+    init_once(QThreadPool *, pool, new QThreadPool) {
+        pool->setMaxThreadCount(1);
+    }
+    return pool;
+}
+
+static void appendVarint(QByteArray &a, quint64 v)
+{
+    while (v >= 0x80) {
+        a.append(char((v & 0x7F) | 0x80));
+        v >>= 7;
+    }
+    a.append(char(v));
+}
+
+static quint64 readVarint(const uchar *&p, const uchar *end)
+{
+    quint64 v = 0;
+    int shift = 0;
+    while (p < end) {
+        uchar b = *p++;
+        v |= quint64(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            break;
+        shift += 7;
+    }
+    return v;
+}
+
+static void appendUInt32(QByteArray &a, quint32 v)
+{
+    uchar b[4];
+    qToLittleEndian(v, b);
+    a.append(reinterpret_cast<const char *>(b), 4);
+}
+
+static void appendUInt64(QByteArray &a, quint64 v)
+{
+    uchar b[8];
+    qToLittleEndian(v, b);
+    a.append(reinterpret_cast<const char *>(b), 8);
+}
+
+static quint32 readUInt32(const uchar *p)
+{
+    return qFromLittleEndian<quint32>(p);
+}
+
+static quint64 readUInt64(const uchar *p)
+{
+    return qFromLittleEndian<quint64>(p);
+}
+
+PostingsReader::PostingsReader(const uchar *posts, int postsLength, const uchar *positions)
+{
+    post = 0;
+    positionCount = 0;
+    p = posts;
+    end = p + postsLength;
+    pos = positions;
+    positionBytes = 0;
+}
+
+bool PostingsReader::next()
+{
+    if (p >= end)
+        return false;
+    pos += positionBytes;
+    post += readVarint(p, end);
+    positionCount = quint32(readVarint(p, end));
+    positionBytes = int(readVarint(p, end));
+    return true;
+}
+
+QVector<quint32> PostingsReader::positions() const
+{
+    QVector<quint32> list;
+    list.reserve(int(positionCount));
+    const uchar *q = pos;
+    const uchar *qend = pos + positionBytes;
+    quint32 position = 0;
+    while (q < qend) {
+        position += quint32(readVarint(q, qend));
+        list << position;
+    }
+    return list;
+}
+
+static void decode(quint32 board, const uchar *posts, int postsLength, const uchar *positions, HitList &hits,
+                   const DocKeySet *deleted = 0)
+{
+    PostingsReader r(posts, postsLength, positions);
+    while (r.next()) {
+        if (deleted && deleted->contains(DocKey(board, r.post)))
+            continue;
+        Hit h;
+        h.board = board;
+        h.post = r.post;
+        h.positions = r.positions();
+        hits << h;
+    }
+}
+
+static void decode(const Postings &p, HitList &hits, const DocKeySet *deleted = 0)
+{
+    decode(p.board, reinterpret_cast<const uchar *>(p.posts.constData()), p.posts.size(),
+           reinterpret_cast<const uchar *>(p.positions.constData()), hits, deleted);
+}
+
+Segment::Segment(const QString &fileName) :
+    FileName(fileName), file(fileName)
+{
+    obsolete = false;
+    data = 0;
+    size = 0;
+    mtermCount = 0;
+    blockCount = 0;
+    mdocumentCount = 0;
+    mtotalLength = 0;
+    names = 0;
+    termTable = 0;
+    blockTable = 0;
+    documentTable = 0;
+    if (!file.open(QFile::ReadOnly))
+        return;
+    qint64 sz = file.size();
+    if (sz < LegacyHeaderSize)
+        return;
+    const uchar *d = file.map(0, sz);
+    if (!d)
+        return;
+    quint32 version = readUInt32(d + 4);
+    quint32 tc = readUInt32(d + 8);
+    quint32 bc = readUInt32(d + 12);
+    quint64 namesOffset = readUInt64(d + 16);
+    quint64 termsOffset = readUInt64(d + 24);
+    quint64 blocksOffset = readUInt64(d + 32);
+    quint32 dc = 0;
+    quint64 documentsOffset = 0;
+    quint64 tl = 0;
+    if (SegmentVersion == version && sz >= HeaderSize) {
+        dc = readUInt32(d + 40);
+        documentsOffset = readUInt64(d + 48);
+        tl = readUInt64(d + 56);
+    }
+    if (readUInt32(d) != SegmentMagic || (1 != version && SegmentVersion != version) || namesOffset > quint64(sz)
+            || (SegmentVersion == version && sz < HeaderSize)
+            || termsOffset + quint64(tc) * TermRecordSize > quint64(sz)
+            || blocksOffset + quint64(bc) * BlockRecordSize > quint64(sz)
+            || documentsOffset + quint64(dc) * DocumentRecordSize > quint64(sz)) {
+        file.unmap(const_cast<uchar *>(d));
+        return;
+    }
+    data = d;
+    size = sz;
+    mtermCount = tc;
+    blockCount = bc;
+    mdocumentCount = dc;
+    mtotalLength = tl;
+    names = d + namesOffset;
+    termTable = d + termsOffset;
+    blockTable = d + blocksOffset;
+    documentTable = d + documentsOffset;
+}
+
+Segment::~Segment()
+{
+    if (data)
+        file.unmap(const_cast<uchar *>(data));
+    file.close();
+    if (obsolete)
+        QFile::remove(FileName);
+}
+
+void Segment::decodeTerm(int index, int board, const DocKeySet &deletedKeys, HitList &hits) const
+{
+    if (index < 0 || index >= termCount())
+        return;
+    const uchar *t = termTable + index * TermRecordSize;
+    quint32 firstBlock = readUInt32(t + 8);
+    quint32 count = readUInt32(t + 12);
+    if (quint64(firstBlock) + count > blockCount)
+        return;
+    const DocKeySet *del = !deletedKeys.isEmpty() ? &deletedKeys : 0;
+    foreach (int i, bRangeD(0, int(count) - 1)) {
+        const uchar *b = blockTable + (firstBlock + i) * BlockRecordSize;
+        quint32 bb = readUInt32(b);
+        if (board >= 0 && bb != quint32(board))
+            continue;
+        quint64 postsOffset = readUInt64(b + 16);
+        quint64 positionsOffset = readUInt64(b + 24);
+        quint32 postsLength = readUInt32(b + 32);
+        quint32 positionsLength = readUInt32(b + 36);
+        if (postsOffset + postsLength > quint64(size) || positionsOffset + positionsLength > quint64(size))
+            continue;
+        decode(bb, data + postsOffset, int(postsLength), data + positionsOffset, hits, del);
+    }
+}
+
+DocKey Segment::document(int index, quint32 *length) const
+{
+    if (index < 0 || index >= documentCount())
+        return bRet(length, quint32(0), DocKey());
+    const uchar *r = documentTable + index * DocumentRecordSize;
+    return bRet(length, readUInt32(r + 4), DocKey(readUInt32(r), readUInt64(r + 8)));
+}
+
+int Segment::documentCount() const
+{
+    return int(mdocumentCount);
+}
+
+qint64 Segment::fileSize() const
+{
+    return size;
+}
+
+int Segment::indexOfTerm(const QByteArray &term) const
+{
+    int lo = 0;
+    int hi = termCount();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        const uchar *t = termTable + mid * TermRecordSize;
+        quint32 length = readUInt32(t + 4);
+        int c = std::memcmp(names + readUInt32(t), term.constData(), qMin(int(length), term.size()));
+        if (!c)
+            c = int(length) - term.size();
+        if (!c)
+            return mid;
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
+bool Segment::isValid() const
+{
+    return data;
+}
+
+quint32 Segment::length(const DocKey &key) const
+{
+    int lo = 0;
+    int hi = documentCount();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        quint32 length = 0;
+        DocKey k = document(mid, &length);
+        if (k == key)
+            return length;
+        if (k < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return 0;
+}
+
+int Segment::lowerBound(const QByteArray &term) const
+{
+    int lo = 0;
+    int hi = termCount();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        const uchar *t = termTable + mid * TermRecordSize;
+        quint32 length = readUInt32(t + 4);
+        int c = std::memcmp(names + readUInt32(t), term.constData(), qMin(int(length), term.size()));
+        if (!c)
+            c = int(length) - term.size();
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void Segment::setObsolete()
+{
+    obsolete = true;
+}
+
+QByteArray Segment::term(int index) const
+{
+    if (index < 0 || index >= termCount())
+        return QByteArray();
+    const uchar *t = termTable + index * TermRecordSize;
+    return QByteArray(reinterpret_cast<const char *>(names + readUInt32(t)), int(readUInt32(t + 4)));
+}
+
+int Segment::termCount() const
+{
+    return int(mtermCount);
+}
+
+quint64 Segment::totalLength() const
+{
+    return mtotalLength;
+}
+
+SegmentWriter::SegmentWriter(const QString &fileName) :
+    file(fileName)
+{
+    termCount = 0;
+    blockCount = 0;
+    documentCount = 0;
+    totalLength = 0;
+    if (!file.open(QFile::WriteOnly | QFile::Truncate))
+        return;
+    out.setDevice(&file);
+    out.setByteOrder(QDataStream::LittleEndian);
+    QByteArray header(Segment::HeaderSize, '\0');
+    out.writeRawData(header.constData(), header.size());
+}
+
+void SegmentWriter::addDocument(const DocKey &key, quint32 length)
+{
+    appendUInt32(documents, key.first);
+    appendUInt32(documents, length);
+    appendUInt64(documents, key.second);
+    totalLength += length;
+    ++documentCount;
+}
+
+void SegmentWriter::addTerm(const QByteArray &term, const PostingsList &list)
+{
+    if (list.isEmpty())
+        return;
+    appendUInt32(terms, quint32(names.size()));
+    appendUInt32(terms, quint32(term.size()));
+    appendUInt32(terms, blockCount);
+    appendUInt32(terms, quint32(list.size()));
+    names += term;
+    foreach (const Postings &p, list) {
+        quint64 postsOffset = quint64(file.pos());
+        out.writeRawData(p.posts.constData(), p.posts.size());
+        quint64 positionsOffset = quint64(file.pos());
+        out.writeRawData(p.positions.constData(), p.positions.size());
+        appendUInt32(blocks, p.board);
+        appendUInt32(blocks, p.count);
+        appendUInt64(blocks, p.lastPost);
+        appendUInt64(blocks, postsOffset);
+        appendUInt64(blocks, positionsOffset);
+        appendUInt32(blocks, quint32(p.posts.size()));
+        appendUInt32(blocks, quint32(p.positions.size()));
+        ++blockCount;
+    }
+    ++termCount;
+}
+
+bool SegmentWriter::finish()
+{
+    if (!file.isOpen())
+        return false;
+    quint64 namesOffset = quint64(file.pos());
+    out.writeRawData(names.constData(), names.size());
+    quint64 termsOffset = quint64(file.pos());
+    out.writeRawData(terms.constData(), terms.size());
+    quint64 blocksOffset = quint64(file.pos());
+    out.writeRawData(blocks.constData(), blocks.size());
+    quint64 documentsOffset = quint64(file.pos());
+    out.writeRawData(documents.constData(), documents.size());
+    if (!file.seek(0))
+        return false;
+    out << SegmentMagic << SegmentVersion << termCount << blockCount << namesOffset << termsOffset << blocksOffset;
+    out << documentCount << quint32(0) << documentsOffset << totalLength;
+    bool ok = (QDataStream::Ok == out.status()) && file.flush();
+    file.close();
+    return ok;
+}
+
+MemorySegment::MemorySegment()
+{
+    totalLength = 0;
+}
+
+MemoryRef::MemoryRef()
+{
+    deletedCount = 0;
+    deletedLength = 0;
+}
+
+SegmentRef::SegmentRef()
+{
+    deletedCount = 0;
+    deletedLength = 0;
+}
+
+static void appendPost(Postings &p, quint64 post, const QVector<quint32> &positions)
+{
+    appendVarint(p.posts, p.count ? (post - p.lastPost) : post);
+    appendVarint(p.posts, quint64(positions.size()));
+    int sz = p.positions.size();
+    quint32 previous = 0;
+    foreach (quint32 position, positions) {
+        appendVarint(p.positions, position - previous);
+        previous = position;
+    }
+    appendVarint(p.posts, quint64(p.positions.size() - sz));
+    p.lastPost = post;
+    p.count += 1;
+}
+
+static int compare(const Hit &h1, const Hit &h2)
+{
+    if (h1.board != h2.board)
+        return (h1.board < h2.board) ? -1 : 1;
+    if (h1.post != h2.post)
+        return (h1.post < h2.post) ? -1 : 1;
+    return 0;
+}
+
+static PostingsList encode(const HitList &hits)
+{
+    PostingsList list;
+    foreach (const Hit &h, hits) {
+        if (list.isEmpty() || list.last().board != h.board) {
+            Postings p;
+            p.board = h.board;
+            p.lastPost = 0;
+            p.count = 0;
+            list << p;
+        }
+        appendPost(list.last(), h.post, h.positions);
+    }
+    return list;
+}
+
+static int indexOfBoard(const PostingsList &list, quint32 board, bool *found = 0)
+{
+    int lo = 0;
+    int hi = list.size();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (list.at(mid).board < board)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return bRet(found, lo < list.size() && list.at(lo).board == board, lo);
+}
+
+static QVector<quint32> unite(const QVector<quint32> &list1, const QVector<quint32> &list2)
+{
+    QVector<quint32> list;
+    list.reserve(list1.size() + list2.size());
+    int i = 0;
+    int j = 0;
+    while (i < list1.size() || j < list2.size()) {
+        if (j >= list2.size() || (i < list1.size() && list1.at(i) < list2.at(j))) {
+            list << list1.at(i++);
+        } else if (i >= list1.size() || list2.at(j) < list1.at(i)) {
+            list << list2.at(j++);
         } else {
-            boards.insert(posts1.key(), posts1.value());
+            list << list1.at(i++);
+            ++j;
         }
     }
-    return boards;
+    return list;
 }
 
-static BoardMap followedBy(const BoardMap &followed, const BoardMap &by)
+static void insertPost(PostingsList &list, quint32 board, quint64 post, const QVector<quint32> &positions)
 {
-    BoardMap boards;
-    for (BoardMap::ConstIterator posts1 = followed.begin(); posts1 != followed.end(); ++posts1) {
-        BoardMap::ConstIterator posts2 = by.find(posts1.key());
-        if (posts2 == by.end())
-            continue;
-        PostMap posts;
-        for (PostMap::ConstIterator positions1 = posts1->begin(); positions1 != posts1->end(); ++positions1) {
-            PostMap::ConstIterator positions2 = posts2->find(positions1.key());
-            if (positions2 == posts2->end())
+    bool found = false;
+    int ind = indexOfBoard(list, board, &found);
+    if (!found) {
+        Postings p;
+        p.board = board;
+        p.lastPost = 0;
+        p.count = 0;
+        list.insert(ind, p);
+    }
+    Postings &p = list[ind];
+    if (!p.count || post > p.lastPost)
+        return appendPost(p, post, positions);
+    HitList hits;
+    decode(p, hits);
+    p.lastPost = 0;
+    p.count = 0;
+    p.posts.clear();
+    p.positions.clear();
+    bool inserted = false;
+    foreach (const Hit &h, hits) {
+        if (!inserted && post <= h.post) {
+            inserted = true;
+            if (post == h.post) {
+                appendPost(p, post, unite(h.positions, positions));
                 continue;
-            PositionSet set;
-            for (PositionSet::ConstIterator pos1 = positions1->begin(); pos1 != positions1->end(); ++pos1) {
-                const quint32 &pos = *pos1;
-                if (!positions2->contains(pos + 1))
-                    continue;
-                set.insert(pos + 1);
             }
-            if (set.isEmpty())
-                continue;
-            posts.insert(positions1.key(), set);
+            appendPost(p, post, positions);
         }
-        if (posts.isEmpty())
+        appendPost(p, h.post, h.positions);
+    }
+    if (!inserted)
+        appendPost(p, post, positions);
+}
+
+static void removePost(PostingsList &list, quint32 board, quint64 post)
+{
+    bool found = false;
+    int ind = indexOfBoard(list, board, &found);
+    if (!found)
+        return;
+    Postings &p = list[ind];
+    HitList hits;
+    decode(p, hits);
+    p.lastPost = 0;
+    p.count = 0;
+    p.posts.clear();
+    p.positions.clear();
+    foreach (const Hit &h, hits) {
+        if (h.post != post)
+            appendPost(p, h.post, h.positions);
+    }
+    if (!p.count)
+        list.remove(ind);
+}
+
+static void markDeleted(MemoryRef &r, const DocKey &key)
+{
+    DocLengthMap::ConstIterator i = r.segment->lengths.find(key);
+    if (r.segment->lengths.end() == i || r.deleted.contains(key))
+        return;
+    r.deleted.insert(key);
+    ++r.deletedCount;
+    r.deletedLength += i.value();
+}
+
+static void markDeleted(SegmentRef &r, const DocKey &key)
+{
+    if (r.deleted.contains(key))
+        return;
+    r.deleted.insert(key);
+    quint32 length = r.segment->length(key);
+    if (!length)
+        return;
+    ++r.deletedCount;
+    r.deletedLength += length;
+}
+
+static void setDeleted(SegmentRef &r, const DocKeySet &deleted)
+{
+    r.deleted.clear();
+    r.deletedCount = 0;
+    r.deletedLength = 0;
+    foreach (const DocKey &key, deleted)
+        markDeleted(r, key);
+}
+
+static quint32 internBoard(Snapshot &s, const QString &boardName)
+{
+    QHash<QString, quint32>::ConstIterator i = s.boardIds.constFind(boardName);
+    if (s.boardIds.constEnd() != i)
+        return i.value();
+    quint32 id = quint32(s.boardNames.size());
+    s.boardIds.insert(boardName, id);
+    s.boardNames << boardName;
+    return id;
+}
+
+static quint32 internTerm(MemorySegment &m, const QString &term)
+{
+    QHash<QString, quint32>::ConstIterator i = m.termIds.constFind(term);
+    if (m.termIds.constEnd() != i)
+        return i.value();
+    quint32 id = quint32(m.terms.size());
+    m.termIds.insert(term, id);
+    m.terms << term;
+    m.postings << PostingsList();
+    return id;
+}
+
+static HitList complement(const HitList &hits1, const HitList &hits2)
+{
+    HitList hits;
+    int j = 0;
+    foreach (const Hit &h, hits1) {
+        while (j < hits2.size() && compare(hits2.at(j), h) < 0)
+            ++j;
+        if (j < hits2.size() && !compare(hits2.at(j), h))
             continue;
-        boards.insert(posts1.key(), posts);
+        hits << h;
     }
-    return boards;
+    return hits;
 }
 
-static BoardMap intersection(const BoardMap &boards1, const BoardMap &boards2)
+static HitList followedBy(const HitList &followed, const HitList &by, quint32 distance)
 {
-    BoardMap boards;
-    for (BoardMap::ConstIterator posts1 = boards1.begin(); posts1 != boards1.end(); ++posts1) {
-        BoardMap::ConstIterator posts2 = boards2.find(posts1.key());
-        if (posts2 == boards2.end())
+    HitList hits;
+    int i = 0;
+    int j = 0;
+    while (i < followed.size() && j < by.size()) {
+        int c = compare(followed.at(i), by.at(j));
+        if (c < 0) {
+            ++i;
             continue;
-        PostMap posts;
-        for (PostMap::ConstIterator positions1 = posts1->begin(); positions1 != posts1->end(); ++positions1) {
-            PostMap::ConstIterator positions2 = posts2->find(positions1.key());
-            if (positions2 == posts2->end())
-                continue;
-            posts.insert(positions1.key(), positions1.value());
-        }
-        if (posts.isEmpty())
+        } else if (c > 0) {
+            ++j;
             continue;
-        boards.insert(posts1.key(), posts);
+        }
+        const QVector<quint32> &positions1 = followed.at(i).positions;
+        const QVector<quint32> &positions2 = by.at(j).positions;
+        Hit h;
+        h.board = by.at(j).board;
+        h.post = by.at(j).post;
+        int k = 0;
+        foreach (quint32 pos, positions1) {
+            while (k < positions2.size() && positions2.at(k) < pos + distance)
+                ++k;
+            if (k < positions2.size() && positions2.at(k) == pos + distance)
+                h.positions << pos + distance;
+        }
+        if (!h.positions.isEmpty())
+            hits << h;
+        ++i;
+        ++j;
     }
-    return boards;
+    return hits;
 }
 
-static BoardMap sum(const BoardMap &boards1, const BoardMap &boards2)
+static HitList intersection(const HitList &hits1, const HitList &hits2)
 {
-    BoardMap boards = boards1;
-    for (BoardMap::ConstIterator posts2 = boards2.begin(); posts2 != boards2.end(); ++posts2) {
-        BoardMap::Iterator posts = boards.find(posts2.key());
-        if (posts != boards.end()) {
-            for (PostMap::ConstIterator positions2 = posts2->begin(); positions2 != posts2->end(); ++positions2) {
-                PostMap::Iterator positions = posts->find(positions2.key());
-                if (positions != posts->end()) {
-                    for (PositionSet::ConstIterator pos2 = positions2->begin(); pos2 != positions2->end(); ++pos2)
-                        positions->insert(*pos2);
-                } else {
-                    posts->insert(positions2.key(), positions2.value());
-                }
-            }
+    HitList hits;
+    int i = 0;
+    int j = 0;
+    while (i < hits1.size() && j < hits2.size()) {
+        int c = compare(hits1.at(i), hits2.at(j));
+        if (c < 0) {
+            ++i;
+        } else if (c > 0) {
+            ++j;
         } else {
-            boards.insert(posts2.key(), posts2.value());
+            hits << hits1.at(i);
+            ++i;
+            ++j;
         }
     }
-    return boards;
+    return hits;
 }
 
-static QStringList words(const QString &text)
+static HitList sum(const HitList &hits1, const HitList &hits2)
 {
-    QStringList list;
-    QString word;
-    foreach (const QChar &c, text) {
-        if (c.isLetterOrNumber()) {
-            word += c;
-        } else if (!word.isEmpty()) {
-            list << word.toLower();
-            word.clear();
+    if (hits1.isEmpty())
+        return hits2;
+    if (hits2.isEmpty())
+        return hits1;
+    HitList hits;
+    hits.reserve(hits1.size() + hits2.size());
+    int i = 0;
+    int j = 0;
+    while (i < hits1.size() || j < hits2.size()) {
+        int c = (i >= hits1.size()) ? 1 : ((j >= hits2.size()) ? -1 : compare(hits1.at(i), hits2.at(j)));
+        if (c < 0) {
+            hits << hits1.at(i++);
+        } else if (c > 0) {
+            hits << hits2.at(j++);
+        } else {
+            Hit h = hits1.at(i++);
+            h.positions = unite(h.positions, hits2.at(j++).positions);
+            hits << h;
         }
     }
-    if (!word.isEmpty())
-        list << word.toLower();
-    return list;
+    return hits;
 }
 
-static PostMap findHelper(BoardMap::ConstIterator boards)
+static Tokens tokenize(const QString &text)
 {
-    PostMap p;
-    for (PostMap::ConstIterator posts = boards->begin(); posts != boards->end(); ++posts)
-        p.insert(posts.key(), posts.value());
-    return p;
+    Tokens t;
+    TokenList list = Analyzer::defaultAnalyzer().analyze(text);
+    foreach (const Token &token, list)
+        t.positions[token.term] << token.position;
+    t.length = quint32(list.size());
+    return t;
 }
 
-static BoardMap findWord(const QString &w, const QString &boardName = QString())
+static bool documentLessThan(const Document &d1, const Document &d2)
 {
+    if (d1.boardName != d2.boardName)
+        return d1.boardName < d2.boardName;
+    return d1.postNumber < d2.postNumber;
+}
+
+static Snapshot *createSnapshot()
+{
+    return new Snapshot;
+}
+
+static SnapshotPointer snapshot()
+{
+    QMutexLocker locker(&snapshotMutex);
+    if (!current)
+        current = SnapshotPointer(createSnapshot());
+    return current;
+}
+
+static void publish(Snapshot *s)
+{
+    SnapshotPointer p(s);
+    SnapshotPointer previous;
+    QMutexLocker locker(&snapshotMutex);
+    previous = current;
+    current = p;
+}
+
+static QList<MemoryRef> memorySegments(const Snapshot &s)
+{
+    return s.frozen + s.memory;
+}
+
+static void setLength(MemorySegment &m, const DocKey &key, quint32 length)
+{
+    m.totalLength -= m.lengths.value(key);
+    m.lengths.insert(key, length);
+    m.totalLength += length;
+}
+
+static void addDocument(Snapshot &s, MemorySegment &m, const QString &boardName, quint64 postNumber,
+                        const Tokens &t)
+{
+    if (t.positions.isEmpty())
+        return;
+    quint32 board = internBoard(s, boardName);
+    for (QMap< QString, QVector<quint32> >::ConstIterator i = t.positions.begin(); i != t.positions.end(); ++i)
+        insertPost(m.postings[int(internTerm(m, i.key()))], board, postNumber, i.value());
+    setLength(m, DocKey(board, postNumber), t.length);
+}
+
+static void removeDocument(Snapshot &s, MemorySegment &m, const QString &boardName, quint64 postNumber,
+                           const QString &text)
+{
+    QHash<QString, quint32>::ConstIterator board = s.boardIds.constFind(boardName);
+    if (s.boardIds.constEnd() == board)
+        return;
+    QSet<QString> terms;
+    foreach (const Token &token, Analyzer::defaultAnalyzer().analyze(text))
+        terms.insert(token.term);
+    foreach (const QString &word, terms) {
+        QHash<QString, quint32>::ConstIterator i = m.termIds.constFind(word);
+        if (m.termIds.constEnd() == i)
+            continue;
+        removePost(m.postings[int(i.value())], board.value(), postNumber);
+    }
+    DocKey key(board.value(), postNumber);
+    m.totalLength -= m.lengths.take(key);
+    foreach (int i, bRangeD(0, s.frozen.size() - 1))
+        markDeleted(s.frozen[i], key);
+    foreach (int i, bRangeD(0, s.memory.size() - 1))
+        markDeleted(s.memory[i], key);
+    foreach (int i, bRangeD(0, s.segments.size() - 1))
+        markDeleted(s.segments[i], key);
+}
+
+static void apply(Snapshot &s, MemorySegment &m, const Update &u)
+{
+    if (u.remove)
+        removeDocument(s, m, u.boardName, u.postNumber, u.text);
+    else
+        addDocument(s, m, u.boardName, u.postNumber, tokenize(u.text));
+}
+
+static void mergeInto(MemorySegment &target, const MemorySegment &source, const DocKeySet &deleted)
+{
+    const DocKeySet *del = !deleted.isEmpty() ? &deleted : 0;
+    foreach (int i, bRangeD(0, source.terms.size() - 1)) {
+        HitList hits;
+        foreach (const Postings &p, source.postings.at(i))
+            decode(p, hits, del);
+        if (hits.isEmpty())
+            continue;
+        PostingsList &list = target.postings[int(internTerm(target, source.terms.at(i)))];
+        foreach (const Hit &h, hits)
+            insertPost(list, h.board, h.post, h.positions);
+    }
+    for (DocLengthMap::ConstIterator i = source.lengths.begin(); i != source.lengths.end(); ++i) {
+        if (!deleted.contains(i.key()))
+            setLength(target, i.key(), i.value());
+    }
+}
+
+static int memorySize(const MemoryRef &r)
+{
+    return r.segment->lengths.size() - int(r.deletedCount);
+}
+
+static void appendMemorySegment(Snapshot &s, const QSharedPointer<const MemorySegment> &m)
+{
+    MemoryRef r;
+    r.segment = m;
+    //NOTE: A tier is folded into the previous one once it reaches a comparable size, so each document is copied
+    //O(log n) times instead of on every update batch
+    while (!s.memory.isEmpty() && memorySize(r) * MemoryTierRatio >= memorySize(s.memory.last())) {
+        MemoryRef previous = s.memory.takeLast();
+        QSharedPointer<MemorySegment> merged(new MemorySegment);
+        mergeInto(*merged, *previous.segment, previous.deleted);
+        mergeInto(*merged, *r.segment, r.deleted);
+        r = MemoryRef();
+        r.segment = merged;
+    }
+    s.memory << r;
+}
+
+static void applyPending()
+{
+    QMutexLocker locker(&writeMutex);
+    QList<Update> list;
+    {
+        QMutexLocker pendingLocker(&pendingMutex);
+        list = pending;
+        pending.clear();
+        updateScheduled = false;
+    }
+    if (list.isEmpty())
+        return;
+    Snapshot *s = new Snapshot(*snapshot());
+    QSharedPointer<MemorySegment> m(new MemorySegment);
+    foreach (const Update &u, list)
+        apply(*s, *m, u);
+    if (!m->terms.isEmpty())
+        appendMemorySegment(*s, m);
+    if (rebuilding)
+        rebuildLog << list;
+    modified = true;
+    publish(s);
+}
+
+static void enqueue(const Update &u)
+{
+    QMutexLocker locker(&pendingMutex);
+    pending << u;
+    if (updateScheduled)
+        return;
+    updateScheduled = true;
+    updatePool()->start(new UpdateTask);
+}
+
+static void findWord(const MemoryRef &r, const QString &w, int board, HitList &hits)
+{
+    const MemorySegment &m = *r.segment;
+    QHash<QString, quint32>::ConstIterator i = m.termIds.find(w);
+    if (m.termIds.end() == i)
+        return;
+    const DocKeySet *deleted = !r.deleted.isEmpty() ? &r.deleted : 0;
+    const PostingsList &list = m.postings.at(int(i.value()));
+    if (board >= 0) {
+        bool found = false;
+        int ind = indexOfBoard(list, quint32(board), &found);
+        if (found)
+            decode(list.at(ind), hits, deleted);
+        return;
+    }
+    foreach (const Postings &p, list)
+        decode(p, hits, deleted);
+}
+
+static HitList findWord(const Snapshot &s, const QString &w, int board = -1)
+{
+    HitList hits;
     if (w.isEmpty())
-        return BoardMap();
-    WordMap::ConstIterator words = index.find(w);
-    if (index.end() == words)
-        return BoardMap();
-    BoardMap m;
-    if (!boardName.isEmpty()) {
-        BoardMap::ConstIterator boards = words->find(boardName);
-        if (boards == words->end())
-            return BoardMap();
-        m.insert(boardName, findHelper(boards));
-    } else {
-        for (BoardMap::ConstIterator boards = words->begin(); boards != words->end(); ++boards)
-            m.insert(boards.key(), findHelper(boards));
+        return hits;
+    foreach (const MemoryRef &r, memorySegments(s)) {
+        HitList h;
+        findWord(r, w, board, h);
+        hits = sum(hits, h);
     }
-    return m;
+    QByteArray term = w.toUtf8();
+    foreach (const SegmentRef &r, s.segments) {
+        HitList h;
+        r.segment->decodeTerm(r.segment->indexOfTerm(term), board, r.deleted, h);
+        hits = sum(hits, h);
+    }
+    return hits;
+}
+
+static void expandPrefix(const MemorySegment &m, const QString &prefix, QSet<QString> &terms)
+{
+    foreach (const QString &term, m.terms) {
+        if (terms.size() >= MaxPrefixTerms)
+            return;
+        if (term.startsWith(prefix))
+            terms.insert(term);
+    }
+}
+
+static QStringList expandPrefix(const Snapshot &s, const QString &prefix)
+{
+    QSet<QString> terms;
+    foreach (const MemoryRef &r, memorySegments(s))
+        expandPrefix(*r.segment, prefix, terms);
+    QByteArray p = prefix.toUtf8();
+    foreach (const SegmentRef &r, s.segments) {
+        for (int i = r.segment->lowerBound(p); i < r.segment->termCount(); ++i) {
+            QByteArray term = r.segment->term(i);
+            if (terms.size() >= MaxPrefixTerms || !term.startsWith(p))
+                break;
+            terms.insert(QString::fromUtf8(term));
+        }
+    }
+    QStringList list = terms.toList();
+    qSort(list);
+    return list;
 }
 
-static BoardMap findPhrase(const QString &phrase, const QString &boardName = QString())
+static HitList findPrefix(const Snapshot &s, const QString &prefix, int board)
 {
-    QStringList list = words(phrase);
+    HitList hits;
+    foreach (const QString &term, expandPrefix(s, prefix))
+        hits = sum(hits, findWord(s, term, board));
+    return hits;
+}
+
+static HitList findPhrase(const Snapshot &s, const QString &phrase, int board = -1)
+{
+    const Analyzer &a = Analyzer::defaultAnalyzer();
+    TokenList raw = a.tokenize(phrase);
+    TokenList list = a.filter(raw);
+    bool prefix = false;
+    if (phrase.endsWith('*') && !raw.isEmpty()) {
+        Token last = raw.last();
+        if (!list.isEmpty() && list.last().position == last.position) {
+            const QString &stem = list.last().term;
+            int n = 0;
+            while (n < stem.size() && n < last.term.size() && stem.at(n) == last.term.at(n))
+                ++n;
+            last.term.truncate(n);
+            list.removeLast();
+        }
+        prefix = last.term.size() >= MinPrefixLength;
+        if (prefix)
+            list << last;
+        else
+            list = a.filter(raw);
+    }
     if (list.isEmpty())
-        return BoardMap();
-    if (list.size() == 1)
-        return findWord(list.first(), boardName);
-    BoardMap m = findWord(list.first(), boardName);
-    foreach (int i, bRangeD(1, list.size() - 1)) {
-        if (m.isEmpty())
+        return HitList();
+    int lastIndex = list.size() - 1;
+    HitList hits = (prefix && !lastIndex) ? findPrefix(s, list.first().term, board)
+                                          : findWord(s, list.first().term, board);
+    foreach (int i, bRangeD(1, lastIndex)) {
+        if (hits.isEmpty())
             break;
-        m = followedBy(m, findWord(list.at(i), boardName));
+        const Token &t = list.at(i);
+        HitList h = (prefix && i == lastIndex) ? findPrefix(s, t.term, board) : findWord(s, t.term, board);
+        hits = followedBy(hits, h, t.position - list.at(i - 1).position);
+    }
+    return hits;
+}
+
+static quint32 documentLength(const Snapshot &s, const DocKey &key)
+{
+    QList<MemoryRef> memory = memorySegments(s);
+    foreach (int j, bRangeR(memory.size() - 1, 0)) {
+        const MemoryRef &r = memory.at(j);
+        if (r.deleted.contains(key))
+            continue;
+        DocLengthMap::ConstIterator i = r.segment->lengths.find(key);
+        if (r.segment->lengths.end() != i)
+            return i.value();
+    }
+    foreach (int j, bRangeR(s.segments.size() - 1, 0)) {
+        const SegmentRef &r = s.segments.at(j);
+        if (r.deleted.contains(key))
+            continue;
+        quint32 length = r.segment->length(key);
+        if (length)
+            return length;
+    }
+    return 0;
+}
+
+static void documentStatistics(const Snapshot &s, quint64 *count, quint64 *totalLength)
+{
+    quint64 c = 0;
+    quint64 tl = 0;
+    foreach (const MemoryRef &r, memorySegments(s)) {
+        c += quint64(memorySize(r));
+        tl += r.segment->totalLength - qMin(r.deletedLength, r.segment->totalLength);
+    }
+    foreach (const SegmentRef &r, s.segments) {
+        c += quint64(qMax(r.segment->documentCount() - int(r.deletedCount), 0));
+        tl += r.segment->totalLength() - qMin(r.deletedLength, r.segment->totalLength());
     }
-    return m;
+    *count = c;
+    *totalLength = tl;
+}
+
+static bool resultLessThan(const Result &r1, const Result &r2)
+{
+    if (r1.score != r2.score)
+        return r1.score > r2.score;
+    if (r1.boardName != r2.boardName)
+        return r1.boardName < r2.boardName;
+    return r1.postNumber > r2.postNumber;
+}
+
+static QString toCursor(const Result &r)
+{
+    quint64 bits = 0;
+    std::memcpy(&bits, &r.score, sizeof(bits));
+    return QString::number(bits, 16) + ":" + QString::number(r.postNumber) + ":" + r.boardName;
+}
+
+static bool fromCursor(const QString &cursor, Result &r)
+{
+    bool ok = false;
+    quint64 bits = cursor.section(':', 0, 0).toULongLong(&ok, 16);
+    if (!ok)
+        return false;
+    r.postNumber = cursor.section(':', 1, 1).toULongLong(&ok);
+    if (!ok)
+        return false;
+    r.boardName = cursor.section(':', 2);
+    std::memcpy(&r.score, &bits, sizeof(bits));
+    return !r.boardName.isEmpty();
+}
+
+static bool restoreManifest(const QByteArray &data, const QString &currentSignature, Snapshot &s)
+{
+    QDataStream ds(data);
+    ds.setVersion(BeQt::DataStreamVersion);
+    quint32 magic = 0;
+    quint32 version = 0;
+    ds >> magic >> version;
+    if (ManifestMagic != magic || !version || version > ManifestVersion)
+        return false;
+    QStringList names;
+    quint32 next = 0;
+    QStringList fileNames;
+    QList<DocKeySet> deleted;
+    QString signature;
+    ds >> names >> next >> fileNames >> deleted;
+    if (version > 1)
+        ds >> signature;
+    if (QDataStream::Ok != ds.status() || fileNames.size() != deleted.size())
+        return false;
+    QList<SegmentRef> list;
+    foreach (int i, bRangeD(0, fileNames.size() - 1)) {
+        SegmentRef r;
+        r.segment = QSharedPointer<Segment>(new Segment(Tools::searchIndexPath() + "/" + fileNames.at(i)));
+        if (!r.segment->isValid())
+            return false;
+        setDeleted(r, deleted.at(i));
+        list << r;
+    }
+    s.boardNames = names;
+    foreach (int i, bRangeD(0, s.boardNames.size() - 1))
+        s.boardIds.insert(s.boardNames.at(i), quint32(i));
+    s.segments = list;
+    nextSegment = next;
+    outdated = !list.isEmpty() && currentSignature != signature;
+    return true;
+}
+
+static void restoreLegacyIndex(const QByteArray &data, Snapshot &s, MemorySegment &m)
+{
+    QDataStream ds(data);
+    ds.setVersion(BeQt::DataStreamVersion);
+    quint32 magic = 0;
+    quint32 version = 0;
+    ds >> magic;
+    if (IndexMagic != magic) {
+        ds.device()->seek(0);
+        WordMap index;
+        ds >> index;
+        for (WordMap::ConstIterator boards = index.begin(); boards != index.end(); ++boards) {
+            PostingsList &list = m.postings[int(internTerm(m, boards.key()))];
+            for (BoardMap::ConstIterator posts = boards->begin(); posts != boards->end(); ++posts) {
+                quint32 board = internBoard(s, posts.key());
+                for (PostMap::ConstIterator positions = posts->begin(); positions != posts->end(); ++positions) {
+                    QVector<quint32> v;
+                    foreach (quint32 pos, positions.value())
+                        v << pos;
+                    qSort(v);
+                    insertPost(list, board, positions.key(), v);
+                    DocKey key(board, positions.key());
+                    setLength(m, key, m.lengths.value(key) + quint32(v.size()));
+                }
+            }
+        }
+        return;
+    }
+    ds >> version;
+    if (IndexVersion != version)
+        return;
+    QStringList names;
+    QStringList terms;
+    ds >> names >> terms;
+    QVector<quint32> ids;
+    foreach (const QString &name, names)
+        ids << internBoard(s, name);
+    foreach (const QString &term, terms) {
+        quint32 count = 0;
+        ds >> count;
+        PostingsList &list = m.postings[int(internTerm(m, term))];
+        for (quint32 i = 0; i < count; ++i) {
+            Postings p;
+            ds >> p.board >> p.lastPost >> p.count >> p.posts >> p.positions;
+            if (QDataStream::Ok != ds.status() || int(p.board) >= ids.size())
+                return;
+            HitList hits;
+            decode(p, hits);
+            foreach (const Hit &h, hits) {
+                insertPost(list, ids.at(int(p.board)), h.post, h.positions);
+                DocKey key(ids.at(int(p.board)), h.post);
+                setLength(m, key, m.lengths.value(key) + quint32(h.positions.size()));
+            }
+        }
+    }
+}
+
+static QByteArray saveManifest(const Snapshot &s)
+{
+    QByteArray data;
+    QDataStream out(&data, QIODevice::WriteOnly);
+    out.setVersion(BeQt::DataStreamVersion);
+    QStringList fileNames;
+    QList<DocKeySet> deleted;
+    foreach (const SegmentRef &r, s.segments) {
+        fileNames << QFileInfo(r.segment->FileName).fileName();
+        deleted << r.deleted;
+    }
+    QString signature = !outdated ? Analyzer::defaultAnalyzer().signature() : QString();
+    out << ManifestMagic << ManifestVersion << s.boardNames << nextSegment << fileNames << deleted << signature;
+    return data;
+}
+
+static bool writeManifest(const QByteArray &data)
+{
+    QString fn = Tools::searchIndexPath() + "/manifest.dat";
+    if (!BDirTools::writeFile(fn + ".tmp", data))
+        return false;
+    QFile::remove(fn);
+    return QFile::rename(fn + ".tmp", fn);
+}
+
+static bool writeSegment(const QString &fileName, const MemorySegment &m)
+{
+    QMap<QByteArray, int> terms;
+    foreach (int i, bRangeD(0, m.terms.size() - 1))
+        terms.insert(m.terms.at(i).toUtf8(), i);
+    SegmentWriter w(fileName);
+    for (QMap<QByteArray, int>::ConstIterator i = terms.begin(); i != terms.end(); ++i)
+        w.addTerm(i.key(), m.postings.at(i.value()));
+    for (DocLengthMap::ConstIterator i = m.lengths.begin(); i != m.lengths.end(); ++i)
+        w.addDocument(i.key(), i.value());
+    return w.finish();
+}
+
+static bool writeSegment(const QString &fileName, const QList<MemoryRef> &list)
+{
+    if (list.size() == 1 && list.first().deleted.isEmpty())
+        return writeSegment(fileName, *list.first().segment);
+    MemorySegment m;
+    foreach (const MemoryRef &r, list)
+        mergeInto(m, *r.segment, r.deleted);
+    return writeSegment(fileName, m);
+}
+
+static int segmentTier(const SegmentRef &r)
+{
+    qint64 size = qMax(r.segment->fileSize(), qint64(1));
+    return int(std::log(double(size)) / std::log(double(MergeFactor)));
+}
+
+static bool selectMerge(const QList<SegmentRef> &segments, int *first, int *count)
+{
+    int n = segments.size();
+    if (n < MergeFactor)
+        return false;
+    foreach (int i, bRangeR(n - MergeFactor, 0)) {
+        int tier = segmentTier(segments.at(i));
+        bool same = true;
+        foreach (int j, bRangeD(i + 1, i + MergeFactor - 1)) {
+            if (segmentTier(segments.at(j)) != tier) {
+                same = false;
+                break;
+            }
+        }
+        if (!same)
+            continue;
+        *first = i;
+        *count = MergeFactor;
+        return true;
+    }
+    if (n < MaxSegmentCount)
+        return false;
+    qint64 smallest = -1;
+    foreach (int i, bRangeD(0, n - MergeFactor)) {
+        qint64 size = 0;
+        foreach (int j, bRangeD(i, i + MergeFactor - 1))
+            size += segments.at(j).segment->fileSize();
+        if (smallest >= 0 && size >= smallest)
+            continue;
+        smallest = size;
+        *first = i;
+    }
+    *count = MergeFactor;
+    return true;
+}
+
+static void scheduleMerge()
+{
+    QMutexLocker locker(&writeMutex);
+    int first = 0;
+    int count = 0;
+    if (merging || !selectMerge(snapshot()->segments, &first, &count))
+        return;
+    merging = true;
+    mergePool()->start(new MergeTask);
+}
+
+void MergeTask::run()
+{
+    QList<SegmentRef> sources;
+    QString fileName;
+    quint64 gen = 0;
+    int first = 0;
+    {
+        QMutexLocker locker(&writeMutex);
+        QList<SegmentRef> segments = snapshot()->segments;
+        int count = 0;
+        if (!selectMerge(segments, &first, &count)) {
+            merging = false;
+            return;
+        }
+        sources = segments.mid(first, count);
+        fileName = Tools::searchIndexPath() + "/segment-" + QString::number(nextSegment++) + ".dat";
+        gen = generation;
+    }
+    SegmentWriter w(fileName);
+    QVector<int> cursors(sources.size(), 0);
+    forever {
+        QByteArray term;
+        bool found = false;
+        foreach (int i, bRangeD(0, sources.size() - 1)) {
+            const Segment *s = sources.at(i).segment.data();
+            if (cursors.at(i) >= s->termCount())
+                continue;
+            QByteArray t = s->term(cursors.at(i));
+            if (!found || t < term) {
+                term = t;
+                found = true;
+            }
+        }
+        if (!found)
+            break;
+        HitList hits;
+        foreach (int i, bRangeD(0, sources.size() - 1)) {
+            const Segment *s = sources.at(i).segment.data();
+            if (cursors.at(i) >= s->termCount() || s->term(cursors.at(i)) != term)
+                continue;
+            HitList h;
+            s->decodeTerm(cursors[i]++, -1, sources.at(i).deleted, h);
+            hits = sum(hits, h);
+        }
+        w.addTerm(term, encode(hits));
+    }
+    QVector<int> documents(sources.size(), 0);
+    forever {
+        DocKey key;
+        bool found = false;
+        foreach (int i, bRangeD(0, sources.size() - 1)) {
+            const Segment *s = sources.at(i).segment.data();
+            if (documents.at(i) >= s->documentCount())
+                continue;
+            DocKey k = s->document(documents.at(i));
+            if (!found || k < key) {
+                key = k;
+                found = true;
+            }
+        }
+        if (!found)
+            break;
+        quint32 length = 0;
+        bool alive = false;
+        foreach (int i, bRangeD(0, sources.size() - 1)) {
+            const Segment *s = sources.at(i).segment.data();
+            quint32 l = 0;
+            if (documents.at(i) >= s->documentCount() || s->document(documents.at(i), &l) != key)
+                continue;
+            ++documents[i];
+            if (sources.at(i).deleted.contains(key))
+                continue;
+            length = l;
+            alive = true;
+        }
+        if (alive)
+            w.addDocument(key, length);
+    }
+    bool ok = w.finish();
+    QSharedPointer<Segment> merged(ok ? new Segment(fileName) : 0);
+    QMutexLocker locker(&writeMutex);
+    merging = false;
+    SnapshotPointer c = snapshot();
+    bool same = (generation == gen) && c->segments.size() >= first + sources.size();
+    foreach (int i, bRangeD(0, sources.size() - 1)) {
+        if (!same)
+            break;
+        same = (c->segments.at(first + i).segment == sources.at(i).segment);
+    }
+    if (!merged || !merged->isValid() || !same) {
+        if (merged)
+            merged->setObsolete();
+        else
+            QFile::remove(fileName);
+        return;
+    }
+    Snapshot *s = new Snapshot(*c);
+    SegmentRef r;
+    r.segment = merged;
+    DocKeySet deleted;
+    foreach (int i, bRangeD(0, sources.size() - 1))
+        deleted += c->segments.at(first + i).deleted - sources.at(i).deleted;
+    setDeleted(r, deleted);
+    s->segments = c->segments.mid(0, first);
+    s->segments << r;
+    s->segments << c->segments.mid(first + sources.size());
+    writeManifest(saveManifest(*s));
+    publish(s);
+    foreach (const SegmentRef &sr, sources)
+        sr.segment->setObsolete();
+    locker.unlock();
+    scheduleMerge();
+}
+
+void RebuildTask::run()
+{
+    QString err;
+    int count = rebuildIndex(&err);
+    TranslatorQt tq;
+    if (count < 0) {
+        bWriteLine(tq.translate("Search", "Failed to rebuild search index:", "message") + " " + err);
+        return;
+    }
+    bWriteLine(tq.translate("Search", "Rebuilt search index, posts:", "message") + " " + QString::number(count));
+}
+
+TokenizeTask::TokenizeTask(const DocumentList &documents, int begin, int end, Tokens *tokens) :
+    Documents(documents), Begin(begin), End(end), tokens(tokens)
+{
+    //
+}
+
+void TokenizeTask::run()
+{
+    foreach (int i, bRangeD(Begin, End - 1))
+        tokens[i - Begin] = tokenize(Documents.at(i).text);
+}
+
+void UpdateTask::run()
+{
+    applyPending();
 }
 
 void addToIndex(const QString &boardName, quint64 postNumber, const QString &text)
 {
     if (boardName.isEmpty() || !postNumber || text.isEmpty())
         return;
-    QStringList list = words(text);
-    if (list.isEmpty())
-        return;
-    QWriteLocker locker(&indexLock);
-    foreach (int i, bRangeD(0, list.size() - 1))
-        index[list.at(i)][boardName][postNumber].insert(quint32(i));
+    Update u;
+    u.boardName = boardName;
+    u.postNumber = postNumber;
+    u.text = text;
+    u.remove = false;
+    enqueue(u);
 }
 
 void clearIndex()
 {
-    QWriteLocker locker(&indexLock);
-    index.clear();
+    QMutexLocker saveLocker(&saveMutex);
+    applyPending();
+    QMutexLocker locker(&writeMutex);
+    SnapshotPointer c = snapshot();
+    Snapshot *s = createSnapshot();
+    ++generation;
     modified = true;
+    outdated = false;
+    if (BDirTools::mkpath(Tools::searchIndexPath()))
+        writeManifest(saveManifest(*s));
+    publish(s);
+    foreach (const SegmentRef &r, c->segments)
+        r.segment->setObsolete();
+}
+
+void closeIndex()
+{
+    rebuildPool()->waitForDone();
+    QMutexLocker saveLocker(&saveMutex);
+    updatePool()->waitForDone();
+    mergePool()->waitForDone();
+    QMutexLocker locker(&writeMutex);
+    publish(createSnapshot());
 }
 
-BoardMap find(const Query &q, const QString &boardName, bool *ok, QString *error, const QLocale &l)
+ResultList find(const Query &q, const QString &boardName, int count, const QString &cursor, QString *nextCursor,
+                bool *ok, QString *error, const QLocale &l)
 {
     TranslatorQt tq(l);
+    if (nextCursor)
+        nextCursor->clear();
     if (!q.isValid())
-        return bRet(ok, false, error, tq.translate("Search", "Invalid search query", "error"), BoardMap());
-    QReadLocker locker(&indexLock);
-    BoardMap m;
-    if (!q.requiredPhrases.isEmpty())
-        m = findPhrase(q.requiredPhrases.first(), boardName);
-    foreach (int i, bRangeD(1, q.requiredPhrases.size() - 1))
-        m = intersection(m, findPhrase(q.requiredPhrases.at(i), boardName));
-    foreach (const QString &phrase, q.possiblePhrases)
-        m = sum(m, findPhrase(phrase, boardName));
+        return bRet(ok, false, error, tq.translate("Search", "Invalid search query", "error"), ResultList());
+    Result after;
+    if (!cursor.isEmpty() && !fromCursor(cursor, after))
+        return bRet(ok, false, error, tq.translate("Search", "Invalid page cursor", "error"), ResultList());
+    SnapshotPointer snap = snapshot();
+    const Snapshot &s = *snap;
+    int board = -1;
+    if (!boardName.isEmpty()) {
+        QHash<QString, quint32>::ConstIterator i = s.boardIds.find(boardName);
+        if (s.boardIds.end() == i)
+            return bRet(ok, true, error, QString(), ResultList());
+        board = int(i.value());
+    }
+    QList<HitList> scored;
+    HitList hits;
+    foreach (int i, bRangeD(0, q.requiredPhrases.size() - 1)) {
+        scored << findPhrase(s, q.requiredPhrases.at(i), board);
+        hits = i ? intersection(hits, scored.last()) : scored.last();
+    }
+    foreach (const QString &phrase, q.possiblePhrases) {
+        scored << findPhrase(s, phrase, board);
+        hits = sum(hits, scored.last());
+    }
     foreach (const QString &phrase, q.excludedPhrases) {
-        if (m.isEmpty())
+        if (hits.isEmpty())
             break;
-        m = complement(m, findPhrase(phrase, boardName));
+        hits = complement(hits, findPhrase(s, phrase, board));
     }
-    return bRet(ok, true, error, QString(), m);
-}
-
-BoardMap find(const Query &query, bool *ok, QString *error, const QLocale &l)
-{
-    return find(query, "", ok, error, l);
+    if (hits.isEmpty())
+        return bRet(ok, true, error, QString(), ResultList());
+    quint64 documents = 0;
+    quint64 totalLength = 0;
+    documentStatistics(s, &documents, &totalLength);
+    double averageLength = documents ? (double(totalLength) / double(documents)) : 0.0;
+    QVector<double> idf;
+    foreach (const HitList &h, scored) {
+        double n = double(qMax(documents, quint64(hits.size())));
+        double df = double(h.size());
+        idf << std::log(1.0 + (n - df + 0.5) / (df + 0.5));
+    }
+    QVector<quint64> lastPosts(s.boardNames.size(), 0);
+    foreach (const Hit &h, hits)
+        lastPosts[int(h.board)] = qMax(lastPosts.at(int(h.board)), h.post);
+    QVector<int> cursors(scored.size(), 0);
+    QVector<Result> results;
+    results.reserve(hits.size());
+    foreach (const Hit &h, hits) {
+        quint32 length = documentLength(s, DocKey(h.board, h.post));
+        double norm = (length && averageLength > 0.0) ? (double(length) / averageLength) : 1.0;
+        Result r;
+        r.boardName = s.boardNames.at(int(h.board));
+        r.postNumber = h.post;
+        r.score = 0.0;
+        foreach (int i, bRangeD(0, scored.size() - 1)) {
+            const HitList &list = scored.at(i);
+            int &j = cursors[i];
+            while (j < list.size() && compare(list.at(j), h) < 0)
+                ++j;
+            if (j >= list.size() || compare(list.at(j), h))
+                continue;
+            double tf = double(list.at(j).positions.size());
+            r.score += idf.at(i) * tf * (Bm25K1 + 1.0) / (tf + Bm25K1 * (1.0 - Bm25B + Bm25B * norm));
+        }
+        r.score *= 1.0 + RecencyWeight * double(h.post) / double(lastPosts.at(int(h.board)));
+        if (!cursor.isEmpty() && !resultLessThan(after, r))
+            continue;
+        results << r;
+    }
+    int k = (count > 0) ? qMin(count + 1, results.size()) : results.size();
+    std::partial_sort(results.begin(), results.begin() + k, results.end(), &resultLessThan);
+    if (count > 0 && results.size() > count) {
+        if (nextCursor)
+            *nextCursor = toCursor(results.at(count - 1));
+        results.resize(count);
+    }
+    return bRet(ok, true, error, QString(), results.toList());
 }
 
 bool isModified()
 {
-    QReadLocker locker(&indexLock);
+    {
+        QMutexLocker locker(&pendingMutex);
+        if (!pending.isEmpty())
+            return true;
+    }
+    QMutexLocker locker(&writeMutex);
     return modified;
 }
 
@@ -265,51 +1812,155 @@ void removeFromIndex(const QString &boardName, quint64 postNumber, const QString
 {
     if (boardName.isEmpty() || !postNumber || text.isEmpty())
         return;
-    QStringList list = words(text);
-    if (list.isEmpty())
-        return;
-    QWriteLocker locker(&indexLock);
-    foreach (int i, bRangeD(0, list.size() - 1)) {
-        const QString &word = list.at(i);
-        BoardMap &boards = index[word];
-        PostMap &posts = boards[boardName];
-        PositionSet &positions = posts[postNumber];
-        positions.remove(quint32(i));
-        if (positions.isEmpty())
-            posts.remove(postNumber);
-        if (posts.isEmpty())
-            boards.remove(boardName);
-        if (boards.isEmpty())
-            index.remove(word);
-    }
-    modified = true;
+    Update u;
+    u.boardName = boardName;
+    u.postNumber = postNumber;
+    u.text = text;
+    u.remove = true;
+    enqueue(u);
 }
 
 int rebuildIndex(QString *error, const QLocale &l)
 {
-    QWriteLocker locker(&indexLock);
-    index.clear();
+    QMutexLocker rebuildLocker(&rebuildMutex);
+    {
+        QMutexLocker locker(&writeMutex);
+        rebuilding = true;
+        rebuildLog.clear();
+    }
+    bool ok = false;
+    DocumentList documents = Database::searchDocuments(&ok, error, l);
+    if (!ok) {
+        QMutexLocker locker(&writeMutex);
+        rebuilding = false;
+        rebuildLog.clear();
+        return -1;
+    }
+    qSort(documents.begin(), documents.end(), &documentLessThan);
+    Snapshot *s = createSnapshot();
+    QSharedPointer<MemorySegment> m(new MemorySegment);
+    QThreadPool pool;
+    pool.setMaxThreadCount(qMax(QThread::idealThreadCount(), 1));
+    for (int offset = 0; offset < documents.size(); offset += TokenizeChunkSize) {
+        int count = qMin(TokenizeChunkSize, documents.size() - offset);
+        QVector<Tokens> tokens(count);
+        int step = count / pool.maxThreadCount() + 1;
+        for (int i = 0; i < count; i += step)
+            pool.start(new TokenizeTask(documents, offset + i, offset + qMin(i + step, count), tokens.data() + i));
+        pool.waitForDone();
+        foreach (int i, bRangeD(0, count - 1)) {
+            const Document &d = documents.at(offset + i);
+            addDocument(*s, *m, d.boardName, d.postNumber, tokens.at(i));
+        }
+    }
+    QMutexLocker saveLocker(&saveMutex);
+    applyPending();
+    QMutexLocker locker(&writeMutex);
+    foreach (const Update &u, rebuildLog)
+        apply(*s, *m, u);
+    if (!m->terms.isEmpty())
+        appendMemorySegment(*s, m);
+    rebuilding = false;
+    rebuildLog.clear();
+    SnapshotPointer c = snapshot();
+    ++generation;
     modified = true;
-    return Database::addPostsToIndex(error, l);
+    outdated = false;
+    publish(s);
+    locker.unlock();
+    saveIndex();
+    foreach (const SegmentRef &r, c->segments)
+        r.segment->setObsolete();
+    return documents.size();
 }
 
-void restoreIndex(const QByteArray &data)
+void restoreIndex()
 {
-    QDataStream ds(data);
-    ds.setVersion(BeQt::DataStreamVersion);
-    QWriteLocker locker(&indexLock);
-    ds >> index;
-    modified = false;
+    QMutexLocker saveLocker(&saveMutex);
+    QMutexLocker locker(&writeMutex);
+    QString signature = Analyzer::defaultAnalyzer().signature();
+    Snapshot *s = createSnapshot();
+    if (restoreManifest(BDirTools::readFile(Tools::searchIndexPath() + "/manifest.dat"), signature, *s)) {
+        modified = false;
+        return publish(s);
+    }
+    delete s;
+    s = createSnapshot();
+    QSharedPointer<MemorySegment> m(new MemorySegment);
+    restoreLegacyIndex(BDirTools::readFile(Tools::searchIndexFile()), *s, *m);
+    if (!m->terms.isEmpty())
+        appendMemorySegment(*s, m);
+    modified = !s->memory.isEmpty();
+    outdated = modified;
+    publish(s);
 }
 
-QByteArray saveIndex()
+bool saveIndex()
 {
-    QByteArray data;
-    QDataStream out(&data, QIODevice::WriteOnly);
-    QReadLocker locker(&indexLock);
-    out << index;
-    modified = false;
-    return data;
+    QMutexLocker saveLocker(&saveMutex);
+    if (!BDirTools::mkpath(Tools::searchIndexPath()))
+        return false;
+    applyPending();
+    QList<MemoryRef> frozen;
+    QString fileName;
+    {
+        QMutexLocker locker(&writeMutex);
+        if (!modified)
+            return true;
+        SnapshotPointer c = snapshot();
+        Snapshot *s = new Snapshot(*c);
+        frozen = c->memory;
+        s->frozen = frozen;
+        s->memory.clear();
+        if (!frozen.isEmpty())
+            fileName = Tools::searchIndexPath() + "/segment-" + QString::number(nextSegment++) + ".dat";
+        modified = false;
+        publish(s);
+    }
+    bool ok = fileName.isEmpty() || writeSegment(fileName, frozen);
+    QMutexLocker locker(&writeMutex);
+    SnapshotPointer c = snapshot();
+    Snapshot *s = new Snapshot(*c);
+    QSharedPointer<Segment> segment((ok && !fileName.isEmpty()) ? new Segment(fileName) : 0);
+    if (segment && segment->isValid()) {
+        SegmentRef r;
+        r.segment = segment;
+        DocKeySet deleted;
+        foreach (int i, bRangeD(0, qMin(frozen.size(), c->frozen.size()) - 1))
+            deleted += c->frozen.at(i).deleted - frozen.at(i).deleted;
+        setDeleted(r, deleted);
+        s->segments << r;
+    } else if (!fileName.isEmpty()) {
+        if (segment)
+            segment->setObsolete();
+        else
+            QFile::remove(fileName);
+        s->memory = c->frozen + c->memory;
+        modified = true;
+        ok = false;
+    }
+    s->frozen.clear();
+    ok = writeManifest(saveManifest(*s)) && ok;
+    if (!ok)
+        modified = true;
+    publish(s);
+    locker.unlock();
+    scheduleMerge();
+    return ok;
+}
+
+bool upgradeIndex()
+{
+    {
+        QMutexLocker locker(&writeMutex);
+        if (!outdated)
+            return false;
+    }
+    TranslatorQt tq;
+    bWriteLine(tq.translate("Search", "Search index was built by another analyzer, rebuilding it in background",
+                            "message"));
+    rebuildPool()->start(new RebuildTask);
+    return true;
 }
 
 }
@@ -1,25 +1,27 @@
 #ifndef OLOLORD_SEARCH_H
 #define OLOLORD_SEARCH_H
 
-class QByteArray;
 class QLocale;
 
 #include "global.h"
 
 #include <BCoreApplication>
 
-#include <QHash>
-#include <QMap>
-#include <QSet>
+#include <QList>
 #include <QString>
 #include <QStringList>
 
 namespace Search
 {
 
-typedef QSet<quint32> PositionSet;
-typedef QMap<quint64, PositionSet> PostMap;
-typedef QHash<QString, PostMap> BoardMap;
+struct OLOLORD_EXPORT Document
+{
+    QString boardName;
+    quint64 postNumber;
+    QString text;
+};
+
+typedef QList<Document> DocumentList;
 
 struct OLOLORD_EXPORT Query
 {
@@ -30,19 +32,29 @@ public:
     bool isValid() const;
 };
 
+struct OLOLORD_EXPORT Result
+{
+    QString boardName;
+    quint64 postNumber;
+    double score;
+};
+
+typedef QList<Result> ResultList;
+
 OLOLORD_EXPORT void addToIndex(const QString &boardName, quint64 postNumber, const QString &text);
 OLOLORD_EXPORT void clearIndex();
-OLOLORD_EXPORT BoardMap find(const Query &query, const QString &boardName, bool *ok = 0, QString *error = 0,
-                             const QLocale &l = BCoreApplication::locale());
-OLOLORD_EXPORT BoardMap find(const Query &query, bool *ok = 0, QString *error = 0,
-                             const QLocale &l = BCoreApplication::locale());
+OLOLORD_EXPORT void closeIndex();
+OLOLORD_EXPORT ResultList find(const Query &query, const QString &boardName = QString(), int count = 0,
+                               const QString &cursor = QString(), QString *nextCursor = 0, bool *ok = 0,
+                               QString *error = 0, const QLocale &l = BCoreApplication::locale());
 OLOLORD_EXPORT bool isModified();
 OLOLORD_EXPORT Query query(const QString &q, bool *ok = 0, QString *error = 0,
                            const QLocale &l = BCoreApplication::locale());
 OLOLORD_EXPORT int rebuildIndex(QString *error = 0, const QLocale &l = BCoreApplication::locale());
 OLOLORD_EXPORT void removeFromIndex(const QString &boardName, quint64 postNumber, const QString &text);
-OLOLORD_EXPORT void restoreIndex(const QByteArray &data);
-OLOLORD_EXPORT QByteArray saveIndex();
+OLOLORD_EXPORT void restoreIndex();
+OLOLORD_EXPORT bool saveIndex();
+OLOLORD_EXPORT bool upgradeIndex();
 
 }
 
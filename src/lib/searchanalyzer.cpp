@@ -0,0 +1,629 @@
+#include "searchanalyzer.h"
+
+#include <BeQt>
+
+#include <QByteArray>
+#include <QChar>
+#include <QDebug>
+#include <QList>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QTextBoundaryFinder>
+
+#include <cstring>
+
+namespace Search
+{
+
+/*Russian words are written in a single-letter transliteration, so that the sources stay ASCII:
+  a-a b-b v-v g-g d-d e-e Z-zh z-z i-i j-short i k-k l-l m-m n-n o-o p-p r-r s-s t-t u-u f-f h-kh c-ts C-ch
+  W-sh X-shch y-y '-soft sign E-e (reversed) U-yu A-ya*/
+
+static ushort cyrillic(char c)
+{
+    static const char Latin[] = "abvgdeZzijklmnoprstufhcCWXy'EUA";
+    const char *p = std::strchr(Latin, c);
+    if (!c || !p)
+        return 0;
+    static const ushort Codes[] = {
+        0x430, 0x431, 0x432, 0x433, 0x434, 0x435, 0x436, 0x437, 0x438, 0x439, 0x43A, 0x43B, 0x43C, 0x43D, 0x43E,
+        0x43F, 0x440, 0x441, 0x442, 0x443, 0x444, 0x445, 0x446, 0x447, 0x448, 0x449, 0x44B, 0x44C, 0x44D, 0x44E,
+        0x44F
+    };
+    return Codes[p - Latin];
+}
+
+static QString ru(const char *s)
+{
+    QString r;
+    for (; *s; ++s)
+        r += QChar(cyrillic(*s));
+    return r;
+}
+
+static const char * const EnglishStopWords[] = {
+    "a", "an", "and", "are", "as", "at", "be", "but", "by", "for", "if", "in", "into", "is", "it", "no", "not", "of",
+    "on", "or", "such", "that", "the", "their", "then", "there", "these", "they", "this", "to", "was", "will",
+    "with", 0
+};
+
+static const char * const RussianStopWords[] = {
+    "i", "v", "vo", "ne", "Cto", "on", "na", "A", "s", "so", "kak", "a", "to", "vse", "ona", "tak", "ego", "no", "da",
+    "ty", "k", "u", "Ze", "vy", "za", "by", "po", "tol'ko", "ee", "mne", "bylo", "vot", "ot", "menA", "eXe", "o",
+    "iz", "emu", "kogda", "daZe", "li", "esli", "uZe", "ili", "ni", "byt'", "byl", "do", "tam", "gde", "est'",
+    "dlA", "my", "ih", "Cem", "byla", "bez", "pod", "budet", "kto", "Etot", "zdes'", "pri", "ob", "nad", "tot",
+    "Cerez", "Eti", "pro", 0
+};
+
+static const char * const PerfectiveGerund1[] = { "v", "vWi", "vWis'", 0 };
+static const char * const PerfectiveGerund2[] = { "iv", "ivWi", "ivWis'", "yv", "yvWi", "yvWis'", 0 };
+static const char * const Adjective[] = {
+    "ee", "ie", "ye", "oe", "imi", "ymi", "ej", "ij", "yj", "oj", "em", "im", "ym", "om", "ego", "ogo", "emu", "omu",
+    "ih", "yh", "uU", "UU", "aA", "AA", "oU", "eU", 0
+};
+static const char * const Participle1[] = { "em", "nn", "vW", "UX", "X", 0 };
+static const char * const Participle2[] = { "ivW", "yvW", "uUX", 0 };
+static const char * const Reflexive[] = { "sA", "s'", 0 };
+static const char * const Verb1[] = {
+    "la", "na", "ete", "jte", "li", "j", "l", "em", "n", "lo", "no", "et", "Ut", "ny", "t'", "eW'", "nno", 0
+};
+static const char * const Verb2[] = {
+    "ila", "yla", "ena", "ejte", "ujte", "ite", "ili", "yli", "ej", "uj", "il", "yl", "im", "ym", "en", "ilo", "ylo",
+    "eno", "At", "uet", "uUt", "it", "yt", "eny", "it'", "yt'", "iW'", "uU", "U", 0
+};
+static const char * const Noun[] = {
+    "a", "ev", "ov", "ie", "'e", "e", "iAmi", "Ami", "ami", "ei", "ii", "i", "iej", "ej", "oj", "ij", "j", "iAm",
+    "Am", "iem", "em", "am", "om", "o", "u", "ah", "iAh", "Ah", "y", "'", "iU", "'U", "U", "iA", "'A", "A", 0
+};
+static const char * const Superlative[] = { "ejW", "ejWe", 0 };
+static const char * const Derivational[] = { "ost", "ost'", 0 };
+
+struct Suffix
+{
+    const char *suffix;
+    const char *replacement;
+};
+
+static const Suffix Step2Suffixes[] = {
+    { "ational", "ate" }, { "tional", "tion" }, { "enci", "ence" }, { "anci", "ance" }, { "izer", "ize" },
+    { "bli", "ble" }, { "alli", "al" }, { "entli", "ent" }, { "eli", "e" }, { "ousli", "ous" },
+    { "ization", "ize" }, { "ation", "ate" }, { "ator", "ate" }, { "alism", "al" }, { "iveness", "ive" },
+    { "fulness", "ful" }, { "ousness", "ous" }, { "aliti", "al" }, { "iviti", "ive" }, { "biliti", "ble" },
+    { "logi", "log" }, { 0, 0 }
+};
+
+static const Suffix Step3Suffixes[] = {
+    { "icate", "ic" }, { "ative", "" }, { "alize", "al" }, { "iciti", "ic" }, { "ical", "ic" }, { "ful", "" },
+    { "ness", "" }, { 0, 0 }
+};
+
+static const char * const Step4Suffixes[] = {
+    "al", "ance", "ence", "er", "ic", "able", "ible", "ant", "ement", "ment", "ent", "ion", "ou", "ism", "ate", "iti",
+    "ous", "ive", "ize", 0
+};
+
+class PorterStemmer
+{
+private:
+    QByteArray b;
+    int k;
+    int j;
+public:
+    explicit PorterStemmer(const QByteArray &word);
+public:
+    QByteArray stem();
+private:
+    bool cons(int i) const;
+    bool cvc(int i) const;
+    bool doublec(int i) const;
+    bool ends(const char *s);
+    int m() const;
+    void r(const char *s);
+    void setTo(const char *s);
+    void step1ab();
+    void step1c();
+    void step2();
+    void step3();
+    void step4();
+    void step5();
+    bool vowelInStem() const;
+};
+
+PorterStemmer::PorterStemmer(const QByteArray &word) :
+    b(word)
+{
+    k = word.size() - 1;
+    j = 0;
+}
+
+QByteArray PorterStemmer::stem()
+{
+    if (k <= 1)
+        return b;
+    step1ab();
+    if (k > 0) {
+        step1c();
+        step2();
+        step3();
+        step4();
+        step5();
+    }
+    return b.left(k + 1);
+}
+
+bool PorterStemmer::cons(int i) const
+{
+    switch (b.at(i)) {
+    case 'a':
+    case 'e':
+    case 'i':
+    case 'o':
+    case 'u':
+        return false;
+    case 'y':
+        return !i || !cons(i - 1);
+    default:
+        return true;
+    }
+}
+
+bool PorterStemmer::cvc(int i) const
+{
+    if (i < 2 || !cons(i) || cons(i - 1) || !cons(i - 2))
+        return false;
+    char c = b.at(i);
+    return c != 'w' && c != 'x' && c != 'y';
+}
+
+bool PorterStemmer::doublec(int i) const
+{
+    return i >= 1 && b.at(i) == b.at(i - 1) && cons(i);
+}
+
+bool PorterStemmer::ends(const char *s)
+{
+    int l = int(std::strlen(s));
+    if (l > k + 1 || s[l - 1] != b.at(k) || std::memcmp(b.constData() + k - l + 1, s, l))
+        return false;
+    j = k - l;
+    return true;
+}
+
+int PorterStemmer::m() const
+{
+    int n = 0;
+    int i = 0;
+    forever {
+        if (i > j)
+            return n;
+        if (!cons(i))
+            break;
+        ++i;
+    }
+    ++i;
+    forever {
+        forever {
+            if (i > j)
+                return n;
+            if (cons(i))
+                break;
+            ++i;
+        }
+        ++i;
+        ++n;
+        forever {
+            if (i > j)
+                return n;
+            if (!cons(i))
+                break;
+            ++i;
+        }
+        ++i;
+    }
+}
+
+void PorterStemmer::r(const char *s)
+{
+    if (m() > 0)
+        setTo(s);
+}
+
+void PorterStemmer::setTo(const char *s)
+{
+    b = b.left(j + 1) + s;
+    k = b.size() - 1;
+}
+
+void PorterStemmer::step1ab()
+{
+    if (b.at(k) == 's') {
+        if (ends("sses"))
+            k -= 2;
+        else if (ends("ies"))
+            setTo("i");
+        else if (b.at(k - 1) != 's')
+            --k;
+    }
+    if (ends("eed")) {
+        if (m() > 0)
+            --k;
+    } else if ((ends("ed") || ends("ing")) && vowelInStem()) {
+        k = j;
+        if (ends("at")) {
+            setTo("ate");
+        } else if (ends("bl")) {
+            setTo("ble");
+        } else if (ends("iz")) {
+            setTo("ize");
+        } else if (doublec(k)) {
+            --k;
+            char c = b.at(k);
+            if (c == 'l' || c == 's' || c == 'z')
+                ++k;
+        } else if (m() == 1 && cvc(k)) {
+            setTo("e");
+        }
+    }
+}
+
+void PorterStemmer::step1c()
+{
+    if (ends("y") && vowelInStem())
+        b[k] = 'i';
+}
+
+void PorterStemmer::step2()
+{
+    for (const Suffix *s = Step2Suffixes; s->suffix; ++s) {
+        if (ends(s->suffix))
+            return r(s->replacement);
+    }
+}
+
+void PorterStemmer::step3()
+{
+    for (const Suffix *s = Step3Suffixes; s->suffix; ++s) {
+        if (ends(s->suffix))
+            return r(s->replacement);
+    }
+}
+
+void PorterStemmer::step4()
+{
+    for (const char * const *s = Step4Suffixes; *s; ++s) {
+        if (!ends(*s))
+            continue;
+        if (!std::strcmp(*s, "ion") && (j < 0 || (b.at(j) != 's' && b.at(j) != 't')))
+            return;
+        if (m() > 1)
+            k = j;
+        return;
+    }
+}
+
+void PorterStemmer::step5()
+{
+    j = k;
+    if (b.at(k) == 'e') {
+        int a = m();
+        if (a > 1 || (a == 1 && !cvc(k - 1)))
+            --k;
+    }
+    if (b.at(k) == 'l' && doublec(k) && m() > 1)
+        --k;
+}
+
+bool PorterStemmer::vowelInStem() const
+{
+    foreach (int i, bRangeD(0, j)) {
+        if (!cons(i))
+            return true;
+    }
+    return false;
+}
+
+static bool isRussianVowel(ushort c)
+{
+    switch (c) {
+    case 0x430:
+    case 0x435:
+    case 0x438:
+    case 0x43E:
+    case 0x443:
+    case 0x44B:
+    case 0x44D:
+    case 0x44E:
+    case 0x44F:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool endsWith(const QString &w, int limit, const char *ending)
+{
+    int n = int(std::strlen(ending));
+    int start = w.size() - n;
+    if (start < limit)
+        return false;
+    foreach (int i, bRangeD(0, n - 1)) {
+        if (w.at(start + i).unicode() != cyrillic(ending[i]))
+            return false;
+    }
+    return true;
+}
+
+static int matchLongest(const QString &w, int limit, const char * const *endings)
+{
+    int best = 0;
+    for (const char * const *e = endings; *e; ++e) {
+        int n = int(std::strlen(*e));
+        if (n > best && endsWith(w, limit, *e))
+            best = n;
+    }
+    return best;
+}
+
+static bool removeLongest(QString &w, int limit, const char * const *endings)
+{
+    int n = matchLongest(w, limit, endings);
+    if (!n)
+        return false;
+    w.chop(n);
+    return true;
+}
+
+static bool removeGroups(QString &w, int limit, const char * const *endings1, const char * const *endings2)
+{
+    int n1 = matchLongest(w, limit, endings1);
+    int n2 = matchLongest(w, limit, endings2);
+    if (!n1 && !n2)
+        return false;
+    if (n2 > n1) {
+        w.chop(n2);
+        return true;
+    }
+    int ind = w.size() - n1 - 1;
+    if (ind < limit || (w.at(ind).unicode() != cyrillic('a') && w.at(ind).unicode() != cyrillic('A')))
+        return false;
+    w.chop(n1);
+    return true;
+}
+
+static bool removeAdjectival(QString &w, int limit)
+{
+    if (!removeLongest(w, limit, Adjective))
+        return false;
+    removeGroups(w, limit, Participle1, Participle2);
+    return true;
+}
+
+AbstractTokenFilter::~AbstractTokenFilter()
+{
+    //
+}
+
+StopWordFilter::StopWordFilter()
+{
+    for (const char * const *s = EnglishStopWords; *s; ++s)
+        words.insert(QString::fromLatin1(*s));
+    for (const char * const *s = RussianStopWords; *s; ++s)
+        words.insert(ru(*s));
+}
+
+bool StopWordFilter::filter(QString &term) const
+{
+    return !words.contains(term);
+}
+
+QString StopWordFilter::id() const
+{
+    return "stop-words:1";
+}
+
+bool RussianStemFilter::filter(QString &term) const
+{
+    QString w = term;
+    foreach (int i, bRangeD(0, w.size() - 1)) {
+        ushort c = w.at(i).unicode();
+        if (0x451 == c)
+            w[i] = QChar(cyrillic('e'));
+        else if (c < 0x430 || c > 0x44F)
+            return true;
+    }
+    int rv = 0;
+    while (rv < w.size() && !isRussianVowel(w.at(rv).unicode()))
+        ++rv;
+    rv = qMin(rv + 1, w.size());
+    int r1 = w.size();
+    foreach (int i, bRangeD(1, w.size() - 1)) {
+        if (!isRussianVowel(w.at(i).unicode()) && isRussianVowel(w.at(i - 1).unicode())) {
+            r1 = i + 1;
+            break;
+        }
+    }
+    int r2 = w.size();
+    foreach (int i, bRangeD(r1 + 1, w.size() - 1)) {
+        if (!isRussianVowel(w.at(i).unicode()) && isRussianVowel(w.at(i - 1).unicode())) {
+            r2 = i + 1;
+            break;
+        }
+    }
+    if (!removeGroups(w, rv, PerfectiveGerund1, PerfectiveGerund2)) {
+        removeLongest(w, rv, Reflexive);
+        if (!removeAdjectival(w, rv) && !removeGroups(w, rv, Verb1, Verb2))
+            removeLongest(w, rv, Noun);
+    }
+    if (endsWith(w, rv, "i"))
+        w.chop(1);
+    removeLongest(w, qMax(r2, rv), Derivational);
+    if (removeLongest(w, rv, Superlative)) {
+        if (endsWith(w, rv, "nn"))
+            w.chop(1);
+    } else if (endsWith(w, rv, "nn") || endsWith(w, rv, "'")) {
+        w.chop(1);
+    }
+    if (!w.isEmpty())
+        term = w;
+    return true;
+}
+
+QString RussianStemFilter::id() const
+{
+    return "stem-ru:1";
+}
+
+bool EnglishStemFilter::filter(QString &term) const
+{
+    if (term.size() <= 2)
+        return true;
+    foreach (const QChar &c, term) {
+        if (c.unicode() < 'a' || c.unicode() > 'z')
+            return true;
+    }
+    term = QString::fromLatin1(PorterStemmer(term.toLatin1()).stem());
+    return true;
+}
+
+QString EnglishStemFilter::id() const
+{
+    return "stem-en:1";
+}
+
+static bool isAsciiWordChar(ushort c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+static bool isWordChar(const QChar &c)
+{
+    return c.isLetterOrNumber() || c.isMark();
+}
+
+const Analyzer &Analyzer::defaultAnalyzer()
+{
+    init_once(Analyzer *, analyzer, new Analyzer) {
+        analyzer->addFilter(new StopWordFilter);
+        analyzer->addFilter(new RussianStemFilter);
+        analyzer->addFilter(new EnglishStemFilter);
+    }
+    return *analyzer;
+}
+
+bool Analyzer::isAscii(const QString &text)
+{
+    const QChar *d = text.unicode();
+    const QChar *end = d + text.size();
+    for (; d != end; ++d) {
+        if (d->unicode() >= 0x80)
+            return false;
+    }
+    return true;
+}
+
+Analyzer::Analyzer()
+{
+    //
+}
+
+Analyzer::~Analyzer()
+{
+    qDeleteAll(filters);
+}
+
+void Analyzer::addFilter(AbstractTokenFilter *f)
+{
+    if (!f)
+        return;
+    filters << f;
+}
+
+TokenList Analyzer::analyze(const QString &text) const
+{
+    return filter(tokenize(text));
+}
+
+TokenList Analyzer::filter(const TokenList &tokens) const
+{
+    if (filters.isEmpty())
+        return tokens;
+    TokenList list;
+    foreach (const Token &t, tokens) {
+        Token tt = t;
+        bool keep = true;
+        foreach (const AbstractTokenFilter *f, filters) {
+            if (!f->filter(tt.term)) {
+                keep = false;
+                break;
+            }
+        }
+        if (keep && !tt.term.isEmpty())
+            list << tt;
+    }
+    return list;
+}
+
+QString Analyzer::signature() const
+{
+    QStringList list;
+    list << "tokenizer:1";
+    foreach (const AbstractTokenFilter *f, filters)
+        list << f->id();
+    return list.join(",");
+}
+
+TokenList Analyzer::tokenize(const QString &text) const
+{
+    TokenList list;
+    quint32 position = 0;
+    if (isAscii(text)) {
+        const QChar *d = text.unicode();
+        int n = text.size();
+        int i = 0;
+        forever {
+            while (i < n && !isAsciiWordChar(d[i].unicode()))
+                ++i;
+            int start = i;
+            while (i < n && isAsciiWordChar(d[i].unicode()))
+                ++i;
+            if (i == start)
+                break;
+            Token t;
+            t.term.resize(i - start);
+            QChar *p = t.term.data();
+            foreach (int j, bRangeD(start, i - 1)) {
+                ushort c = d[j].unicode();
+                p[j - start] = QChar(ushort((c >= 'A' && c <= 'Z') ? (c + 32) : c));
+            }
+            t.position = position++;
+            list << t;
+        }
+        return list;
+    }
+    QTextBoundaryFinder finder(QTextBoundaryFinder::Word, text);
+    int previous = 0;
+    forever {
+        int next = finder.toNextBoundary();
+        if (next < 0)
+            break;
+        int i = previous;
+        while (i < next) {
+            while (i < next && !isWordChar(text.at(i)))
+                ++i;
+            int start = i;
+            while (i < next && isWordChar(text.at(i)))
+                ++i;
+            if (i == start)
+                break;
+            Token t;
+            t.term = text.mid(start, i - start).toLower();
+            t.position = position++;
+            list << t;
+        }
+        previous = next;
+    }
+    return list;
+}
+
+}
@@ -0,0 +1,78 @@
+#ifndef OLOLORD_SEARCHANALYZER_H
+#define OLOLORD_SEARCHANALYZER_H
+
+#include "global.h"
+
+#include <QList>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+
+namespace Search
+{
+
+struct OLOLORD_EXPORT Token
+{
+    QString term;
+    quint32 position;
+};
+
+typedef QList<Token> TokenList;
+
+class OLOLORD_EXPORT AbstractTokenFilter
+{
+public:
+    virtual ~AbstractTokenFilter();
+public:
+    virtual bool filter(QString &term) const = 0;
+    virtual QString id() const = 0;
+};
+
+class OLOLORD_EXPORT StopWordFilter : public AbstractTokenFilter
+{
+private:
+    QSet<QString> words;
+public:
+    explicit StopWordFilter();
+public:
+    bool filter(QString &term) const;
+    QString id() const;
+};
+
+class OLOLORD_EXPORT RussianStemFilter : public AbstractTokenFilter
+{
+public:
+    bool filter(QString &term) const;
+    QString id() const;
+};
+
+class OLOLORD_EXPORT EnglishStemFilter : public AbstractTokenFilter
+{
+public:
+    bool filter(QString &term) const;
+    QString id() const;
+};
+
+class OLOLORD_EXPORT Analyzer
+{
+private:
+    QList<AbstractTokenFilter *> filters;
+public:
+    static const Analyzer &defaultAnalyzer();
+    static bool isAscii(const QString &text);
+public:
+    explicit Analyzer();
+    ~Analyzer();
+public:
+    void addFilter(AbstractTokenFilter *f);
+    TokenList analyze(const QString &text) const;
+    TokenList filter(const TokenList &tokens) const;
+    QString signature() const;
+    TokenList tokenize(const QString &text) const;
+private:
+    Q_DISABLE_COPY(Analyzer)
+};
+
+}
+
+#endif // OLOLORD_SEARCHANALYZER_H
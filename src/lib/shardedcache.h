@@ -0,0 +1,425 @@
+#ifndef OLOLORD_SHARDEDCACHE_H
+#define OLOLORD_SHARDEDCACHE_H
+
+#include "global.h"
+
+#include <QAtomicInt>
+#include <QAtomicInteger>
+#include <QHash>
+#include <QList>
+#include <QReadLocker>
+#include <QReadWriteLock>
+#include <QSharedPointer>
+#include <QtGlobal>
+#include <QWriteLocker>
+
+template <typename Key, typename T> class ShardedCache
+{
+public:
+    enum EvictionPolicy
+    {
+        LruPolicy = 0,
+        ClockPolicy
+    };
+public:
+    struct Statistics
+    {
+        quint64 hits;
+        quint64 misses;
+        quint64 inserts;
+        quint64 evictions;
+        int count;
+        int cost;
+        int maxCost;
+        qint64 bytes;
+    };
+private:
+    struct Node
+    {
+        Key key;
+        QSharedPointer<T> object;
+        int cost;
+        qint64 bytes;
+        QAtomicInt referenced;
+        Node *previous;
+        Node *next;
+    };
+    struct Shard
+    {
+        QHash<Key, Node *> nodes;
+        Node *head;
+        Node *tail;
+        int totalCost;
+        qint64 totalBytes;
+        mutable QAtomicInteger<quint64> hits;
+        mutable QAtomicInteger<quint64> misses;
+        quint64 inserts;
+        quint64 evictions;
+        mutable QReadWriteLock lock;
+    public:
+        explicit Shard() :
+            lock(QReadWriteLock::Recursive)
+        {
+            head = 0;
+            tail = 0;
+            totalCost = 0;
+            totalBytes = 0;
+            inserts = 0;
+            evictions = 0;
+        }
+    };
+public:
+    class WriteLocker
+    {
+    private:
+        ShardedCache &cache;
+        Shard &s;
+        const Key key;
+        QWriteLocker locker;
+    public:
+        explicit WriteLocker(ShardedCache &c, const Key &k) :
+            cache(c), s(c.shard(k)), key(k), locker(&s.lock)
+        {
+            //
+        }
+    public:
+        QSharedPointer<T> object() const
+        {
+            //NOTE: The object may be shared with readers, so it must be replaced via setObject(), not modified
+            Node *n = s.nodes.value(key);
+            if (!n)
+                return QSharedPointer<T>();
+            if (ClockPolicy == cache.mpolicy) {
+                n->referenced.fetchAndStoreRelaxed(1);
+            } else {
+                cache.unlink(s, n);
+                cache.link(s, n);
+            }
+            return n->object;
+        }
+        int cost() const
+        {
+            Node *n = s.nodes.value(key);
+            return n ? n->cost : 0;
+        }
+        void setObject(const QSharedPointer<T> &object, int cost, qint64 bytes = -1)
+        {
+            Node *n = s.nodes.value(key);
+            if (!n || !object)
+                return;
+            n->object = object;
+            if (cost < 0)
+                cost = 0;
+            if (bytes < 0)
+                bytes = cost;
+            s.totalCost += cost - n->cost;
+            s.totalBytes += bytes - n->bytes;
+            cache.bytesChanged(bytes - n->bytes);
+            n->cost = cost;
+            n->bytes = bytes;
+            cache.trim(s, qMax(cache.shardMaxCost(), cost), n);
+        }
+        void unlock()
+        {
+            locker.unlock();
+        }
+    private:
+        Q_DISABLE_COPY(WriteLocker)
+    };
+public:
+    const int ShardCount;
+private:
+    Shard *shards;
+    int mmaxCost;
+    EvictionPolicy mpolicy;
+public:
+    explicit ShardedCache(int shardCount = 16, int maxCost = 100, EvictionPolicy policy = ClockPolicy) :
+        ShardCount((shardCount > 0) ? shardCount : 1)
+    {
+        shards = new Shard[ShardCount];
+        mmaxCost = (maxCost >= 0) ? maxCost : 0;
+        mpolicy = policy;
+    }
+    virtual ~ShardedCache()
+    {
+        clear();
+        delete [] shards;
+    }
+public:
+    void clear()
+    {
+        for (int i = 0; i < ShardCount; ++i) {
+            Shard &s = shards[i];
+            QWriteLocker locker(&s.lock);
+            while (s.tail)
+                destroy(s, s.tail);
+        }
+    }
+    bool contains(const Key &key) const
+    {
+        const Shard &s = shard(key);
+        QReadLocker locker(&s.lock);
+        return s.nodes.contains(key);
+    }
+    qint64 evict(qint64 bytes, const T *keep = 0)
+    {
+        qint64 freed = 0;
+        bool evicted = true;
+        while (freed < bytes && evicted) {
+            evicted = false;
+            for (int i = 0; i < ShardCount && freed < bytes; ++i) {
+                Shard &s = shards[i];
+                QWriteLocker locker(&s.lock);
+                Node *n = victim(s, keep);
+                if (!n)
+                    continue;
+                freed += n->bytes;
+                destroy(s, n);
+                s.evictions += 1;
+                evicted = true;
+            }
+        }
+        return freed;
+    }
+    EvictionPolicy evictionPolicy() const
+    {
+        return mpolicy;
+    }
+    bool insert(const Key &key, const QSharedPointer<T> &object, int cost = 1, qint64 bytes = -1)
+    {
+        if (!object)
+            return false;
+        if (cost < 0)
+            cost = 0;
+        if (bytes < 0)
+            bytes = cost;
+        Shard &s = shard(key);
+        QWriteLocker locker(&s.lock);
+        Node *n = s.nodes.value(key);
+        if (n)
+            destroy(s, n);
+        if (cost > mmaxCost)
+            return false;
+        n = new Node;
+        n->key = key;
+        n->object = object;
+        n->cost = cost;
+        n->bytes = bytes;
+        n->referenced.fetchAndStoreRelaxed(0);
+        n->previous = 0;
+        n->next = 0;
+        link(s, n);
+        s.nodes.insert(key, n);
+        s.totalCost += cost;
+        s.totalBytes += bytes;
+        s.inserts += 1;
+        bytesChanged(bytes);
+        trim(s, qMax(shardMaxCost(), cost), n);
+        return true;
+    }
+    QList<Key> keys(int max = -1) const
+    {
+        QList< QList<Key> > lists;
+        for (int i = 0; i < ShardCount; ++i) {
+            const Shard &s = shards[i];
+            QList<Key> list;
+            QReadLocker locker(&s.lock);
+            for (const Node *n = s.head; n && (max < 0 || list.size() < max); n = n->next)
+                list << n->key;
+            lists << list;
+        }
+        QList<Key> list;
+        for (int j = 0; max < 0 || list.size() < max; ++j) {
+            bool found = false;
+            for (int i = 0; i < ShardCount && (max < 0 || list.size() < max); ++i) {
+                if (j >= lists.at(i).size())
+                    continue;
+                list << lists.at(i).at(j);
+                found = true;
+            }
+            if (!found)
+                break;
+        }
+        return list;
+    }
+    int maxCost() const
+    {
+        return mmaxCost;
+    }
+    QSharedPointer<T> object(const Key &key) const
+    {
+        Shard &s = shard(key);
+        if (ClockPolicy == mpolicy) {
+            QReadLocker locker(&s.lock);
+            Node *n = s.nodes.value(key);
+            if (!n) {
+                s.misses.fetchAndAddRelaxed(1);
+                return QSharedPointer<T>();
+            }
+            s.hits.fetchAndAddRelaxed(1);
+            n->referenced.fetchAndStoreRelaxed(1);
+            return n->object;
+        }
+        QWriteLocker locker(&s.lock);
+        Node *n = s.nodes.value(key);
+        if (!n) {
+            s.misses.fetchAndAddRelaxed(1);
+            return QSharedPointer<T>();
+        }
+        s.hits.fetchAndAddRelaxed(1);
+        unlink(s, n);
+        link(s, n);
+        return n->object;
+    }
+    bool remove(const Key &key)
+    {
+        Shard &s = shard(key);
+        QWriteLocker locker(&s.lock);
+        Node *n = s.nodes.value(key);
+        if (!n)
+            return false;
+        destroy(s, n);
+        return true;
+    }
+    void setEvictionPolicy(EvictionPolicy policy)
+    {
+        mpolicy = policy;
+    }
+    void setMaxCost(int cost)
+    {
+        mmaxCost = (cost >= 0) ? cost : 0;
+        int max = shardMaxCost();
+        for (int i = 0; i < ShardCount; ++i) {
+            Shard &s = shards[i];
+            QWriteLocker locker(&s.lock);
+            trim(s, max);
+        }
+    }
+    Statistics statistics() const
+    {
+        Statistics st;
+        st.hits = 0;
+        st.misses = 0;
+        st.inserts = 0;
+        st.evictions = 0;
+        st.count = 0;
+        st.cost = 0;
+        st.maxCost = mmaxCost;
+        st.bytes = 0;
+        for (int i = 0; i < ShardCount; ++i) {
+            const Shard &s = shards[i];
+            QReadLocker locker(&s.lock);
+            st.hits += s.hits.load();
+            st.misses += s.misses.load();
+            st.inserts += s.inserts;
+            st.evictions += s.evictions;
+            st.count += s.nodes.size();
+            st.cost += s.totalCost;
+            st.bytes += s.totalBytes;
+        }
+        return st;
+    }
+    QSharedPointer<T> take(const Key &key)
+    {
+        Shard &s = shard(key);
+        QWriteLocker locker(&s.lock);
+        Node *n = s.nodes.value(key);
+        if (!n)
+            return QSharedPointer<T>();
+        QSharedPointer<T> object = n->object;
+        destroy(s, n);
+        return object;
+    }
+    int totalCost() const
+    {
+        int cost = 0;
+        for (int i = 0; i < ShardCount; ++i) {
+            const Shard &s = shards[i];
+            QReadLocker locker(&s.lock);
+            cost += s.totalCost;
+        }
+        return cost;
+    }
+protected:
+    virtual void bytesChanged(qint64 delta)
+    {
+        Q_UNUSED(delta)
+    }
+private:
+    void destroy(Shard &s, Node *n)
+    {
+        unlink(s, n);
+        s.nodes.remove(n->key);
+        s.totalCost -= n->cost;
+        s.totalBytes -= n->bytes;
+        bytesChanged(-n->bytes);
+        delete n;
+    }
+    static void link(Shard &s, Node *n)
+    {
+        n->previous = 0;
+        n->next = s.head;
+        if (s.head)
+            s.head->previous = n;
+        s.head = n;
+        if (!s.tail)
+            s.tail = n;
+    }
+    Shard &shard(const Key &key) const
+    {
+        return shards[qHash(key) % uint(ShardCount)];
+    }
+    int shardMaxCost() const
+    {
+        return (mmaxCost / ShardCount) + ((mmaxCost % ShardCount) ? 1 : 0);
+    }
+    void trim(Shard &s, int maxCost, Node *keep = 0)
+    {
+        while (s.tail && s.totalCost > maxCost) {
+            Node *n = s.tail;
+            if (n == keep && n == s.head)
+                break;
+            bool secondChance = (ClockPolicy == mpolicy && n->referenced.fetchAndStoreRelaxed(0));
+            if (n == keep || (secondChance && n != s.head)) {
+                unlink(s, n);
+                link(s, n);
+                continue;
+            }
+            destroy(s, n);
+            s.evictions += 1;
+        }
+    }
+    Node *victim(Shard &s, const T *keep)
+    {
+        int steps = 2 * s.nodes.size();
+        Node *n = s.tail;
+        while (n && steps-- > 0) {
+            bool secondChance = (ClockPolicy == mpolicy && n->referenced.fetchAndStoreRelaxed(0));
+            if (n->object.data() != keep && (!secondChance || n == s.head))
+                return n;
+            if (n == s.head)
+                return 0;
+            unlink(s, n);
+            link(s, n);
+            n = s.tail;
+        }
+        return 0;
+    }
+    static void unlink(Shard &s, Node *n)
+    {
+        if (n->previous)
+            n->previous->next = n->next;
+        else
+            s.head = n->next;
+        if (n->next)
+            n->next->previous = n->previous;
+        else
+            s.tail = n->previous;
+        n->previous = 0;
+        n->next = 0;
+    }
+private:
+    Q_DISABLE_COPY(ShardedCache)
+};
+
+#endif // OLOLORD_SHARDEDCACHE_H
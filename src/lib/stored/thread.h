@@ -201,6 +201,17 @@ struct OLOLORD_EXPORT PostCount
     int count;
 };
 
+PRAGMA_DB(view object(Post) object(Thread: Post::thread_))
+struct OLOLORD_EXPORT PostBoardNumberThreadNumber
+{
+    PRAGMA_DB(column(Post::board_))
+    QString board;
+    PRAGMA_DB(column(Post::number_))
+    quint64 number;
+    PRAGMA_DB(column(Thread::number_))
+    quint64 threadNumber;
+};
+
 PRAGMA_DB(view object(Post))
 struct OLOLORD_EXPORT PostId
 {
@@ -215,6 +226,16 @@ struct OLOLORD_EXPORT PostIdBoardRawText
     QString rawText;
 };
 
+PRAGMA_DB(view object(Post))
+struct OLOLORD_EXPORT PostIdBoardRawTextMarkup
+{
+    quint64 id;
+    QString board;
+    QString rawText;
+    bool extendedWakabaMarkEnabled;
+    bool bbCodeEnabled;
+};
+
 PRAGMA_DB(object table("postReferences"))
 class OLOLORD_EXPORT PostReference
 {
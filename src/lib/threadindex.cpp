@@ -0,0 +1,213 @@
+#include "threadindex.h"
+
+#include "database.h"
+#include "stored/thread.h"
+#include "stored/thread-odb.hxx"
+#include "tools.h"
+#include "transaction.h"
+
+#include <BeQt>
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QDebug>
+#include <QList>
+#include <QMap>
+#include <QReadLocker>
+#include <QReadWriteLock>
+#include <QSharedPointer>
+#include <QString>
+#include <QtAlgorithms>
+#include <QWriteLocker>
+
+#include <odb/database.hxx>
+#include <odb/exception.hxx>
+#include <odb/query.hxx>
+
+namespace ThreadIndex
+{
+
+struct BoardIndex
+{
+    ThreadInfoList threads;
+    DraftMap drafts;
+};
+
+typedef QMap<QString, BoardIndex> BoardMap;
+
+static BoardMap boards;
+static QReadWriteLock boardsLock(QReadWriteLock::Recursive);
+
+static bool threadInfoLessThan(const ThreadInfo &t1, const ThreadInfo &t2)
+{
+    if (t1.fixed != t2.fixed)
+        return t1.fixed;
+    if (t1.dateTime != t2.dateTime)
+        return t1.dateTime > t2.dateTime;
+    return t1.number > t2.number;
+}
+
+static int indexOf(const ThreadInfoList &list, quint64 threadNumber)
+{
+    foreach (int i, bRangeD(0, list.size() - 1)) {
+        if (list.at(i).number == threadNumber)
+            return i;
+    }
+    return -1;
+}
+
+static void insertSorted(ThreadInfoList &list, const ThreadInfo &info)
+{
+    ThreadInfoList::Iterator i = qLowerBound(list.begin(), list.end(), info, &threadInfoLessThan);
+    list.insert(i, info);
+}
+
+static bool load(const QString &boardName, BoardIndex &index)
+{
+    try {
+        Transaction t(Transaction::ReadOnlyMode);
+        if (!t)
+            return false;
+        odb::query<Thread> q = odb::query<Thread>::board == boardName && odb::query<Thread>::archived == false;
+        QList<Thread> threads = Database::query<Thread, Thread>(q);
+        foreach (const Thread &tt, threads) {
+            const Thread::Posts &posts = tt.posts();
+            if (posts.isEmpty())
+                continue;
+            QSharedPointer<Post> opPost = posts.first().load();
+            ThreadInfo info;
+            info.number = tt.number();
+            info.dateTime = tt.dateTime().toUTC();
+            info.fixed = tt.fixed();
+            info.draft = opPost->draft();
+            info.opHashpass = opPost->hashpass();
+            index.threads << info;
+            if (info.draft)
+                index.drafts.insert(info.number, info.opHashpass);
+        }
+    } catch (const odb::exception &e) {
+        Tools::log("ThreadIndex::load", e);
+        return false;
+    }
+    qSort(index.threads.begin(), index.threads.end(), &threadInfoLessThan);
+    return true;
+}
+
+void addPost(const QString &boardName, quint64 threadNumber, const QDateTime &dateTime, bool bump)
+{
+    if (boardName.isEmpty() || !threadNumber || !bump)
+        return;
+    QWriteLocker locker(&boardsLock);
+    BoardMap::Iterator it = boards.find(boardName);
+    if (boards.end() == it)
+        return;
+    int ind = indexOf(it->threads, threadNumber);
+    if (ind < 0)
+        return;
+    ThreadInfo info = it->threads.takeAt(ind);
+    info.dateTime = dateTime.toUTC();
+    insertSorted(it->threads, info);
+}
+
+void addThread(const QString &boardName, const ThreadInfo &info)
+{
+    if (boardName.isEmpty() || !info.number)
+        return;
+    QWriteLocker locker(&boardsLock);
+    BoardMap::Iterator it = boards.find(boardName);
+    if (boards.end() == it)
+        return;
+    int ind = indexOf(it->threads, info.number);
+    if (ind >= 0)
+        it->threads.removeAt(ind);
+    ThreadInfo ti = info;
+    ti.dateTime = ti.dateTime.toUTC();
+    insertSorted(it->threads, ti);
+    if (ti.draft)
+        it->drafts.insert(ti.number, ti.opHashpass);
+    else
+        it->drafts.remove(ti.number);
+}
+
+void clear(const QString &boardName)
+{
+    QWriteLocker locker(&boardsLock);
+    if (boardName.isEmpty())
+        boards.clear();
+    else
+        boards.remove(boardName);
+}
+
+void removeThread(const QString &boardName, quint64 threadNumber)
+{
+    if (boardName.isEmpty() || !threadNumber)
+        return;
+    QWriteLocker locker(&boardsLock);
+    BoardMap::Iterator it = boards.find(boardName);
+    if (boards.end() == it)
+        return;
+    int ind = indexOf(it->threads, threadNumber);
+    if (ind >= 0)
+        it->threads.removeAt(ind);
+    it->drafts.remove(threadNumber);
+}
+
+void setThreadDraft(const QString &boardName, quint64 threadNumber, bool draft)
+{
+    if (boardName.isEmpty() || !threadNumber)
+        return;
+    QWriteLocker locker(&boardsLock);
+    BoardMap::Iterator it = boards.find(boardName);
+    if (boards.end() == it)
+        return;
+    int ind = indexOf(it->threads, threadNumber);
+    if (ind < 0)
+        return;
+    ThreadInfo &info = it->threads[ind];
+    info.draft = draft;
+    if (draft)
+        it->drafts.insert(threadNumber, info.opHashpass);
+    else
+        it->drafts.remove(threadNumber);
+}
+
+void setThreadFixed(const QString &boardName, quint64 threadNumber, bool fixed)
+{
+    if (boardName.isEmpty() || !threadNumber)
+        return;
+    QWriteLocker locker(&boardsLock);
+    BoardMap::Iterator it = boards.find(boardName);
+    if (boards.end() == it)
+        return;
+    int ind = indexOf(it->threads, threadNumber);
+    if (ind < 0)
+        return;
+    ThreadInfo info = it->threads.takeAt(ind);
+    info.fixed = fixed;
+    insertSorted(it->threads, info);
+}
+
+ThreadInfoList threads(const QString &boardName, DraftMap *drafts, bool *ok)
+{
+    if (boardName.isEmpty())
+        return bRet(ok, false, ThreadInfoList());
+    QReadLocker rlocker(&boardsLock);
+    BoardMap::ConstIterator it = boards.constFind(boardName);
+    if (boards.constEnd() != it) {
+        bSet(drafts, it->drafts);
+        return bRet(ok, true, it->threads);
+    }
+    rlocker.unlock();
+    QWriteLocker locker(&boardsLock);
+    it = boards.constFind(boardName);
+    if (boards.constEnd() == it) {
+        BoardIndex index;
+        if (!load(boardName, index))
+            return bRet(ok, false, ThreadInfoList());
+        it = boards.insert(boardName, index);
+    }
+    bSet(drafts, it->drafts);
+    return bRet(ok, true, it->threads);
+}
+
+}
@@ -0,0 +1,37 @@
+#ifndef OLOLORD_THREADINDEX_H
+#define OLOLORD_THREADINDEX_H
+
+#include "global.h"
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QList>
+#include <QMap>
+#include <QString>
+
+namespace ThreadIndex
+{
+
+struct OLOLORD_EXPORT ThreadInfo
+{
+    quint64 number;
+    QDateTime dateTime;
+    bool fixed;
+    bool draft;
+    QByteArray opHashpass;
+};
+
+typedef QMap<quint64, QByteArray> DraftMap;
+typedef QList<ThreadInfo> ThreadInfoList;
+
+OLOLORD_EXPORT void addPost(const QString &boardName, quint64 threadNumber, const QDateTime &dateTime, bool bump);
+OLOLORD_EXPORT void addThread(const QString &boardName, const ThreadInfo &info);
+OLOLORD_EXPORT void clear(const QString &boardName = QString());
+OLOLORD_EXPORT void removeThread(const QString &boardName, quint64 threadNumber);
+OLOLORD_EXPORT void setThreadDraft(const QString &boardName, quint64 threadNumber, bool draft);
+OLOLORD_EXPORT void setThreadFixed(const QString &boardName, quint64 threadNumber, bool fixed);
+OLOLORD_EXPORT ThreadInfoList threads(const QString &boardName, DraftMap *drafts = 0, bool *ok = 0);
+
+}
+
+#endif // OLOLORD_THREADINDEX_H
@@ -7,6 +7,7 @@
 #include "controller/error.h"
 #include "controller/notfound.h"
 #include "database.h"
+#include "requestcontext.h"
 #include "settingslocker.h"
 #include "translator.h"
 
@@ -32,6 +33,7 @@
 #include <QRegExp>
 #include <QSet>
 #include <QSettings>
+#include <QSharedPointer>
 #include <QString>
 #include <QStringList>
 #include <QTemporaryFile>
@@ -42,12 +44,14 @@
 #include <QVariant>
 #include <QVariantList>
 #include <QVariantMap>
+#include <QVector>
 
 #if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
 #include <QMimeDatabase>
 #include <QMimeType>
 #endif
 
+#include <cppcms/http_context.h>
 #include <cppcms/http_cookie.h>
 #include <cppcms/http_file.h>
 #include <cppcms/http_request.h>
@@ -182,6 +186,91 @@ bool IpBanInfo::isValid() const
     return range.isValid();
 }
 
+IpRangeMap::IpRangeMap()
+{
+    //
+}
+
+IpRangeMap::IpRangeMap(const QList<IpBanInfo> &list)
+{
+    QList< QPair<IpRange, int> > l;
+    foreach (const IpBanInfo &inf, list)
+        l << qMakePair(inf.range, inf.level);
+    build(l);
+}
+
+IpRangeMap::IpRangeMap(const QList<IpRange> &list, int value)
+{
+    QList< QPair<IpRange, int> > l;
+    foreach (const IpRange &r, list)
+        l << qMakePair(r, value);
+    build(l);
+}
+
+bool IpRangeMap::contains(unsigned int ip) const
+{
+    if (!ip || starts.isEmpty())
+        return false;
+    QVector<unsigned int>::ConstIterator i = qUpperBound(starts.begin(), starts.end(), ip);
+    return (i != starts.begin()) && ip <= ends.at(i - starts.begin() - 1);
+}
+
+bool IpRangeMap::isEmpty() const
+{
+    return starts.isEmpty();
+}
+
+int IpRangeMap::size() const
+{
+    return starts.size();
+}
+
+int IpRangeMap::value(unsigned int ip, int defaultValue) const
+{
+    if (!ip || starts.isEmpty())
+        return defaultValue;
+    QVector<unsigned int>::ConstIterator i = qUpperBound(starts.begin(), starts.end(), ip);
+    if (i == starts.begin())
+        return defaultValue;
+    int ind = i - starts.begin() - 1;
+    return (ip <= ends.at(ind)) ? values.at(ind) : defaultValue;
+}
+
+void IpRangeMap::build(const QList< QPair<IpRange, int> > &list)
+{
+    //NOTE: Ranges may overlap; the one listed first wins, as it did with the linear scan
+    QMap< quint64, QList<int> > opened;
+    QMap< quint64, QList<int> > closed;
+    foreach (int i, bRangeD(0, list.size() - 1)) {
+        const IpRange &r = list.at(i).first;
+        if (!r.isValid() || r.start > r.end)
+            continue;
+        opened[r.start] << i;
+        closed[quint64(r.end) + 1] << i;
+        opened[quint64(r.end) + 1];
+    }
+    QMap<int, int> active;
+    for (QMap< quint64, QList<int> >::ConstIterator i = opened.begin(); i != opened.end(); ++i) {
+        foreach (int ind, closed.value(i.key()))
+            active.remove(ind);
+        foreach (int ind, i.value())
+            active.insert(ind, list.at(ind).second);
+        QMap< quint64, QList<int> >::ConstIterator next = i + 1;
+        if (active.isEmpty() || next == opened.end())
+            continue;
+        unsigned int start = i.key();
+        unsigned int end = next.key() - 1;
+        int v = active.begin().value();
+        if (!ends.isEmpty() && ends.last() + 1 == start && values.last() == v) {
+            ends.last() = end;
+        } else {
+            starts << start;
+            ends << end;
+            values << v;
+        }
+    }
+}
+
 static QMutex cityNameMutex(QMutex::Recursive);
 static QMutex countryCodeMutex(QMutex::Recursive);
 static QMutex countryNameMutex(QMutex::Recursive);
@@ -197,13 +286,93 @@ static QMap<QString, QElapsedTimer *> ddosWait;
 static QMutex ddosWaitMutex;
 static QElapsedTimer ddosWaitTimer;
 static bool ddosWaitTimerStarted = false;
-static QList<IpRange> loggingSkipIps;
+static const qint64 IpBansCheckInterval = 10 * BeQt::Second;
+static QSharedPointer<const IpRangeMap> ipBans;
+static QElapsedTimer ipBansCheckTimer;
+static QDateTime ipBansLastModified;
+static QMutex ipBansMutex;
+static QString ipBansPath;
+static QMutex ipBansReloadMutex;
+static QSharedPointer<const IpRangeMap> loggingSkipIps;
 static QMutex loggingSkipIpsMutex(QMutex::Recursive);
 static unsigned int renderThreads = 0;
 static QMutex renderThreadsMutex;
 static QMutex storagePathMutex(QMutex::Recursive);
 static QMutex timezoneMutex(QMutex::Recursive);
 
+static void acquireRenderThread()
+{
+    forever {
+        renderThreadsMutex.lock();
+        bool b = (renderThreads < SettingsLocker()->value("System/max_render_threads",
+                                                          QThread::idealThreadCount()).toUInt());
+        if (b)
+            ++renderThreads;
+        renderThreadsMutex.unlock();
+        if (b)
+            break;
+        BeQt::msleep(1);
+    }
+}
+
+static QString detectUserIp(const cppcms::http::request &req, bool *proxy)
+{
+    SettingsLocker s;
+    cppcms::http::request &r = *const_cast<cppcms::http::request *>(&req);
+    bSet(proxy, false);
+    if (s->value("System/Proxy/detect_real_ip", true).toBool()) {
+        QString ip = fromStd(r.getenv("HTTP_X_FORWARDED_FOR"));
+        bool ok = false;
+        ipNum(ip, &ok);
+        if (ok)
+            return bRet(proxy, true, ip);
+        ip = fromStd(r.getenv("HTTP_X_CLIENT_IP"));
+        ipNum(ip, &ok);
+        if (ok)
+            return bRet(proxy, true, ip);
+    }
+    if (s->value("System/use_x_real_ip", false).toBool())
+        return fromStd(r.getenv("HTTP_X_REAL_IP"));
+    else
+        return fromStd(r.remote_addr());
+}
+
+static int loadIpBans(bool force)
+{
+    QMutexLocker reloadLocker(&ipBansReloadMutex);
+    QString path = BDirTools::findResource("res/ip_ban.txt", BDirTools::UserOnly);
+    QDateTime lastModified = !path.isEmpty() ? QFileInfo(path).lastModified() : QDateTime();
+    QMutexLocker locker(&ipBansMutex);
+    if (!force && !ipBans.isNull() && path == ipBansPath && lastModified == ipBansLastModified)
+        return ipBans->size();
+    locker.unlock();
+    QList<IpBanInfo> list;
+    if (!path.isEmpty()) {
+        QStringList sl = BDirTools::readTextFile(path, "UTF-8").split(QRegExp("\\r?\\n+"),
+                                                                      QString::SkipEmptyParts);
+        foreach (const QString &s, sl) {
+            IpBanInfo inf(s.split(' '));
+            if (!inf.isValid())
+                continue;
+            list << inf;
+        }
+    }
+    QSharedPointer<const IpRangeMap> map(new IpRangeMap(list));
+    ipBansPath = path;
+    ipBansLastModified = lastModified;
+    locker.relock();
+    ipBans = map;
+    ipBansCheckTimer.start();
+    return map->size();
+}
+
+static void releaseRenderThread()
+{
+    renderThreadsMutex.lock();
+    --renderThreads;
+    renderThreadsMutex.unlock();
+}
+
 static QTime time(int msecs)
 {
     int h = msecs / BeQt::Hour;
@@ -251,6 +420,11 @@ AudioTags audioTags(const QString &fileName)
     return a;
 }
 
+QString cacheHotKeysFile()
+{
+    return BCoreApplication::location("storage", BCoreApplication::UserResource) + "/cache-hot-keys.dat";
+}
+
 QString captchaQuotaFile()
 {
     return BCoreApplication::location("storage", BCoreApplication::UserResource) + "/captcha-quota.dat";
@@ -273,7 +447,7 @@ QString cookieValue(const cppcms::http::request &req, const QString &name)
 
 QString customContent(const QString &prefix, const QLocale &l)
 {
-    QString *s = Cache::customContent(prefix, l);
+    QSharedPointer<QString> s = Cache::customContent(prefix, l);
     if (!s) {
         QString path = BDirTools::findResource("custom/" + prefix, BDirTools::UserOnly);
         if (path.isEmpty())
@@ -281,19 +455,15 @@ QString customContent(const QString &prefix, const QLocale &l)
         QString fn = BDirTools::localeBasedFileName(path + "/content.html", l);
         if (fn.isEmpty())
             return QString();
-        s = new QString(BDirTools::readTextFile(fn, "UTF-8"));
-        if (!Cache::cacheCustomContent(prefix, l, s)) {
-            QString ss = *s;
-            delete s;
-            return ss;
-        }
+        s = QSharedPointer<QString>(new QString(BDirTools::readTextFile(fn, "UTF-8")));
+        Cache::cacheCustomContent(prefix, l, s);
     }
     return *s;
 }
 
 QList<CustomLinkInfo> customLinks(const QLocale &l)
 {
-    QList<CustomLinkInfo> *list = Cache::customLinks(l);
+    QSharedPointer< QList<CustomLinkInfo> > list = Cache::customLinks(l);
     if (!list) {
         QString path = BDirTools::findResource("res", BDirTools::UserOnly);
         if (path.isEmpty())
@@ -301,7 +471,7 @@ QList<CustomLinkInfo> customLinks(const QLocale &l)
         QString fn = BDirTools::localeBasedFileName(path + "/custom_links.txt", l);
         if (fn.isEmpty())
             return QList<CustomLinkInfo>();
-        list = new QList<CustomLinkInfo>;
+        list = QSharedPointer< QList<CustomLinkInfo> >(new QList<CustomLinkInfo>);
         QStringList sl = BDirTools::readTextFile(fn, "UTF-8").split(QRegExp("\\r?\\n+"), QString::KeepEmptyParts);
         foreach (const QString &s, sl) {
             QStringList sll = BTextTools::splitCommand(s);
@@ -318,11 +488,7 @@ QList<CustomLinkInfo> customLinks(const QLocale &l)
                 info.target = sll.at(3);
             *list << info;
         }
-        if (!Cache::cacheCustomLinks(l, list)) {
-            QList<CustomLinkInfo> llist = *list;
-            delete list;
-            return llist;
-        }
+        Cache::cacheCustomLinks(l, list);
     }
     return *list;
 }
@@ -484,7 +650,15 @@ GetParameters getParameters(const cppcms::http::request &request)
 
 QByteArray hashpass(const cppcms::http::request &req)
 {
-    return toHashpass(hashpassString(req));
+    RequestContext *c = RequestContext::current(req);
+    if (c && c->lookup(RequestContext::HashpassValue))
+        return c->hashpass;
+    QByteArray hp = toHashpass(hashpassString(req));
+    if (c) {
+        c->hashpass = hp;
+        c->store(RequestContext::HashpassValue);
+    }
+    return hp;
 }
 
 QString hashpassString(const cppcms::http::request &req)
@@ -495,41 +669,33 @@ QString hashpassString(const cppcms::http::request &req)
 int ipBanLevel(const QString &ip)
 {
     bool ok = false;
-    int n = ipNum(ip, &ok);
+    unsigned int n = ipNum(ip, &ok);
     if (!ok)
         return 0;
-    Cache::IpBanInfoList *list = Cache::ipBanInfoList();
-    int level = 0;
-    if (!list) {
-        QString path = BDirTools::findResource("res/ip_ban.txt", BDirTools::UserOnly);
-        if (path.isEmpty())
-            return 0;
-        QStringList sl = BDirTools::readTextFile(path, "UTF-8").split(QRegExp("\\r?\\n+"), QString::SkipEmptyParts);
-        list = new Cache::IpBanInfoList;
-        foreach (const QString &s, sl) {
-            IpBanInfo inf(s.split(' '));
-            if (!inf.isValid())
-                continue;
-            if (inf.range.in(n))
-                level = inf.level;
-            *list << inf;
-        }
-        if (!Cache::cacheIpBanInfoList(list))
-            delete list;
-    } else {
-        foreach (const IpBanInfo &inf, *list) {
-            if (inf.range.in(n)) {
-                level = inf.level;
-                break;
-            }
-        }
-    }
-    return level;
+    QMutexLocker locker(&ipBansMutex);
+    bool check = ipBans.isNull() || ipBansCheckTimer.elapsed() >= IpBansCheckInterval;
+    if (check)
+        ipBansCheckTimer.start();
+    locker.unlock();
+    if (check)
+        loadIpBans(false);
+    locker.relock();
+    QSharedPointer<const IpRangeMap> map = ipBans;
+    locker.unlock();
+    return map->value(n);
 }
 
 int ipBanLevel(const cppcms::http::request &req)
 {
-    return ipBanLevel(userIp(req));
+    RequestContext *c = RequestContext::current(req);
+    if (c && c->lookup(RequestContext::IpBanLevelValue))
+        return c->ipBanLevel;
+    int lvl = ipBanLevel(userIp(req));
+    if (c) {
+        c->ipBanLevel = lvl;
+        c->store(RequestContext::IpBanLevelValue);
+    }
+    return lvl;
 }
 
 bool isAudioType(const QString &mimeType)
@@ -683,9 +849,16 @@ QDateTime localDateTime(const QDateTime &dt, int offsetMinutes)
 
 QLocale locale(const cppcms::http::request &req, const QLocale &defaultLocale)
 {
+    RequestContext *c = RequestContext::current(req);
+    if (c && c->lookup(RequestContext::LocaleValue))
+        return (QLocale::c() == c->locale) ? defaultLocale : c->locale;
     QLocale l(cookieValue(req, "locale"));
     if (QLocale::c() == l)
         l = QLocale(Database::geolocationInfo(req).countryCode);
+    if (c) {
+        c->locale = l;
+        c->store(RequestContext::LocaleValue);
+    }
     return (QLocale::c() == l) ? defaultLocale : l;
 }
 
@@ -699,13 +872,11 @@ void log(const cppcms::http::request &req, const QString &action, const QString
     do_once(init)
         resetLoggingSkipIps();
     QString ip = userIp(req);
-    int n = ipNum(ip);
     QMutexLocker locker(&loggingSkipIpsMutex);
-    foreach (const IpRange &r, loggingSkipIps) {
-        if (r.in(n))
-            return;
-    }
+    QSharedPointer<const IpRangeMap> skip = loggingSkipIps;
     locker.unlock();
+    if (!skip.isNull() && skip->contains(ipNum(ip)))
+        return;
     bLog("[" + ip + "] [" + action + "] [" + state + "]" + (!target.isEmpty() ? (" " + target) : QString()));
 }
 
@@ -787,7 +958,7 @@ QString mimeType(const QByteArray &data, bool *ok)
 
 QStringList news(const QLocale &l)
 {
-    QStringList *sl = Cache::news(l);
+    QSharedPointer<QStringList> sl = Cache::news(l);
     if (!sl) {
         QString path = BDirTools::findResource("news", BDirTools::UserOnly);
         if (path.isEmpty())
@@ -795,12 +966,9 @@ QStringList news(const QLocale &l)
         QString fn = BDirTools::localeBasedFileName(path + "/news.txt", l);
         if (fn.isEmpty())
             return QStringList();
-        sl = new QStringList(BDirTools::readTextFile(fn, "UTF-8").split(QRegExp("\\r?\\n+"), QString::SkipEmptyParts));
-        if (!Cache::cacheNews(l, sl)) {
-            QStringList sll = *sl;
-            delete sl;
-            return sll;
-        }
+        sl = QSharedPointer<QStringList>(new QStringList(BDirTools::readTextFile(fn, "UTF-8").split(
+                                             QRegExp("\\r?\\n+"), QString::SkipEmptyParts)));
+        Cache::cacheNews(l, sl);
     }
     return *sl;
 }
@@ -915,40 +1083,49 @@ void redirect(cppcms::application &app, const QString &path)
 
 void render(cppcms::application &app, const QString &templateName, cppcms::base_content &content)
 {
-    forever {
-        renderThreadsMutex.lock();
-        bool b = (renderThreads < SettingsLocker()->value("System/max_render_threads",
-                                                          QThread::idealThreadCount()).toUInt());
-        if (b)
-            ++renderThreads;
-        renderThreadsMutex.unlock();
-        if (b)
-            break;
-        BeQt::msleep(1);
-    }
+    acquireRenderThread();
     app.render(toStd(templateName), content);
-    renderThreadsMutex.lock();
-    --renderThreads;
-    renderThreadsMutex.unlock();
+    releaseRenderThread();
+}
+
+void render(cppcms::application &app, const QString &templateName, cppcms::base_content &content,
+            std::ostream &out)
+{
+    out.imbue(app.context().locale());
+    acquireRenderThread();
+    app.render(toStd(templateName), out, content);
+    releaseRenderThread();
+}
+
+int reloadIpBans()
+{
+    return loadIpBans(true);
+}
+
+QString rerenderCheckpointFile()
+{
+    return BCoreApplication::location("storage", BCoreApplication::UserResource) + "/rerender-checkpoint.dat";
 }
 
 void resetLoggingSkipIps()
 {
     QStringList list = SettingsLocker()->value("System/logging_skip_ip").toString().split(QRegExp("\\,\\s*"),
                                                                                           QString::SkipEmptyParts);
-    QMutexLocker locker(&loggingSkipIpsMutex);
-    loggingSkipIps.clear();
+    QList<IpRange> ranges;
     foreach (const QString &s, list) {
         IpRange r(s);
         if (!r.isValid())
             continue;
-        loggingSkipIps << r;
+        ranges << r;
     }
+    QSharedPointer<const IpRangeMap> map(new IpRangeMap(ranges));
+    QMutexLocker locker(&loggingSkipIpsMutex);
+    loggingSkipIps = map;
 }
 
 QStringList rules(const QString &prefix, const QLocale &l)
 {
-    QStringList *sl = Cache::rules(l, prefix);
+    QSharedPointer<QStringList> sl = Cache::rules(l, prefix);
     if (!sl) {
         QString path = BDirTools::findResource(prefix, BDirTools::UserOnly);
         if (path.isEmpty())
@@ -956,12 +1133,9 @@ QStringList rules(const QString &prefix, const QLocale &l)
         QString fn = BDirTools::localeBasedFileName(path + "/rules.txt", l);
         if (fn.isEmpty())
             return QStringList();
-        sl = new QStringList(BDirTools::readTextFile(fn, "UTF-8").split(QRegExp("\\r?\\n+"), QString::SkipEmptyParts));
-        if (!Cache::cacheRules(prefix, l, sl)) {
-            QStringList sll = *sl;
-            delete sl;
-            return sll;
-        }
+        sl = QSharedPointer<QStringList>(new QStringList(BDirTools::readTextFile(fn, "UTF-8").split(
+                                             QRegExp("\\r?\\n+"), QString::SkipEmptyParts)));
+        Cache::cacheRules(prefix, l, sl);
     }
     return *sl;
 }
@@ -971,15 +1145,20 @@ QString searchIndexFile()
     return BCoreApplication::location("storage", BCoreApplication::UserResource) + "/search-index.dat";
 }
 
+QString searchIndexPath()
+{
+    return BCoreApplication::location("storage", BCoreApplication::UserResource) + "/search-index";
+}
+
 FriendList siteFriends()
 {
-    FriendList *list = Cache::friendList();
+    QSharedPointer<FriendList> list = Cache::friendList();
     if (!list) {
         QString path = BDirTools::findResource("res/friends.txt", BDirTools::UserOnly);
         if (path.isEmpty())
             return FriendList();
         QStringList sl = BDirTools::readTextFile(path, "UTF-8").split(QRegExp("\\r?\\n+"), QString::SkipEmptyParts);
-        list = new FriendList;
+        list = QSharedPointer<FriendList>(new FriendList);
         foreach (const QString &s, sl) {
             bool ok = false;
             QStringList sll = BTextTools::splitCommand(s, &ok);
@@ -994,11 +1173,7 @@ FriendList siteFriends()
                 continue;
             *list << f;
         }
-        if (!Cache::cacheFriendList(list)) {
-            FriendList llist = *list;
-            delete list;
-            return llist;
-        }
+        Cache::cacheFriendList(list);
     }
     return *list;
 }
@@ -1164,24 +1339,17 @@ QString toString(const QByteArray &hp, bool *ok)
 
 QString userIp(const cppcms::http::request &req, bool *proxy)
 {
-    SettingsLocker s;
-    cppcms::http::request &r = *const_cast<cppcms::http::request *>(&req);
-    bSet(proxy, false);
-    if (s->value("System/Proxy/detect_real_ip", true).toBool()) {
-        QString ip = fromStd(r.getenv("HTTP_X_FORWARDED_FOR"));
-        bool ok = false;
-        ipNum(ip, &ok);
-        if (ok)
-            return bRet(proxy, true, ip);
-        ip = fromStd(r.getenv("HTTP_X_CLIENT_IP"));
-        ipNum(ip, &ok);
-        if (ok)
-            return bRet(proxy, true, ip);
+    RequestContext *c = RequestContext::current(req);
+    if (c && c->lookup(RequestContext::UserIpValue))
+        return bRet(proxy, c->userIpProxy, c->userIp);
+    bool p = false;
+    QString ip = detectUserIp(req, &p);
+    if (c) {
+        c->userIp = ip;
+        c->userIpProxy = p;
+        c->store(RequestContext::UserIpValue);
     }
-    if (s->value("System/use_x_real_ip", false).toBool())
-        return fromStd(r.getenv("HTTP_X_REAL_IP"));
-    else
-        return fromStd(r.remote_addr());
+    return bRet(proxy, p, ip);
 }
 
 }
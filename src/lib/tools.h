@@ -35,13 +35,16 @@ class locale;
 #include <QImage>
 #include <QList>
 #include <QMap>
+#include <QPair>
 #include <QString>
 #include <QStringList>
 #include <QVariant>
+#include <QVector>
 
 #include <cppcms/json.h>
 
 #include <list>
+#include <ostream>
 #include <string>
 
 #define DDOS_A(weight) if (!Tools::ddosTest(application, (weight))) \
@@ -124,6 +127,25 @@ public:
     bool isValid() const;
 };
 
+class OLOLORD_EXPORT IpRangeMap
+{
+private:
+    QVector<unsigned int> starts;
+    QVector<unsigned int> ends;
+    QVector<int> values;
+public:
+    explicit IpRangeMap();
+    explicit IpRangeMap(const QList<IpBanInfo> &list);
+    explicit IpRangeMap(const QList<IpRange> &list, int value = 1);
+public:
+    bool contains(unsigned int ip) const;
+    bool isEmpty() const;
+    int size() const;
+    int value(unsigned int ip, int defaultValue = 0) const;
+private:
+    void build(const QList< QPair<IpRange, int> > &list);
+};
+
 struct OLOLORD_EXPORT IsMobile
 {
     struct {
@@ -196,6 +218,7 @@ const QString InputDateTimeFormat = "dd.MM.yyyy:hh";
 
 OLOLORD_EXPORT QStringList acceptedExternalBoards();
 OLOLORD_EXPORT AudioTags audioTags(const QString &fileName);
+OLOLORD_EXPORT QString cacheHotKeysFile();
 OLOLORD_EXPORT QString captchaQuotaFile();
 OLOLORD_EXPORT bool captchaEnabled(const QString &boardName);
 OLOLORD_EXPORT QString cookieValue(const cppcms::http::request &req, const QString &name);
@@ -239,10 +262,15 @@ OLOLORD_EXPORT FileList postFiles(const cppcms::http::request &request, const Po
 OLOLORD_EXPORT PostParameters postParameters(const cppcms::http::request &request);
 OLOLORD_EXPORT cppcms::json::value readJsonValue(const QString &fileName, bool *ok = 0);
 OLOLORD_EXPORT void render(cppcms::application &app, const QString &templateName, cppcms::base_content &content);
+OLOLORD_EXPORT void render(cppcms::application &app, const QString &templateName, cppcms::base_content &content,
+                           std::ostream &out);
 OLOLORD_EXPORT void redirect(cppcms::application &app, const QString &path = QString());
+OLOLORD_EXPORT int reloadIpBans();
+OLOLORD_EXPORT QString rerenderCheckpointFile();
 OLOLORD_EXPORT void resetLoggingSkipIps();
 OLOLORD_EXPORT QStringList rules(const QString &prefix, const QLocale &l);
 OLOLORD_EXPORT QString searchIndexFile();
+OLOLORD_EXPORT QString searchIndexPath();
 OLOLORD_EXPORT FriendList siteFriends();
 OLOLORD_EXPORT QString storagePath();
 OLOLORD_EXPORT QStringList supportedCodeLanguages();
@@ -1,37 +1,135 @@
 #include "transaction.h"
 
+#include "settingslocker.h"
 #include "tools.h"
 
 #include <BDirTools>
+#include <BLogger>
 
 #include <QDebug>
 #include <QMap>
+#include <QMutex>
+#include <QMutexLocker>
 #include <QScopedPointer>
+#include <QSettings>
 #include <QString>
 
 #include <odb/database.hxx>
 #include <odb/exception.hxx>
 #include <odb/schema-catalog.hxx>
 #include <odb/sqlite/connection.hxx>
+#include <odb/sqlite/connection-factory.hxx>
 #include <odb/sqlite/database.hxx>
 #include <odb/transaction.hxx>
 
 #include <exception>
+#include <memory>
 
 class Hack : public odb::transaction
 {
 public:
     int counter;
+    const bool ReadOnly;
 public:
-    explicit Hack(odb::transaction_impl *impl) :
-        odb::transaction(impl)
+    explicit Hack(odb::transaction_impl *impl, bool readOnly) :
+        odb::transaction(impl), ReadOnly(readOnly)
     {
         counter = 1;
     }
 };
 
+class ConnectionFactory : public odb::sqlite::connection_pool_factory
+{
+public:
+    const bool ReadOnly;
+    const bool WalEnabled;
+public:
+    explicit ConnectionFactory(std::size_t maxConnections, std::size_t minConnections, bool readOnly,
+                               bool walEnabled) :
+        odb::sqlite::connection_pool_factory(maxConnections, minConnections), ReadOnly(readOnly),
+        WalEnabled(walEnabled)
+    {
+        //
+    }
+protected:
+    pooled_connection_ptr create();
+};
+
+static QMutex poolMutex(QMutex::Recursive);
+static odb::sqlite::database *pooledDatabase = 0;
+static odb::sqlite::database *pooledReadOnlyDatabase = 0;
+static bool walEnabled = false;
+static quint64 connectionCount = 0;
+static quint64 readOnlyConnectionCount = 0;
+static quint64 transactionCount = 0;
+static quint64 readOnlyTransactionCount = 0;
+
+ConnectionFactory::pooled_connection_ptr ConnectionFactory::create()
+{
+    pooled_connection_ptr c = odb::sqlite::connection_pool_factory::create();
+    c->execute("PRAGMA busy_timeout = 30000;"); //30 seconds
+    if (WalEnabled && !ReadOnly) {
+        c->execute("PRAGMA journal_mode = WAL;");
+        c->execute("PRAGMA synchronous = NORMAL;");
+    }
+    QMutexLocker locker(&poolMutex);
+    if (ReadOnly)
+        ++readOnlyConnectionCount;
+    else
+        ++connectionCount;
+    return c;
+}
+
+static odb::sqlite::database *sharedDatabase(bool readOnly)
+{
+    QMutexLocker locker(&poolMutex);
+    if (readOnly && pooledReadOnlyDatabase) {
+        ++readOnlyTransactionCount;
+        return pooledReadOnlyDatabase;
+    }
+    if (pooledDatabase && (!readOnly || !walEnabled)) {
+        ++transactionCount;
+        return pooledDatabase;
+    }
+    QString storagePath = Tools::storagePath();
+    if (storagePath.isEmpty())
+        return 0;
+    QString fileName = storagePath + "/db.sqlite";
+    if (!BDirTools::touch(fileName))
+        return 0;
+    SettingsLocker s;
+    std::size_t maxConnections = s->value("Database/max_connections", 0).toUInt();
+    std::size_t minConnections = s->value("Database/min_connections", 0).toUInt();
+    if (!pooledDatabase) {
+        walEnabled = s->value("Database/wal_enabled", false).toBool();
+        std::auto_ptr<odb::sqlite::connection_factory> f(new ConnectionFactory(maxConnections, minConnections, false,
+                                                                               walEnabled));
+        pooledDatabase = new odb::sqlite::database(Tools::toStd(fileName), SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE
+                                                   | SQLITE_OPEN_PRIVATECACHE, true, "", f);
+        //NOTE: Switching to WAL must happen before any read-only connection is opened
+        pooledDatabase->connection();
+    }
+    if (!readOnly || !walEnabled) {
+        ++transactionCount;
+        return pooledDatabase;
+    }
+    std::auto_ptr<odb::sqlite::connection_factory> f(new ConnectionFactory(maxConnections, minConnections, true,
+                                                                           walEnabled));
+    pooledReadOnlyDatabase = new odb::sqlite::database(Tools::toStd(fileName),
+                                                       SQLITE_OPEN_READONLY | SQLITE_OPEN_PRIVATECACHE, true, "", f);
+    ++readOnlyTransactionCount;
+    return pooledReadOnlyDatabase;
+}
+
 Transaction::Transaction(bool commitOnDestruction) :
-    CommitOnDestruction(commitOnDestruction)
+    CommitOnDestruction(commitOnDestruction), TransactionMode(ReadWriteMode)
+{
+    finalized = true;
+    reset();
+}
+
+Transaction::Transaction(Mode mode, bool commitOnDestruction) :
+    CommitOnDestruction(commitOnDestruction), TransactionMode(mode)
 {
     finalized = true;
     reset();
@@ -45,6 +143,27 @@ Transaction::~Transaction()
         rollback();
 }
 
+void Transaction::closeConnections()
+{
+    QMutexLocker locker(&poolMutex);
+    delete pooledReadOnlyDatabase;
+    pooledReadOnlyDatabase = 0;
+    delete pooledDatabase;
+    pooledDatabase = 0;
+}
+
+Transaction::ConnectionPoolInfo Transaction::connectionPoolInfo()
+{
+    QMutexLocker locker(&poolMutex);
+    ConnectionPoolInfo info;
+    info.connectionCount = connectionCount;
+    info.readOnlyConnectionCount = readOnlyConnectionCount;
+    info.readOnlyTransactionCount = readOnlyTransactionCount;
+    info.transactionCount = transactionCount;
+    info.walEnabled = walEnabled;
+    return info;
+}
+
 void Transaction::commit()
 {
     if (finalized)
@@ -55,15 +174,12 @@ void Transaction::commit()
         if (h->counter > 1) {
             h->counter -= 1;
         } else {
-            odb::database *db = &h->database();
             try {
                 h->commit();
                 delete h;
-                delete db;
             } catch (const odb::timeout &e) {
                 Tools::log("Transaction::commit", e);
                 delete h;
-                delete db;
                 throw e;
             }
         }
@@ -89,19 +205,22 @@ void Transaction::reset()
     if (!finalized)
         return;
     if (odb::transaction::has_current()) {
-        reinterpret_cast<Hack *>(&odb::transaction::current())->counter += 1;
-    } else {
-        QString storagePath = Tools::storagePath();
-        if (storagePath.isEmpty())
-            return;
-        QString fileName = storagePath + "/db.sqlite";
-        if (!BDirTools::touch(fileName))
+        Hack *h = reinterpret_cast<Hack *>(&odb::transaction::current());
+        if (h->ReadOnly && ReadOnlyMode != TransactionMode) {
+            //NOTE: The nested transaction joins the outer one, so its writes would fail on a read-only connection
+            bLog("[Transaction::reset] Writable transaction nested inside a read-only one");
             return;
+        }
+        h->counter += 1;
+    } else {
         try {
-            odb::sqlite::database *db = new odb::sqlite::database(Tools::toStd(fileName),
-                                                                  SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
-            new Hack(db->begin());
-            db->execute("PRAGMA busy_timeout = 30000;"); //30 seconds
+            odb::sqlite::database *db = sharedDatabase(ReadOnlyMode == TransactionMode);
+            if (!db)
+                return;
+            if (WriteMode == TransactionMode)
+                new Hack(db->begin_immediate(), false);
+            else
+                new Hack(db->begin(), ReadOnlyMode == TransactionMode);
         } catch (const odb::exception &e) {
             Tools::log("Transaction::reset", e);
             return;
@@ -120,15 +239,12 @@ void Transaction::rollback()
         if (h->counter > 1) {
             h->counter -= 1;
         } else {
-            odb::database *db = &h->database();
             try {
                 h->rollback();
                 delete h;
-                delete db;
             } catch (const odb::timeout &e) {
                 Tools::log("Transaction::rollback", e);
                 delete h;
-                delete db;
                 throw e;
             }
         }
@@ -150,5 +266,5 @@ Transaction::operator odb::database *() const
 
 Transaction::operator bool() const
 {
-    return db();
+    return !finalized && db();
 }
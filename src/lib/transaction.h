@@ -12,13 +12,34 @@ class database;
 
 class OLOLORD_EXPORT Transaction
 {
+public:
+    enum Mode
+    {
+        ReadWriteMode = 0,
+        ReadOnlyMode,
+        WriteMode
+    };
+public:
+    struct OLOLORD_EXPORT ConnectionPoolInfo
+    {
+        quint64 connectionCount;
+        quint64 readOnlyConnectionCount;
+        quint64 readOnlyTransactionCount;
+        quint64 transactionCount;
+        bool walEnabled;
+    };
 public:
     const bool CommitOnDestruction;
+    const Mode TransactionMode;
 private:
     bool finalized;
 public:
     explicit Transaction(bool commitOnDestruction = false);
+    explicit Transaction(Mode mode, bool commitOnDestruction = false);
     ~Transaction();
+public:
+    static void closeConnections();
+    static ConnectionPoolInfo connectionPoolInfo();
 public:
     void commit();
     odb::database *db() const;
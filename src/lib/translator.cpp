@@ -5,10 +5,12 @@
 
 #include <BTranslator>
 
+#include <QList>
 #include <QLocale>
 #include <QMutex>
 #include <QMutexLocker>
 #include <QSet>
+#include <QSharedPointer>
 #include <QString>
 
 #include <cppcms/http_request.h>
@@ -26,16 +28,16 @@ static QString translateInternal(const char *context, const char *sourceText, co
 {
     QString src = QString::fromLatin1(sourceText);
     QMutexLocker locker(&translatorMutex);
-    foreach (const QString &name, translatorNames.values()) {
-        BTranslator *t = Cache::translator(name, l);
+    QList<QString> names = translatorNames.values();
+    locker.unlock();
+    foreach (const QString &name, names) {
+        Cache::LoadLock loadLock;
+        QSharedPointer<BTranslator> t = Cache::translator(name, l, &loadLock);
         if (!t) {
-            t = new BTranslator(l, name);
-            if (t->load()) {
-                if (!Cache::cacheTranslator(name, l, t)) {
-                    delete t;
-                    t = 0;
-                }
-            }
+            t = QSharedPointer<BTranslator>(new BTranslator(l, name));
+            if (!t->load() || !Cache::cacheTranslator(name, l, t))
+                t.clear();
+            loadLock.unlock();
         }
         QString s = t ? t->translate(context, sourceText, disambiguation, n) : src;
         if (!s.isEmpty() && s != src)